@@ -24,6 +24,24 @@ cl.exe /W3 ^
              /DEBUG ^
              /SUBSYSTEM:CONSOLE
 SET build_result=%errorlevel%
+if %build_result% NEQ 0 goto :built
+cl.exe /W3 ^
+       /std:c++17 ^
+       /Os ^
+       /Oi %= enable intrinsics =% ^
+       /GL %= enable link time optimization =% ^
+       /GS- %= disable stack overflow security checks =% ^
+       /nologo ^
+       /Fe:"profitDrainBench" %= set executable name =% ^
+       /I "../../sysroot/include/" %= set include search path =% ^
+       /I "../code/public/include/profitDrain/" %= set include search path =% ^
+       /I "../code/private/include/profitDrain/" %= set include search path =% ^
+       "../code/src/resistance_is_measurable.cpp" ^
+       /link /LIBPATH:"../../sysroot/lib/" %= Search path for libraries =% ^
+             /DEBUG ^
+             /SUBSYSTEM:CONSOLE
+SET build_result=%errorlevel%
+:built
 
 copy /Y "..\code\public\include\*" "../../sysroot/include/"
 copy /Y ".\profitDrain.exe" "../../sysroot/bin/"
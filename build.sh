@@ -8,6 +8,7 @@ clang++  -Wall \
          -g \
          -O2 \
          -fno-exceptions \
+         -pthread \
          --std=c++17 \
          -I"../../sysroot/include/" \
          -I"../code/public/include/profitDrain/" \
@@ -17,6 +18,22 @@ clang++  -Wall \
          "../code/src/resistance_is_futile.cpp";
 build_result=$?;
 
+if [ ${build_result} -eq 0 ]; then
+    clang++  -Wall \
+             -g \
+             -O2 \
+             -fno-exceptions \
+             -pthread \
+             --std=c++17 \
+             -I"../../sysroot/include/" \
+             -I"../code/public/include/profitDrain/" \
+             -I"../code/private/include/profitDrain/" \
+             -L"../../sysroot/lib/" \
+             -o "profitDrainBench" \
+             "../code/src/resistance_is_measurable.cpp";
+    build_result=$?;
+fi
+
 cp "./profitDrain" "../../sysroot/bin/";
 
 popd;
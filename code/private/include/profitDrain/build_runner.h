@@ -0,0 +1,51 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef BUILD_RUNNER_H
+#define BUILD_RUNNER_H
+
+#include "build_timer_db.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pdrain
+{
+struct BuildRunResult
+{
+    int64_t duration;    // Monotonic clock, milliseconds
+    int exitCode;        // 128 + signal number if the command was killed by a signal
+    DbUsageRecord usage; // Resources used by the command and every process it started, the build id is not set
+};
+
+// Runs the command as a child process and waits for it. Interrupt and termination signals received meanwhile are
+// forwarded to the child. The resource usage is collected when the child is reaped.
+int runBuild(const std::vector<std::string>& command, BuildRunResult& result);
+} // namespace pdrain
+
+#endif
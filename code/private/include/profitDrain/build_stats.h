@@ -0,0 +1,222 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef BUILD_STATS_H
+#define BUILD_STATS_H
+
+#include "build_timer_db.h"
+#include "duration_histogram.h"
+#include "string_interner.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pdrain
+{
+const int64_t millisecondsPerHour = 60 * 60 * 1000;
+const int64_t millisecondsPerDay = 24 * millisecondsPerHour;
+
+// Width of the columns of the stat graphs. Weeks start on Monday, months on the 1st, both in UTC.
+enum class GraphBucket : uint8_t
+{
+    HOUR,
+    DAY,
+    WEEK,
+    MONTH
+};
+
+// Per hour buckets of the graphs, the columns of every width are summed up from them. Bucket i holds the successful
+// builds started i hours before lastHour, the buckets reach back to the start of the first column.
+struct BuildGraphData
+{
+    std::vector<int64_t> totalBuildTimes;
+    std::vector<int64_t> buildCounts;
+    int64_t lastHour; // The last hour of the last column, hours since epoch (UTC)
+    int64_t lastStart; // Start of the latest successful build, in the buckets or after them
+    GraphBucket bucket;
+    int width; // Number of columns
+};
+
+// A column of the graphs, the successful builds started in [start, end).
+struct GraphColumn
+{
+    int64_t start; // Milliseconds since epoch
+    int64_t end;
+    int64_t totalBuildTime;
+    int64_t buildCount;
+};
+
+// Everything the aggregation has to remember about the records seen so far, to be able to pair the next one.
+// Records with a build id are paired through openBuilds, no matter what was recorded between them. Records without
+// one (legacy databases, builds recorded without an id) are paired with their neighbour.
+struct OpenBuild
+{
+    int64_t startTimestamp;
+    uint32_t group; // Only set when grouping
+};
+
+// A record of a part of the database that can only be paired once the parts before it are known, see stitchBuildStats.
+struct DeferredRecord
+{
+    enum Kind : uint8_t
+    {
+        FIRST_STOP, // The first record of the part, a STOP without an id: it may stop the last START of the part before
+        NEIGHBOUR,  // The first two records without an id paired with their neighbour
+        ORPHAN_STOP // A STOP with an id whose START is not in the part
+    };
+    RecordView record;
+    size_t position;
+    Kind kind;
+};
+
+struct PairingState
+{
+    size_t recordCount;
+    Operation previousOperation;
+    int64_t previousTimestamp;
+    uint32_t previousGroup;
+    bool pendingStart; // Previous record is a START, it counts as a failed build unless a STOP follows.
+    std::unordered_map<uint64_t, OpenBuild> openBuilds; // Build id -> START
+    uint64_t lastStartedBuildId; // Id of the previous record if it is a START with an id, otherwise 0
+
+    // A part of the database read on its own starts without knowing what was before it. The records that depend on
+    // that are deferred until it is known, the rest is paired as usual.
+    bool chunked;
+    bool lastStartedKnown;
+    size_t position; // Reader position after the record being aggregated, orders the builds of the parts
+    std::vector<DeferredRecord> deferred;
+};
+
+// Builds grouped by their note, or by the value of a key=value tag in it.
+struct BuildGroupStats
+{
+    size_t buildCount;
+    size_t successfulBuildCount;
+    size_t totalBuildTime; // Successful builds
+    size_t maxBuildTime;
+};
+
+// A build paired with its STOP, for the operations that look at the builds one by one.
+struct FinishedBuild
+{
+    int64_t startTimestamp;
+    int64_t stopTimestamp;
+    int32_t exitCode;
+    uint32_t group; // Only set when grouping
+};
+
+// The spans of a phase of the builds: the spans with the same name, nested in the spans of the same names.
+struct PhaseStats
+{
+    std::string path; // Names of the enclosing spans and of the span, separated by '/'
+    size_t spanCount;
+    int64_t totalTime; // Milliseconds
+    DurationHistogram histogram;
+};
+
+// Sums of the usage records of the builds that have one.
+struct ResourceUsageStats
+{
+    size_t buildCount;
+    int64_t wallTime; // Milliseconds
+    int64_t userTime; // Microseconds
+    int64_t systemTime;
+    int64_t totalMaxRss; // KiB, sum of the per build peaks
+    int64_t maxRss;      // KiB, the highest peak
+    int64_t blockInputs;
+    int64_t blockOutputs;
+    int64_t voluntaryContextSwitches;
+    int64_t involuntaryContextSwitches;
+};
+
+struct StatOperationData
+{
+    PairingState pairing;
+
+    size_t totalBuildCount;
+    size_t successfulBuildCount;
+    size_t totalBuildTime;
+    double avgBuildTime;
+    size_t lastBuildTime;
+    int64_t lastBuildTimestamp; // When the last successful build stopped
+    size_t lastBuildPosition;   // Where its STOP is in the database, set when the records are read in parts
+    size_t maxBuildTime;
+    DurationHistogram buildTimeHistogram; // Successful builds
+    BuildGraphData buildGraphData;
+    ResourceUsageStats usage; // Not part of the stat checkpoint, the usage file is small and read as a whole
+    std::vector<PhaseStats> phases; // Not part of it either, the same goes for the spans file
+    size_t compactedBuildCount; // Builds counted from rollups, their notes are gone
+
+    // Empty: no grouping, "note": by the whole note, otherwise by the value of the <groupBy>=<value> tag of the note.
+    // The checkpoint keeps the groups, but stat only keeps one for the builds that aren't grouped.
+    std::string groupBy;
+    StringInterner groupNames; // Group id -> group name
+    std::vector<BuildGroupStats> groups;
+
+    // When set, the builds paired by aggregateRecord are also appended to it, in the order of their STOPs. Not for the
+    // records read in parts, those are only paired when stitched.
+    std::vector<FinishedBuild>* finishedBuilds;
+};
+
+void gimmeTime(const time_t* theTime, struct tm* result);
+std::string computeDateStr(int64_t timestamp);
+int64_t computeDayIndex(int64_t timestampMs);
+int64_t computeHourIndex(int64_t timestampMs);
+// Days since epoch of a date of the proleptic Gregorian calendar, the inverse of what gimmeTime does with the date.
+int64_t daysFromCivil(int64_t year, int month, int day);
+
+std::string_view groupKeyOf(std::string_view note, const std::string& groupBy);
+
+bool parseGraphBucket(const std::string& name, GraphBucket& bucket);
+const char* graphBucketName(GraphBucket bucket);
+// Index of the column of the given width a timestamp falls in, the columns that follow each other have consecutive
+// indices. graphColumnStart is the inverse, it returns the first millisecond of the column.
+int64_t graphColumnIndex(GraphBucket bucket, int64_t timestampMs);
+int64_t graphColumnStart(GraphBucket bucket, int64_t column);
+// Sums the hourly buckets up into the columns of the graphs, oldest first.
+std::vector<GraphColumn> graphColumns(const BuildGraphData& graph);
+
+// The graphs end with the column of tsNow and are width columns wide.
+void initBuildStats(StatOperationData& data, GraphBucket bucket, int width, int64_t tsNow);
+void aggregateRecord(StatOperationData& data, const RecordView& record);
+// The id of the group with the given name, the group is added if data doesn't have it yet.
+uint32_t groupOf(StatOperationData& data, std::string_view name);
+void aggregateUsage(ResourceUsageStats& usage, const DbUsageRecord& record);
+// Pairs the span-begins and span-ends of every build and adds the spans to the phases. The spans left open, and the
+// ones still open inside a span that is closed, are not counted.
+void aggregateSpans(std::vector<PhaseStats>& phases, const std::vector<DbSpanRecord>& spans);
+void mergeBuildStats(StatOperationData& target, const StatOperationData& source);
+// Continues the aggregates of the records before a part of the same database with the ones of the part, read with
+// pairing.chunked set: the deferred records are paired, and whatever the part left open is carried over.
+void stitchBuildStats(StatOperationData& target, const StatOperationData& part);
+void finishBuildStats(StatOperationData& data);
+} // namespace pdrain
+
+#endif
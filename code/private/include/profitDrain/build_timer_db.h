@@ -0,0 +1,444 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef BUILD_TIMER_DB_H
+#define BUILD_TIMER_DB_H
+
+#include "string_interner.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pdrain
+{
+enum class Operation : char
+{
+    START,
+    STOP,
+    STAT,
+    DUMP,
+    CONVERT,
+    RUN,
+    SERVE,
+    ROTATE,
+    COMPACT,
+    REGRESSIONS,
+    EXPORT_METRICS,
+    SPAN_BEGIN,
+    SPAN_END,
+    UNKNOWN,
+};
+
+// On disk formats of the timer database.
+//
+// Version 1 (legacy): no header, a sequence of variable length records in host byte order:
+//     Operation | int64_t timestamp | size_t text size | text bytes
+// The text is the note for START and the exit code string for STOP.
+//
+// Version 2: a DbFileHeader followed by fixed size records, little endian. Notes are kept in a separate heap file
+// (<database>.notes) and referenced by their offset. Rewrites store every distinct note once, appends only look for
+// the note among the last entries of the heap. The records are packed into dbRecordSize bytes, which leaves the build
+// id unaligned, the fields are copied in and out rather than read in place:
+//     timestamp, with the operation in its top bit (set for STOP) | note offset or exit code | build id
+//
+// Version 3 (compressed): a DbFileHeader with recordSize 0, followed by variable size records, notes in a heap the
+// same as for version 2:
+//     tag byte | timestamp | note offset or exit code | build id
+// The fields are little endian integers of the sizes the tag gives, fields of size 0 are left out. The timestamp is
+// the zigzag encoded difference to the previous record, or the timestamp itself where an append starts (every append
+// starts with an absolute timestamp, writers never have to decode the end of the file). A zero note offset or exit
+// code takes no bytes and a STOP of the build the last START started doesn't store the build id, the tag refers to it.
+// The sizes are in the tag rather than in continuation bits so the reader knows where the next record starts from
+// the tag alone.
+// The records are split into blocks by DbSyncMarkers: a writer ends the block once it holds dbBlockSize bytes, and an
+// append starts with a marker when the last one was torn. The decoder state starts over after every marker, the marker
+// checksums the block before it. Readers verify each block against the marker after it and skip the ones that don't
+// match, and can start reading at any marker.
+const int dbLegacyVersion = 1;
+const int dbVersion = 2;
+const int dbCompressedVersion = 3;
+
+// Fields of the tag byte of compressed records.
+const uint8_t dbTagStop = 0x01;         // STOP, otherwise START
+const uint8_t dbTagBuildIdShift = 1;    // 2 bits: dbNoBuildId, dbExplicitBuildId or dbLastStartedBuildId
+const uint8_t dbTagTimeSizeShift = 3;   // 3 bits: index into dbTimeSizes
+const uint8_t dbTagValueSizeShift = 6;  // 2 bits: index into dbValueSizes
+const uint8_t dbNoBuildId = 0;
+const uint8_t dbExplicitBuildId = 1;    // The 8 byte build id follows
+const uint8_t dbLastStartedBuildId = 2; // The build id is the one of the last START
+const uint8_t dbTimeSizes[8] = {0, 1, 2, 3, 4, 5, 6, 8}; // 8: the timestamp itself
+const uint8_t dbValueSizes[4] = {0, 1, 2, 4};
+const uint8_t dbSyncTag = 3 << dbTagBuildIdShift; // The build id mode no record uses
+const char dbSyncMagic[7] = {'P', 'D', 'S', 'Y', 'N', 'C', 'M'};
+const size_t dbBlockSize = 64 * 1024;
+const char dbMagic[8] = {'P', 'D', 'R', 'A', 'I', 'N', 'D', 'B'};
+const char dbNotesMagic[8] = {'P', 'D', 'R', 'A', 'I', 'N', 'N', 'T'};
+
+struct DbFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t recordSize;
+    uint32_t reserved0;
+    uint64_t reserved1;
+};
+
+// A record of a version 2 database as encodeRecord and decodeRecord see it.
+struct DbRecord
+{
+    int64_t timestamp; // Milliseconds since epoch
+    union
+    {
+        uint32_t noteOffset; // START: offset of the note entry in the notes heap, 0 if there is no note
+        int32_t exitCode;    // STOP
+    };
+    uint8_t operation;
+    uint8_t reserved[3];
+    uint64_t buildId; // Pairs a STOP with its START, 0 if the build had no id.
+};
+
+struct DbSyncMarker
+{
+    uint8_t tag;   // dbSyncTag
+    char magic[7]; // dbSyncMagic
+    uint32_t blockSize;     // Bytes since the previous marker (or the header), 0 if the writer didn't know
+    uint32_t blockChecksum; // CRC-32 of those bytes
+    uint64_t position;      // Offset of the marker in the file, tells it from record bytes that look like one
+};
+
+static_assert(sizeof(DbFileHeader) == 32, "The file header is part of the on disk format");
+static_assert(sizeof(DbSyncMarker) == 24, "The sync marker is part of the on disk format");
+const size_t dbRecordSize = 20;
+const uint64_t dbStopBit = 1ull << 63;
+
+// Writes the record into dbRecordSize bytes.
+void encodeRecord(const DbRecord& raw, char* bytes);
+// Reads a record of dbRecordSize bytes. A record whose timestamp was torn has an unknown operation.
+void decodeRecord(const char* bytes, DbRecord& raw);
+
+// The notes heap starts with dbNotesMagic, followed by the entries: uint32_t note size | note bytes | uint32_t note
+// size. The size after the note lets an append walk the last entries back from the end of the heap.
+const size_t dbNoteEntryHeaderSize = sizeof(uint32_t);
+const size_t dbNoteEntryOverhead = 2 * sizeof(uint32_t);
+
+// Appends the heap entry of the note to out.
+void appendNoteEntry(std::string& out, std::string_view note);
+
+// Exit code stored for STOP records whose exit code isn't a number.
+const int32_t invalidExitCode = -1;
+
+// Resource usage of the builds run by profitDrain itself, kept in <database>.usage: a DbFileHeader with
+// dbUsageMagic followed by fixed size DbUsageRecords. Builds recorded with start/stop have no usage record.
+const int dbUsageVersion = 1;
+const char dbUsageMagic[8] = {'P', 'D', 'R', 'A', 'I', 'N', 'R', 'U'};
+
+struct DbUsageRecord
+{
+    uint64_t buildId;                   // Build id of the START/STOP pair of the build
+    int64_t wallTime;                   // Milliseconds
+    int64_t userTime;                   // CPU time of the whole process tree, microseconds
+    int64_t systemTime;                 // Microseconds
+    int64_t maxRss;                     // Peak resident set of the largest process in the tree, KiB
+    int64_t blockInputs;                // Block input operations
+    int64_t blockOutputs;               // Block output operations
+    int64_t voluntaryContextSwitches;   // Waits, mostly for I/O
+    int64_t involuntaryContextSwitches; // Preemptions
+};
+
+static_assert(sizeof(DbUsageRecord) == 72, "The usage record is part of the on disk format");
+
+// Phases of the builds, kept in <database>.spans: a DbFileHeader with dbSpanMagic followed by a fixed size
+// DbSpanRecord for every span-begin and span-end. Spans nest, a span-end closes the innermost open span of its build
+// with the same name, or the innermost one if it has no name.
+const int dbSpanVersion = 1;
+const char dbSpanMagic[8] = {'P', 'D', 'R', 'A', 'I', 'N', 'S', 'P'};
+const size_t dbSpanNameSize = 40;
+
+struct DbSpanRecord
+{
+    uint64_t buildId;          // Build id of the START the span belongs to, 0 if it was recorded without one
+    int64_t timestamp;         // Milliseconds since epoch
+    uint8_t begin;             // 1 for a span-begin, 0 for a span-end
+    uint8_t reserved[7];
+    char name[dbSpanNameSize]; // Zero padded, not terminated if it is dbSpanNameSize long
+};
+
+static_assert(sizeof(DbSpanRecord) == 64, "The span record is part of the on disk format");
+
+// Databases are split into segments by time. The database file itself holds the current month, rotate moves the
+// records of every finished month into a segment file of its own, <database>.YYYY-MM, in the version 2 format. A
+// build always stays in the segment of the month it started in, together with its STOP.
+//
+// compact turns the old segments into per day rollups, kept in <database>.rollup: a DbFileHeader with dbRollupMagic
+// followed by variable size entries, each a DbRollupRecord and histogramEntryCount DbRollupHistogramEntries. The
+// reserved1 field of the header is the first day (days since epoch) whose segment was not compacted: the segments of
+// the months before it are covered by the rollups, even if they haven't been deleted yet.
+const int dbRollupVersion = 1;
+const char dbRollupMagic[8] = {'P', 'D', 'R', 'A', 'I', 'N', 'R', 'L'};
+
+struct DbRollupRecord
+{
+    int64_t day;                   // Days since epoch (UTC)
+    uint64_t buildCount;           // Builds counted on the day, failed and never stopped ones too
+    uint64_t successfulBuildCount;
+    uint64_t totalBuildTime;       // Successful builds, milliseconds
+    uint64_t maxBuildTime;
+    uint64_t lastBuildTime;        // Last successful build that stopped on the day
+    int64_t lastBuildTimestamp;    // When it stopped, 0 if no build succeeded on the day
+    uint64_t startedBuildTime;     // Successful builds started on the day, what the graphs show for the day
+    uint64_t startedBuildCount;
+    int64_t histogramMax;
+    uint32_t histogramEntryCount;
+    uint32_t reserved;
+};
+
+// A non empty bucket of the build time histogram of the successful builds of the day.
+struct DbRollupHistogramEntry
+{
+    uint32_t bucket;
+    uint32_t count;
+};
+
+static_assert(sizeof(DbRollupRecord) == 88, "The rollup record is part of the on disk format");
+static_assert(sizeof(DbRollupHistogramEntry) == 8, "The rollup record is part of the on disk format");
+
+int32_t parseExitCode(std::string_view exitCode);
+std::string notesPathFor(const std::string& path);
+std::string usagePathFor(const std::string& path);
+std::string spansPathFor(const std::string& path);
+std::string rollupPathFor(const std::string& path);
+std::string segmentPathFor(const std::string& path, int year, int month);
+// The segments of the database at path, oldest first. Their months are returned as year * 12 + month - 1.
+void listSegments(const std::string& path, std::vector<std::string>& segmentPaths, std::vector<int>& months);
+
+// Read only view of a whole file. The memory stays valid until unmapFile is called.
+struct MappedFile
+{
+    const char* data = nullptr;
+    size_t size = 0;
+#if defined(_WIN64) || defined(_WIN32)
+    void* fileHandle = nullptr;
+    void* mappingHandle = nullptr;
+#endif
+};
+
+int mapFile(const std::string& path, MappedFile& file);
+void unmapFile(MappedFile& file);
+// Identifies the file itself rather than its path, a file replaced under the same name gets a new identity.
+struct FileIdentity
+{
+    uint64_t device;
+    uint64_t inode;
+};
+
+int fileIdentity(const std::string& path, FileIdentity& identity);
+// Atomically replaces targetPath with sourcePath.
+int replaceFile(const std::string& sourcePath, const std::string& targetPath);
+
+// Appends the files matching a wildcard pattern (*, ? and, except on Windows, [...]) to paths, sorted by name. A path
+// without wildcards is appended as it is. Returns a negative value if the pattern doesn't match anything.
+int expandPathPattern(const std::string& pattern, std::vector<std::string>& paths);
+
+// Lets the OS drop the pages of [0, offset) from the resident set. They are paged in again if touched later.
+void releaseMappedPages(MappedFile& file, size_t offset);
+
+// A single record of the timer database. The text points into the mapped files: it is the note for START records and,
+// for version 1 databases, the exit code string of STOP records.
+struct RecordView
+{
+    Operation operation;
+    int64_t timestamp;
+    std::string_view text;
+    int32_t exitCode; // STOP only
+    uint64_t buildId; // 0 if the record has no build id
+};
+
+uint64_t generateBuildId();
+
+// What the decoder of compressed databases has to know about the records before the reader position.
+struct ReaderState
+{
+    int64_t previousTimestamp;
+    uint64_t lastStartedBuildId;
+    uint64_t blockStart; // Where the block of the position starts, 0 if it isn't known
+};
+
+// CRC-32 (IEEE 802.3) of the bytes, continuing the crc of the bytes before them.
+uint32_t crc32(uint32_t crc, const void* data, size_t size);
+
+// Where the writer of a compressed database is: the encoder state and the block the next record goes to.
+struct CompressedBlockWriter
+{
+    ReaderState state;
+    bool hasPrevious;
+    uint64_t position; // File offset of the next record
+    uint64_t blockStart;
+    uint32_t blockChecksum;
+    bool blockKnown; // False if the block started before what the appender read, its marker gets a blockSize of 0
+};
+
+// Appends a record to the database, in the format of the existing file. New files are created in the latest format.
+int appendRecord(const std::string& path, const RecordView& record);
+// Appends all the records with a single write, other writers never get in between them.
+int appendRecords(const std::string& path, const RecordView* records, size_t count);
+
+// Appends the resource usage of a build to the usage file of the database at path.
+int appendUsageRecord(const std::string& path, const DbUsageRecord& usage);
+// Reads every complete record of the usage file of the database at path. A database without one has no records.
+int readUsageRecords(const std::string& path, std::vector<DbUsageRecord>& records);
+// The same for the spans file.
+int appendSpanRecord(const std::string& path, const DbSpanRecord& span);
+int readSpanRecords(const std::string& path, std::vector<DbSpanRecord>& records);
+
+// Rewrites a database in the format of the given version (dbVersion or dbCompressedVersion) at targetPath.
+int convertDatabase(const std::string& path, const std::string& targetPath, int version);
+
+class BuildTimerDbReader;
+class DbFileWriter;
+
+// Rewrites the version 2 or 3 database at path, in its own format, with the records the rewrite function passes to the
+// writer, holding the lock of the database all along, so no append gets lost. The database is only replaced if the
+// function returns 0. rewritten is called with the complete new file right before it replaces the database, the file
+// keeps its identity when it is moved.
+int rewriteDatabase(const std::string& path,
+                    const std::function<int(BuildTimerDbReader& reader, DbFileWriter& writer)>& rewrite,
+                    const std::function<void(const std::string& rewrittenPath)>& rewritten = nullptr);
+} // namespace pdrain
+
+class pdrain::BuildTimerDbReader
+{
+public:
+    BuildTimerDbReader() = default;
+    BuildTimerDbReader(const BuildTimerDbReader&) = delete;
+    BuildTimerDbReader& operator=(const BuildTimerDbReader&) = delete;
+    ~BuildTimerDbReader();
+
+    int open(const std::string& path);
+    void close();
+
+    // Returns false once there are no more complete records in the file.
+    bool next(RecordView& record);
+
+    // Byte offset of the next record. An incomplete record at the end of the file is not consumed.
+    size_t position() const
+    {
+        return offset;
+    }
+
+    // Decoder state at position(), compressed databases continue from a position only with the state of it.
+    ReaderState state() const
+    {
+        return decoderState;
+    }
+
+    // Continues reading at a position returned earlier by position(), with the state() returned along with it.
+    bool seek(size_t position, const ReaderState& state = ReaderState());
+
+    // Positions that split the records after position() into up to count parts of at least minPartSize bytes, in
+    // order. Every part can be read by a reader of its own, seeked with seekToPart() and limited to the next one.
+    // Version 1 databases, and compressed databases written before the sync markers, can't be split.
+    std::vector<size_t> partPositions(size_t count, size_t minPartSize) const;
+    bool seekToPart(size_t position);
+    // Stops reading at the given position, the start of the next part.
+    void limit(size_t position);
+
+    // Continues reading at the first record with a timestamp not older than the given one. Records are appended in
+    // time order, version 2 databases are binary searched, the others can only be scanned. Returns the number of
+    // records skipped, of version 2 databases that includes the torn ones next() wouldn't have returned.
+    uint64_t seekToTimestamp(int64_t timestamp);
+
+    std::string_view contents() const
+    {
+        return std::string_view(file.data, file.size);
+    }
+
+    size_t size() const
+    {
+        return file.size;
+    }
+
+    int version() const
+    {
+        return formatVersion;
+    }
+
+private:
+    bool nextLegacy(RecordView& record);
+    bool nextCompressed(RecordView& record);
+    void noteAt(uint64_t noteOffset, RecordView& record) const;
+    size_t findSyncMarker(size_t from) const;
+    void enterBlock();
+    void releaseConsumedPages();
+
+    std::string path;
+    MappedFile file;
+    MappedFile notes;
+    ReaderState decoderState = {};
+    size_t blockEnd = 0; // The sync marker after the records of the block, or end
+    size_t end = 0;      // Records are read up to here
+    int formatVersion = dbLegacyVersion;
+    size_t dataOffset = 0;
+    size_t offset = 0;
+    size_t releasedOffset = 0;
+};
+
+// Writes a new version 2 database and its notes heap from scratch, every distinct note is stored once.
+class pdrain::DbFileWriter
+{
+public:
+    DbFileWriter() = default;
+    DbFileWriter(const DbFileWriter&) = delete;
+    DbFileWriter& operator=(const DbFileWriter&) = delete;
+    ~DbFileWriter();
+
+    // version is dbVersion or dbCompressedVersion. Given a basePath, the notes heap starts as a copy of the heap of that
+    // database, its notes keep their offsets.
+    int open(const std::string& path, int version = dbVersion, const std::string& basePath = std::string());
+    int write(const RecordView& record);
+    // Returns the first error of open, write and closing the files.
+    int close();
+
+private:
+    std::string path;
+    int formatVersion = dbVersion;
+    CompressedBlockWriter encoder = {};
+    std::string buffer;
+    FILE* out = nullptr;
+    FILE* notesOut = nullptr;
+    StringInterner notes;
+    std::vector<uint32_t> noteOffsets; // Note id -> offset in the heap
+    uint64_t notesSize = 0;
+    int result = 0;
+};
+
+#endif
@@ -0,0 +1,82 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef CHANGE_DETECTOR_H
+#define CHANGE_DETECTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pdrain
+{
+// Online change point detection over the durations of the successful builds: a two sided CUSUM of the log durations,
+// standardized with the median and the median absolute deviation of the builds the current level was calibrated with.
+// On a log scale the same slowdown looks the same for a 10 s and a 10 min build. Every build counts for at most three
+// deviations, so a single outlier (a clean build, a cold cache) can't raise an alarm on its own.
+struct ChangeDetector
+{
+    static const uint32_t windowSize = 64;      // Recent builds kept, levels and shifts are measured on them
+    static const uint32_t calibrationSize = 30; // Builds a level is calibrated with
+
+    uint64_t buildCount;
+    uint64_t levelStart; // First build of the current level
+    uint64_t upperStart; // First build of the run that raised upper above zero
+    uint64_t lowerStart;
+    int64_t upperStartTimestamp;
+    int64_t lowerStartTimestamp;
+    float baseline; // Median log duration of the level
+    float scale;    // Standard deviation of the log durations of the level, estimated from their MAD
+    float upper;    // CUSUM of the builds slower than the baseline
+    float lower;    // CUSUM of the builds faster than it
+    uint8_t calibrated;
+    float recent[windowSize]; // Log durations of the last builds, indexed by the build count
+};
+
+// A shift of the build time.
+struct ChangePoint
+{
+    int64_t timestamp; // Start of the first build of the new level
+    int64_t before;    // Median build time of the old level, milliseconds
+    int64_t after;     // Median build time of the builds since the shift
+    uint32_t buildCount; // Builds since the shift when it was detected
+    uint32_t group;
+};
+
+// Feeds the next successful build to the detector. Returns true, with the shift in change, when the build confirms
+// one. The detector continues with the new level.
+bool detectChange(ChangeDetector& detector, int64_t startTimestamp, int64_t duration, ChangePoint& change);
+
+// The state of regressions, kept in the extra part of its checkpoint, <database>.regressions.
+std::string regressionCheckpointPathFor(const std::string& path);
+void saveDetectors(std::string& out, const std::vector<ChangeDetector>& detectors, const std::vector<ChangePoint>& changes);
+bool loadDetectors(std::string_view in, std::vector<ChangeDetector>& detectors, std::vector<ChangePoint>& changes);
+} // namespace pdrain
+
+#endif
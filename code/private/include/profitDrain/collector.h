@@ -0,0 +1,89 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef COLLECTOR_H
+#define COLLECTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pdrain
+{
+// A collector (profitDrain -x=serve) keeps a database open and listens on <database>.sock, a Unix domain socket.
+// Requests and responses are messages: uint32_t payload size | payload. Every connection carries one request and
+// its response. Not available on Windows, the commands always work with the files there.
+std::string collectorSocketPath(const std::string& path);
+
+// Result of collectorRequest when no collector listens for the database, the caller works with the files.
+const int collectorNotRunning = 1;
+
+// Sends a request to the collector of the database and waits for its response.
+int collectorRequest(const std::string& path, const std::string& request, std::string& response);
+
+class CollectorServer;
+} // namespace pdrain
+
+class pdrain::CollectorServer
+{
+public:
+    struct Request
+    {
+        int client; // Pass to respond
+        std::string payload;
+    };
+
+    CollectorServer() = default;
+    CollectorServer(const CollectorServer&) = delete;
+    CollectorServer& operator=(const CollectorServer&) = delete;
+    ~CollectorServer();
+
+    // Fails if another collector already listens for the database.
+    int open(const std::string& path);
+    void close();
+
+    // Waits up to timeoutMs for requests, then takes every complete request that is ready without waiting more, so
+    // requests arriving together are handled as one batch. Returns false if the wait was interrupted by a signal.
+    bool receive(int timeoutMs, std::vector<Request>& requests);
+    void respond(int client, const std::string& response);
+
+private:
+    struct Connection
+    {
+        int fd;
+        std::string received;
+    };
+
+    bool readFrom(Connection& connection, std::vector<Request>& requests);
+
+    std::string socketPath;
+    int listenFd = -1;
+    std::vector<Connection> connections;
+};
+
+#endif
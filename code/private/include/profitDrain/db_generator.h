@@ -0,0 +1,56 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef DB_GENERATOR_H
+#define DB_GENERATOR_H
+
+#include <cstdint>
+#include <string>
+
+namespace pdrain
+{
+// Shape of a synthetic timer database. The same options and seed always give the same database.
+struct GeneratorOptions
+{
+    uint64_t recordCount = 1000000; // START and STOP records together
+    int formatVersion = 2;
+    double meanNoteLength = 24;     // Note lengths are exponentially distributed
+    uint32_t distinctNotes = 200;   // Notes are drawn from a pool of this size, a few of them much more often
+    double emptyNoteRate = 0.2;     // Builds started without a note
+    double failureRate = 0.15;      // Builds stopped with a non-zero exit code
+    double interleaveRate = 0.05;   // Builds started while the previous one is still running
+    double medianBuildTime = 300;   // Seconds, build times are log-normally distributed
+    int spanDays = 365;             // The records end at endTimestamp and start this many days before
+    int64_t endTimestamp = 0;       // Milliseconds since epoch, 0 for now
+    uint64_t seed = 1;
+};
+
+// Writes a new database at path (and its notes heap for version 2), replacing existing files.
+int generateDatabase(const std::string& path, const GeneratorOptions& options);
+} // namespace pdrain
+
+#endif
@@ -0,0 +1,78 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef DB_SEGMENTS_H
+#define DB_SEGMENTS_H
+
+#include "build_stats.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace pdrain
+{
+// Months are counted as year * 12 + month - 1, the same as listSegments returns them.
+int monthOfDay(int64_t day);
+int64_t firstDayOfMonth(int month);
+
+// A checkpoint an operation keeps of its own next to the database (regressions, export-metrics). update brings its
+// state up to date with all the records of the database, it returns false if there is no state to carry over.
+struct CarriedCheckpoint
+{
+    std::string path;
+    std::function<bool(StatOperationData& data, std::string& extra)> update;
+};
+
+// Moves the records of the months before the one of tsNow (UTC) out of the database into its segments, new segments
+// are written in the format of the given version. Records of months already compacted go to the oldest segment that
+// is not. The checkpoints are updated with the database locked and tied to the rotated database, which only holds
+// records they cover.
+int rotateDatabase(const std::string& path,
+                   int64_t tsNow,
+                   int version,
+                   const std::vector<CarriedCheckpoint>& checkpoints);
+
+// Rotates the database, then replaces the segments of the months more than keepMonths months before the one of tsNow
+// with per day rollups.
+int compactDatabase(const std::string& path,
+                    int keepMonths,
+                    int64_t tsNow,
+                    int version,
+                    const std::vector<CarriedCheckpoint>& checkpoints);
+
+// Adds the rollups of the days [firstDay, lastDay] to data. compactedUntil is set to the first day not covered by the
+// rollups, the segments of the months before it must not be read. A database without rollups has none.
+int aggregateRollups(const std::string& path,
+                     int64_t firstDay,
+                     int64_t lastDay,
+                     StatOperationData& data,
+                     int64_t& compactedUntil);
+} // namespace pdrain
+
+#endif
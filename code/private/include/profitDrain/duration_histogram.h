@@ -0,0 +1,86 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef DURATION_HISTOGRAM_H
+#define DURATION_HISTOGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace pdrain
+{
+class DurationHistogram;
+} // namespace pdrain
+
+// Log-linear histogram of durations in the style of HdrHistogram. Every power of two range is split into
+// subBucketCount buckets, so a value is known with a relative error of at most 1/subBucketCount (about 3%) and
+// values below subBucketCount exactly. The memory used doesn't depend on the number of values recorded, and two
+// histograms merge without losing anything, the same as if all the values had been recorded into one.
+class pdrain::DurationHistogram
+{
+public:
+    static const int subBucketBits = 5;
+    static const int64_t subBucketCount = int64_t(1) << subBucketBits;
+    static const size_t bucketCount = (64 - subBucketBits + 1) * subBucketCount;
+
+    DurationHistogram();
+
+    // Negative values are counted as 0.
+    void record(int64_t value, uint64_t count = 1);
+    void merge(const DurationHistogram& other);
+
+    // The highest value equivalent to the one at the given percentile (0 - 100), 0 if nothing was recorded.
+    int64_t valueAtPercentile(double percentile) const;
+
+    uint64_t totalCount() const
+    {
+        return total;
+    }
+
+    int64_t maxValue() const
+    {
+        return max;
+    }
+
+    uint64_t countAt(size_t index) const
+    {
+        return counts[index];
+    }
+
+    static size_t bucketIndex(int64_t value);
+    // [lowestValue(index), highestValue(index)] are the values counted by the bucket.
+    static int64_t lowestValue(size_t index);
+    static int64_t highestValue(size_t index);
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    int64_t max;
+};
+
+#endif
@@ -0,0 +1,69 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef METRICS_EXPORT_H
+#define METRICS_EXPORT_H
+
+#include "build_stats.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pdrain
+{
+// Upper bounds of the buckets of the build time histogram, seconds. The +Inf bucket comes after them.
+const int64_t metricsBucketBounds[] = {1, 5, 10, 30, 60, 120, 300, 600, 1200, 1800, 3600, 7200};
+const size_t metricsBucketCount = sizeof(metricsBucketBounds) / sizeof(metricsBucketBounds[0]) + 1;
+
+// The build time histogram of the successful builds of a group, the buckets are not cumulative.
+struct MetricsHistogram
+{
+    uint64_t counts[metricsBucketCount];
+    uint64_t buildCount;
+    uint64_t totalBuildTime; // Milliseconds
+};
+
+void recordMetricsBuild(MetricsHistogram& histogram, int64_t buildTime);
+
+// export-metrics keeps its checkpoint, with the histograms in the extra part, in <database>.metrics and writes the
+// metrics to <database>.prom unless it is given a file.
+std::string metricsCheckpointPathFor(const std::string& path);
+std::string metricsPathFor(const std::string& path);
+void saveMetricsHistograms(std::string& out, const std::vector<MetricsHistogram>& histograms);
+bool loadMetricsHistograms(std::string_view in, std::vector<MetricsHistogram>& histograms);
+
+// The counters of data and the histograms of its groups (histograms[0] when not grouping) in the Prometheus text
+// format, one label named after the --group-by key per group.
+void formatMetrics(std::string& out, const StatOperationData& data, const std::vector<MetricsHistogram>& histograms);
+// Replaces the file at path with text at once, the textfile collector never reads a partial file.
+int writeMetricsFile(const std::string& path, const std::string& text);
+} // namespace pdrain
+
+#endif
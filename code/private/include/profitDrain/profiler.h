@@ -0,0 +1,124 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "build_timer_db.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pdrain
+{
+// The stages of stat --profile reports the time of. The time of a stage run on several threads adds up.
+enum class ProfileStage : uint8_t
+{
+    COLLECTOR,  // Asking the collector, stat is done if it answers
+    OPEN,       // Opening and mapping the databases and their notes
+    CHECKPOINT, // Loading and saving the stat checkpoints
+    READ,       // Decoding the records
+    PAIR,       // Pairing the records into builds and adding them up
+    MERGE,      // Merging the parts, segments, rollups and databases
+    SIDE_FILES, // The rollups, usage and spans files
+    GRAPHS,     // Summing the columns of the graphs up and drawing them
+    REPORT,     // The rest of the output
+    COUNT,
+};
+
+// Set by --profile before any thread is started, only read afterwards.
+extern bool profiling;
+
+int64_t profileClock(); // Nanoseconds, monotonic
+void addStageTime(ProfileStage stage, int64_t nanoseconds);
+void addRecordsRead(uint64_t records, uint64_t bytes);
+
+// Adds the time until it goes out of scope to the stage, if profiling.
+class ProfileScope
+{
+public:
+    explicit ProfileScope(ProfileStage stage) : stage(stage), start(profiling ? profileClock() : 0)
+    {
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+    ~ProfileScope()
+    {
+        if (profiling)
+        {
+            addStageTime(stage, profileClock() - start);
+        }
+    }
+
+private:
+    ProfileStage stage;
+    int64_t start;
+};
+
+// Runs the function and adds its time to the stage, if profiling.
+template <typename Function>
+auto profiled(ProfileStage stage, Function&& function) -> decltype(function())
+{
+    const ProfileScope scope(stage);
+    return function();
+}
+
+// Splits the time of a loop over the records of a reader between READ and PAIR, if profiling. Timing every record
+// would take longer than reading it: only every 64th next() and the handling of its record, until the next call, are
+// timed, the time of the whole loop is split by their ratio.
+class ReadProfile
+{
+public:
+    explicit ReadProfile(const BuildTimerDbReader& reader);
+
+    bool next(BuildTimerDbReader& reader, RecordView& record)
+    {
+        return profiling ? sampledNext(reader, record) : reader.next(record);
+    }
+
+    // Adds the times of the loop, the records and the bytes read to the profile.
+    void finish(const BuildTimerDbReader& reader);
+
+private:
+    bool sampledNext(BuildTimerDbReader& reader, RecordView& record);
+
+    int64_t start = 0;
+    int64_t sampleEnd = 0; // After the last timed next(), 0 if the record after it wasn't timed
+    int64_t sampledRead = 0;
+    int64_t sampledPair = 0;
+    uint64_t recordCount = 0;
+    size_t startPosition = 0;
+};
+
+// Writes the stage times, the records and bytes read, the allocations and the peak RSS to stderr. totalNanoseconds is
+// the wall time of the whole operation.
+void printProfile(int64_t totalNanoseconds);
+} // namespace pdrain
+
+#endif
@@ -0,0 +1,165 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef RECORD_EXPORT_H
+#define RECORD_EXPORT_H
+
+#include "build_timer_db.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace pdrain
+{
+enum class DumpFormat : char
+{
+    TEXT,  // INDEX|OPERATION TYPE|TIMESTAMP|[Note/Exit Code], not escaped
+    CSV,   // RFC 4180
+    JSONL, // One JSON object per line
+    BIN,   // See dumpBinaryMagic
+    TRACE, // Chrome Trace Event JSON, see TraceWriter
+};
+
+// Binary dump: dumpBinaryMagic | uint32_t version | uint32_t reserved, then for every record, little endian:
+//     int64_t timestamp | int32_t exit code | uint8_t operation | 3 reserved bytes | uint64_t build id |
+//     uint32_t text size | text bytes
+// The text is the note of START records, and the exit code string of STOP records in version 1 databases.
+const char dumpBinaryMagic[8] = {'P', 'D', 'R', 'A', 'I', 'N', 'D', 'X'};
+const uint32_t dumpBinaryVersion = 1;
+
+bool parseDumpFormat(const std::string& name, DumpFormat& format);
+
+class OutputBuffer;
+
+void writeDumpHeader(OutputBuffer& out, DumpFormat format);
+// exitCodeAsText: print the stored text of STOP records as the exit code, that is all version 1 databases have.
+void writeDumpRecord(OutputBuffer& out, DumpFormat format, uint64_t index, const RecordView& record, bool exitCodeAsText);
+
+class TraceWriter;
+} // namespace pdrain
+
+// Collects the output in a big buffer and writes it in a few large writes, instead of one per line.
+class pdrain::OutputBuffer
+{
+public:
+    explicit OutputBuffer(FILE* out, size_t capacity = 1024 * 1024);
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    ~OutputBuffer();
+
+    void append(std::string_view str)
+    {
+        if (buffer.size() + str.size() > capacity)
+        {
+            flush();
+        }
+        buffer.append(str.data(), str.size());
+    }
+
+    void append(char c)
+    {
+        if (buffer.size() >= capacity)
+        {
+            flush();
+        }
+        buffer.push_back(c);
+    }
+
+    void appendInt(int64_t value);
+    void appendHex(uint64_t value); // 16 digits, zero padded
+
+    template <typename T>
+    void appendRaw(const T& value)
+    {
+        append(std::string_view((const char*) &value, sizeof(value)));
+    }
+
+    // Returns false if anything failed to be written so far.
+    bool flush();
+
+    // Binary output must not be touched by newline translation (Windows).
+    void setBinary();
+
+private:
+    FILE* out;
+    size_t capacity;
+    std::string buffer;
+    bool failed = false;
+};
+
+// Writes the builds as the complete events of a Chrome Trace Event JSON object, for Perfetto and chrome://tracing.
+// The records are paired the same way stat pairs them and a build is written once its STOP is read, only the builds
+// still open are kept. Every database, or every group of --group-by, is a process of the trace, and every build goes
+// to the lowest thread (lane) of it no other build is on at the time, so the builds running at once show side by side
+// and the gaps between them stay empty. The note, the exit code and the build id are the args of the event. The
+// builds that never stopped are instant events.
+class pdrain::TraceWriter
+{
+public:
+    // name: name of the process of the builds that aren't grouped, the database.
+    TraceWriter(OutputBuffer& out, const std::string& name, const std::string& groupBy, bool exitCodeAsText);
+
+    void write(const RecordView& record);
+    // Writes the builds left open and ends the JSON object.
+    void finish();
+
+private:
+    struct Process
+    {
+        uint32_t pid;
+        std::vector<bool> lanes; // Lanes a build is on
+    };
+
+    struct OpenBuild
+    {
+        int64_t timestamp;
+        std::string note;
+        uint64_t buildId;
+        Process* process;
+        uint32_t lane;
+    };
+
+    void beginEvent();
+    void writeUnfinished(const OpenBuild& build);
+
+    OutputBuffer& out;
+    std::string name;
+    std::string groupBy;
+    bool exitCodeAsText;
+    bool firstEvent = true;
+    std::unordered_map<std::string, Process> processes;
+    std::unordered_map<uint64_t, OpenBuild> openBuilds; // Build id -> START, 0 for the previous record if it is a START
+    bool previousIsStart = false;
+    uint64_t previousBuildId = 0; // Build id of the previous record if it is a START
+};
+
+#endif
@@ -0,0 +1,81 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef STAT_CHECKPOINT_H
+#define STAT_CHECKPOINT_H
+
+#include "build_stats.h"
+#include "build_timer_db.h"
+
+#include <cstdint>
+#include <string>
+
+namespace pdrain
+{
+// The stat checkpoint (<database>.ckpt) holds the aggregation state reached by the last stat run, so the next run
+// only has to read the records appended since. It is tied to the database file by its identity and by fingerprints
+// of the data it covers, a database that shrank or was replaced invalidates it.
+std::string checkpointPathFor(const std::string& path);
+
+// On success the reader is positioned after the records covered by the checkpoint and data holds their aggregates,
+// with the hourly graph buckets moved to tsNow. Returns false if there is no usable checkpoint.
+bool loadStatCheckpoint(const std::string& path,
+                        BuildTimerDbReader& reader,
+                        GraphBucket bucket,
+                        int width,
+                        int64_t tsNow,
+                        StatOperationData& data);
+
+// Must be called before finishBuildStats, the checkpoint holds the raw running totals.
+int saveStatCheckpoint(const std::string& path, const BuildTimerDbReader& reader, const StatOperationData& data);
+
+// The same for the operations that keep a checkpoint of their own next to the database, in checkpointPath, with their
+// state in extra. data.groupBy selects the grouping the checkpoint must have been made with.
+bool loadCheckpoint(const std::string& checkpointPath,
+                    const std::string& path,
+                    BuildTimerDbReader& reader,
+                    GraphBucket bucket,
+                    int width,
+                    int64_t tsNow,
+                    StatOperationData& data,
+                    std::string& extra);
+// Reads the state of a checkpoint without holding it against the database, with the grouping it was made with, e.g.
+// to keep what an operation found in a database that was replaced since.
+bool loadCheckpointState(const std::string& checkpointPath,
+                         GraphBucket bucket,
+                         int width,
+                         int64_t tsNow,
+                         StatOperationData& data,
+                         std::string& extra);
+int saveCheckpoint(const std::string& checkpointPath,
+                   const std::string& path,
+                   const BuildTimerDbReader& reader,
+                   const StatOperationData& data,
+                   const std::string& extra);
+} // namespace pdrain
+
+#endif
@@ -0,0 +1,79 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#ifndef STRING_INTERNER_H
+#define STRING_INTERNER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace pdrain
+{
+class StringInterner;
+} // namespace pdrain
+
+// Maps strings to small dense ids, every distinct string is stored only once. The strings are copied into big arena
+// blocks that are only freed with the interner, so interning doesn't allocate per string and a lookup of a string that
+// is already interned doesn't allocate at all.
+class pdrain::StringInterner
+{
+public:
+    StringInterner() = default;
+    // The index points into the arena blocks, a copy would point into the ones of the original.
+    StringInterner(const StringInterner&) = delete;
+    StringInterner& operator=(const StringInterner&) = delete;
+    StringInterner(StringInterner&&) = default;
+    StringInterner& operator=(StringInterner&&) = default;
+
+    uint32_t intern(std::string_view str);
+
+    std::string_view name(uint32_t id) const
+    {
+        return names[id];
+    }
+
+    size_t size() const
+    {
+        return names.size();
+    }
+
+private:
+    static const size_t blockSize = 64 * 1024;
+
+    std::string_view store(std::string_view str);
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t blockUsed = blockSize; // Bytes used of the last block
+    std::vector<std::string_view> names; // Id -> string, pointing into the blocks
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+#endif
@@ -0,0 +1,468 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+// profitDrainBench: writes synthetic timer databases and measures how the operations of profitDrain scale with them.
+
+#include "arg_parse.h"
+#include "build_stats.h"
+#include "build_timer_db.h"
+#include "db_generator.h"
+#include "stat_checkpoint.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN64) || defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__) || defined(__linux__)
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#error "NIMBY"
+#endif
+
+namespace pdrain
+{
+namespace bench
+{
+struct Measurement
+{
+    double bestSeconds;  // Fastest of the repetitions
+    double peakRssMiB;   // Of the process that ran the operation
+};
+
+struct BenchOptions
+{
+    GeneratorOptions generator;
+    std::string path = "profitDrainBench.db";
+    uint64_t maxRecords = 1000000;
+    std::vector<int> formats = {dbLegacyVersion, dbVersion, dbCompressedVersion};
+    int repeat = 3;
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Runs setup once, then the operation repeat times. On POSIX systems every operation runs in a child process, so
+// its peak RSS is its own and whatever it leaves behind doesn't affect the next one. The operations print to the null
+// device, which still costs the write calls but no terminal rendering.
+int measure(const std::function<void()>& setup, const std::function<int()>& operation, int repeat, Measurement& m)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    std::stringbuf nullBuffer;
+    std::streambuf* coutBuffer = std::cout.rdbuf(&nullBuffer);
+    setup();
+    m.bestSeconds = 1e300;
+    int result = 0;
+    for (int i = 0; i < repeat && result == 0; ++i)
+    {
+        nullBuffer.str(std::string());
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        result = operation();
+        m.bestSeconds = std::min(m.bestSeconds, secondsSince(start));
+    }
+    std::cout.rdbuf(coutBuffer);
+    // Windows only knows the peak of the whole benchmark process.
+    PROCESS_MEMORY_COUNTERS counters = {};
+    K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    m.peakRssMiB = counters.PeakWorkingSetSize / 1024.0 / 1024.0;
+    return result;
+#else
+    std::cout.flush();
+    int channel[2];
+    if (pipe(channel) != 0)
+    {
+        return -5;
+    }
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(channel[0]);
+        close(channel[1]);
+        return -5;
+    }
+    if (pid == 0)
+    {
+        close(channel[0]);
+        if (!freopen("/dev/null", "w", stdout))
+        {
+            _exit(5);
+        }
+        setup();
+        double bestSeconds = 1e300;
+        for (int i = 0; i < repeat; ++i)
+        {
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (operation() != 0)
+            {
+                _exit(1);
+            }
+            std::cout.flush();
+            bestSeconds = std::min(bestSeconds, secondsSince(start));
+        }
+        const bool written = write(channel[1], &bestSeconds, sizeof(bestSeconds)) == sizeof(bestSeconds);
+        _exit(written ? 0 : 5);
+    }
+
+    close(channel[1]);
+    m.bestSeconds = 0;
+    const bool received = read(channel[0], &m.bestSeconds, sizeof(m.bestSeconds)) == sizeof(m.bestSeconds);
+    close(channel[0]);
+    int status = 0;
+    struct rusage resources = {};
+    if (wait4(pid, &status, 0, &resources) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !received)
+    {
+        return -5;
+    }
+#if defined(__APPLE__)
+    m.peakRssMiB = resources.ru_maxrss / 1024.0 / 1024.0;
+#else
+    m.peakRssMiB = resources.ru_maxrss / 1024.0;
+#endif
+    return 0;
+#endif
+}
+
+uint64_t databaseSize(const std::string& path)
+{
+    uint64_t size = 0;
+    for (const std::string& file : {path, notesPathFor(path)})
+    {
+        MappedFile mapped;
+        if (mapFile(file, mapped) == 0)
+        {
+            size += mapped.size;
+        }
+        unmapFile(mapped);
+    }
+    return size;
+}
+
+void removeDatabase(const std::string& path)
+{
+    for (const std::string& file : {path, notesPathFor(path), usagePathFor(path), checkpointPathFor(path)})
+    {
+        remove(file.c_str());
+    }
+}
+
+void printResult(int formatVersion, uint64_t recordCount, const char* name, const Measurement& m, double sizeMiB)
+{
+    printf("v%-5d %10llu %-10s %12.3f %14.0f %10.1f %14.1f\n",
+           formatVersion,
+           (unsigned long long) recordCount,
+           name,
+           m.bestSeconds * 1000,
+           m.bestSeconds > 0 ? recordCount / m.bestSeconds : 0,
+           m.bestSeconds > 0 ? sizeMiB / m.bestSeconds : 0,
+           m.peakRssMiB);
+    fflush(stdout);
+}
+
+int runBenchmarks(const BenchOptions& options)
+{
+    printf("profitDrain benchmark: best of %d runs, seed %llu, %.0f%% failures, %.0f%% interleaved\n",
+           options.repeat,
+           (unsigned long long) options.generator.seed,
+           options.generator.failureRate * 100,
+           options.generator.interleaveRate * 100);
+    printf("%-6s %10s %-10s %12s %14s %10s %14s\n", "FORMAT", "RECORDS", "OPERATION", "TIME [ms]", "RECORDS/S", "MIB/S",
+           "PEAK RSS [MiB]");
+
+    for (uint64_t recordCount = 1000; recordCount <= options.maxRecords; recordCount *= 10)
+    {
+        for (const int formatVersion : options.formats)
+        {
+            GeneratorOptions generator = options.generator;
+            generator.recordCount = recordCount;
+            generator.formatVersion = formatVersion;
+            // Generated in a child process too, the memory it used doesn't count for the benchmarks forked later.
+            removeDatabase(options.path);
+            Measurement generation = {};
+            if (measure([]() {}, [&]() { return generateDatabase(options.path, generator); }, 1, generation) != 0)
+            {
+                std::cerr << "Failed to generate the database!" << std::endl;
+                return -2;
+            }
+            const double sizeMiB = databaseSize(options.path) / 1024.0 / 1024.0;
+            printResult(formatVersion, recordCount, "generate", generation, sizeMiB);
+
+            Context context;
+            context.outFilePath = options.path;
+            context.dbFilePaths.push_back(options.path);
+            StatOperationData graphData = {};
+            const auto none = []() {};
+            const auto removeCheckpoint = [&]() { remove(checkpointPathFor(options.path).c_str()); };
+
+            struct Benchmark
+            {
+                const char* name;
+                std::function<void()> setup;
+                std::function<int()> operation;
+            };
+            const Benchmark benchmarks[] = {
+                {"read",
+                 none,
+                 [&]() {
+                     BuildTimerDbReader reader;
+                     if (reader.open(options.path) != 0)
+                     {
+                         return -2;
+                     }
+                     RecordView record;
+                     size_t count = 0;
+                     while (reader.next(record))
+                     {
+                         ++count;
+                     }
+                     return count > 0 ? 0 : -2;
+                 }},
+                {"stat",
+                 none,
+                 [&]() {
+                     removeCheckpoint();
+                     context.operation = Operation::STAT;
+                     return stat(context);
+                 }},
+                {"stat-ckpt",
+                 [&]() {
+                     context.operation = Operation::STAT;
+                     stat(context);
+                 },
+                 [&]() { return stat(context); }},
+                {"dump",
+                 none,
+                 [&]() {
+                     context.operation = Operation::DUMP;
+                     return takeDump(context);
+                 }},
+                {"graph",
+                 [&]() {
+                     removeCheckpoint();
+                     const int64_t tsNow = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                               std::chrono::system_clock::now().time_since_epoch())
+                                               .count();
+                     aggregateDatabase(options.path, context, tsNow, graphData);
+                     finishBuildStats(graphData);
+                 },
+                 [&]() {
+                     drawBuildTimeGraph(graphData);
+                     return 0;
+                 }},
+            };
+
+            for (const Benchmark& benchmark : benchmarks)
+            {
+                Measurement m = {};
+                if (measure(benchmark.setup, benchmark.operation, options.repeat, m) != 0)
+                {
+                    std::cerr << "The " << benchmark.name << " benchmark failed!" << std::endl;
+                    removeDatabase(options.path);
+                    return -5;
+                }
+                printResult(formatVersion, recordCount, benchmark.name, m, sizeMiB);
+            }
+        }
+    }
+    removeDatabase(options.path);
+    return 0;
+}
+
+// 1000, 10K, 100M
+bool parseCount(const std::string& str, uint64_t& count)
+{
+    char* end = nullptr;
+    const unsigned long long value = strtoull(str.c_str(), &end, 10);
+    uint64_t multiplier = 1;
+    if (*end == 'K' || *end == 'k')
+    {
+        multiplier = 1000;
+        ++end;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        multiplier = 1000000;
+        ++end;
+    }
+    else if (*end == 'G' || *end == 'g')
+    {
+        multiplier = 1000000000;
+        ++end;
+    }
+    count = value * multiplier;
+    return !str.empty() && end != str.c_str() && *end == '\0';
+}
+
+bool parseRate(const std::string& str, double& rate)
+{
+    char* end = nullptr;
+    rate = strtod(str.c_str(), &end);
+    return !str.empty() && *end == '\0' && rate >= 0 && rate <= 1;
+}
+
+void printHelp()
+{
+    std::cout << "Usage: " << std::endl;
+    std::cout << "    profitDrainBench [options] - benchmark the operations on databases of 1K, 10K, ... records"
+              << std::endl;
+    std::cout << "    profitDrainBench -x=generate -o=<database file> [options] - write a synthetic database" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "    --records=<Records to generate, default 1M>" << std::endl;
+    std::cout << "    --max-records=<Biggest database benchmarked, default 1M, up to 100M and more>" << std::endl;
+    std::cout << "    --format=<v1|v2|v3 (compressed), default all of them for the benchmark and v2 for generate>"
+              << std::endl;
+    std::cout << "    --note-length=<Mean note length, default 24>" << std::endl;
+    std::cout << "    --distinct-notes=<Number of different notes, default 200>" << std::endl;
+    std::cout << "    --failure-rate=<0 - 1, share of failed builds, default 0.15>" << std::endl;
+    std::cout << "    --interleave=<0 - 1, share of builds started while another one runs, default 0.05>"
+              << std::endl;
+    std::cout << "    --span-days=<Days the records span, default 365>" << std::endl;
+    std::cout << "    --seed=<Random seed, default 1>" << std::endl;
+    std::cout << "    --repeat=<Runs per benchmark, the fastest counts, default 3>" << std::endl;
+    std::cout << "    -o=<Database file, for the benchmark the scratch file, default profitDrainBench.db>" << std::endl;
+    std::cout << "Examples:" << std::endl;
+    std::cout << "    profitDrainBench --max-records=100M --format=v2" << std::endl;
+    std::cout << "    profitDrainBench -x=generate -o=t.db --records=10M --failure-rate=0.3 --format=v1" << std::endl;
+}
+} // namespace bench
+} // namespace pdrain
+
+int main(int argc, const char** argv)
+{
+    using namespace pdrain;
+    using namespace pdrain::bench;
+
+    BenchOptions options;
+    bool generate = false, formatSet = false;
+    const std::vector<std::pair<std::string, std::string>> arguments = ArgParser::parseArguments(argc - 1, argv + 1);
+    for (const auto& val : arguments)
+    {
+        bool valid = true;
+        if (val.first == "x")
+        {
+            generate = val.second == "generate";
+            valid = generate || val.second == "bench";
+        }
+        else if (val.first == "o")
+        {
+            options.path = val.second;
+            valid = !options.path.empty();
+        }
+        else if (val.first == "records")
+        {
+            valid = parseCount(val.second, options.generator.recordCount);
+        }
+        else if (val.first == "max-records")
+        {
+            valid = parseCount(val.second, options.maxRecords);
+        }
+        else if (val.first == "format")
+        {
+            int formatVersion = 0;
+            for (const int version : {dbLegacyVersion, dbVersion, dbCompressedVersion})
+            {
+                formatVersion = val.second == "v" + std::to_string(version) ? version : formatVersion;
+            }
+            options.formats = {formatVersion};
+            options.generator.formatVersion = formatVersion;
+            formatSet = true;
+            valid = formatVersion != 0;
+        }
+        else if (val.first == "note-length")
+        {
+            options.generator.meanNoteLength = strtod(val.second.c_str(), nullptr);
+            valid = options.generator.meanNoteLength >= 0;
+        }
+        else if (val.first == "distinct-notes")
+        {
+            uint64_t count = 0;
+            valid = parseCount(val.second, count) && count > 0 && count <= 1000000;
+            options.generator.distinctNotes = (uint32_t) count;
+        }
+        else if (val.first == "failure-rate")
+        {
+            valid = parseRate(val.second, options.generator.failureRate);
+        }
+        else if (val.first == "interleave")
+        {
+            valid = parseRate(val.second, options.generator.interleaveRate);
+        }
+        else if (val.first == "span-days")
+        {
+            options.generator.spanDays = atoi(val.second.c_str());
+            valid = options.generator.spanDays > 0;
+        }
+        else if (val.first == "seed")
+        {
+            valid = parseCount(val.second, options.generator.seed);
+        }
+        else if (val.first == "repeat")
+        {
+            options.repeat = atoi(val.second.c_str());
+            valid = options.repeat > 0;
+        }
+        else
+        {
+            valid = false;
+        }
+
+        if (!valid)
+        {
+            std::cerr << "Invalid parameter: " << val.first << " and value: " << val.second << std::endl << std::endl;
+            printHelp();
+            return -1;
+        }
+    }
+
+    if (generate)
+    {
+        if (!formatSet)
+        {
+            options.generator.formatVersion = dbVersion;
+        }
+        return generateDatabase(options.path, options.generator);
+    }
+    return runBenchmarks(options);
+}
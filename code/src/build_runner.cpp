@@ -0,0 +1,303 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "build_runner.h"
+
+#include <chrono>
+#include <iostream>
+
+#if defined(_WIN64) || defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__APPLE__) || defined(__linux__)
+#include <errno.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#error "NIMBY"
+#endif
+
+namespace pdrain
+{
+#if defined(_WIN64) || defined(_WIN32)
+// Quotes an argument the way CommandLineToArgvW / the MSVC runtime splits them.
+static std::string quoteArgument(const std::string& argument)
+{
+    if (!argument.empty() && argument.find_first_of(" \t\n\v\"") == std::string::npos)
+    {
+        return argument;
+    }
+
+    std::string quoted = "\"";
+    size_t backslashes = 0;
+    for (const char c : argument)
+    {
+        if (c == '\\')
+        {
+            ++backslashes;
+            continue;
+        }
+        quoted.append(c == '"' ? backslashes * 2 + 1 : backslashes, '\\');
+        backslashes = 0;
+        quoted.push_back(c);
+    }
+    quoted.append(backslashes * 2, '\\');
+    quoted.push_back('"');
+    return quoted;
+}
+
+static int64_t fileTimeToMicroseconds(const LARGE_INTEGER& time)
+{
+    // FILETIME and the job accounting times count 100 ns intervals.
+    return time.QuadPart / 10;
+}
+
+static int spawnAndWait(const std::vector<std::string>& command, int& exitCode, DbUsageRecord& usage)
+{
+    std::string commandLine;
+    for (const std::string& argument : command)
+    {
+        commandLine += (commandLine.empty() ? "" : " ") + quoteArgument(argument);
+    }
+
+    // Ctrl+C reaches every process attached to the console, the child decides what to do with it.
+    SetConsoleCtrlHandler(nullptr, TRUE);
+    STARTUPINFOA startupInfo = {};
+    startupInfo.cb = sizeof(startupInfo);
+    PROCESS_INFORMATION processInfo = {};
+    if (!CreateProcessA(nullptr,
+                        &commandLine[0],
+                        nullptr,
+                        nullptr,
+                        TRUE,
+                        CREATE_SUSPENDED,
+                        nullptr,
+                        nullptr,
+                        &startupInfo,
+                        &processInfo))
+    {
+        std::cerr << "Failed to start: " << command[0] << std::endl;
+        SetConsoleCtrlHandler(nullptr, FALSE);
+        return -5;
+    }
+
+    // The job accounts for every process the build starts, not just the one started here. If the child can't be put
+    // in a job (e.g. nested jobs before Windows 8) only its own usage is known.
+    HANDLE job = CreateJobObjectA(nullptr, nullptr);
+    if (job && !AssignProcessToJobObject(job, processInfo.hProcess))
+    {
+        CloseHandle(job);
+        job = nullptr;
+    }
+    ResumeThread(processInfo.hThread);
+
+    WaitForSingleObject(processInfo.hProcess, INFINITE);
+    DWORD processExitCode = 1;
+    GetExitCodeProcess(processInfo.hProcess, &processExitCode);
+
+    JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION accounting = {};
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+    if (job &&
+        QueryInformationJobObject(
+            job, JobObjectBasicAndIoAccountingInformation, &accounting, sizeof(accounting), nullptr) &&
+        QueryInformationJobObject(job, JobObjectExtendedLimitInformation, &limits, sizeof(limits), nullptr))
+    {
+        usage.userTime = fileTimeToMicroseconds(accounting.BasicInfo.TotalUserTime);
+        usage.systemTime = fileTimeToMicroseconds(accounting.BasicInfo.TotalKernelTime);
+        usage.maxRss = (int64_t) (limits.PeakProcessMemoryUsed / 1024);
+        usage.blockInputs = (int64_t) accounting.IoInfo.ReadOperationCount;
+        usage.blockOutputs = (int64_t) accounting.IoInfo.WriteOperationCount;
+    }
+    else
+    {
+        FILETIME creationTime, exitTime, kernelTime, userTime;
+        if (GetProcessTimes(processInfo.hProcess, &creationTime, &exitTime, &kernelTime, &userTime))
+        {
+            LARGE_INTEGER time;
+            time.LowPart = userTime.dwLowDateTime;
+            time.HighPart = (LONG) userTime.dwHighDateTime;
+            usage.userTime = fileTimeToMicroseconds(time);
+            time.LowPart = kernelTime.dwLowDateTime;
+            time.HighPart = (LONG) kernelTime.dwHighDateTime;
+            usage.systemTime = fileTimeToMicroseconds(time);
+        }
+        IO_COUNTERS ioCounters;
+        if (GetProcessIoCounters(processInfo.hProcess, &ioCounters))
+        {
+            usage.blockInputs = (int64_t) ioCounters.ReadOperationCount;
+            usage.blockOutputs = (int64_t) ioCounters.WriteOperationCount;
+        }
+    }
+    // Windows doesn't count context switches per process.
+
+    if (job)
+    {
+        CloseHandle(job);
+    }
+    CloseHandle(processInfo.hThread);
+    CloseHandle(processInfo.hProcess);
+    SetConsoleCtrlHandler(nullptr, FALSE);
+
+    exitCode = (int) processExitCode;
+    return 0;
+}
+#else
+static volatile pid_t childPid = 0;
+
+static void forwardSignal(int signalNumber)
+{
+    if (childPid > 0)
+    {
+        kill(childPid, signalNumber);
+    }
+}
+
+static int64_t timevalToMicroseconds(const struct timeval& time)
+{
+    return (int64_t) time.tv_sec * 1000000 + time.tv_usec;
+}
+
+static int spawnAndWait(const std::vector<std::string>& command, int& exitCode, DbUsageRecord& usage)
+{
+    std::vector<char*> argv;
+    for (const std::string& argument : command)
+    {
+        argv.push_back((char*) argument.c_str());
+    }
+    argv.push_back(nullptr);
+
+    const int forwardedSignals[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2};
+    struct sigaction forward = {};
+    forward.sa_handler = forwardSignal;
+    sigemptyset(&forward.sa_mask);
+    forward.sa_flags = SA_RESTART;
+    struct sigaction previous[sizeof(forwardedSignals) / sizeof(forwardedSignals[0])];
+    const auto restoreHandlers = [&]() {
+        for (size_t i = 0; i < sizeof(forwardedSignals) / sizeof(forwardedSignals[0]); ++i)
+        {
+            sigaction(forwardedSignals[i], &previous[i], nullptr);
+        }
+    };
+
+    // The handlers are in place before the fork, with the signals blocked until childPid is set: a Ctrl+C that comes
+    // in between is forwarded once the parent unblocks it, rather than killing the parent and orphaning the build.
+    sigset_t blocked, previousMask;
+    sigemptyset(&blocked);
+    for (size_t i = 0; i < sizeof(forwardedSignals) / sizeof(forwardedSignals[0]); ++i)
+    {
+        sigaddset(&blocked, forwardedSignals[i]);
+    }
+    sigprocmask(SIG_BLOCK, &blocked, &previousMask);
+    for (size_t i = 0; i < sizeof(forwardedSignals) / sizeof(forwardedSignals[0]); ++i)
+    {
+        sigaction(forwardedSignals[i], &forward, &previous[i]);
+    }
+
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        restoreHandlers();
+        sigprocmask(SIG_SETMASK, &previousMask, nullptr);
+        std::cerr << "Failed to start: " << command[0] << std::endl;
+        return -5;
+    }
+    if (pid == 0)
+    {
+        // The command gets the handlers and the mask profitDrain was started with.
+        restoreHandlers();
+        sigprocmask(SIG_SETMASK, &previousMask, nullptr);
+        execvp(argv[0], argv.data());
+        std::cerr << "Failed to execute: " << command[0] << std::endl;
+        _exit(127);
+    }
+
+    childPid = pid;
+    sigprocmask(SIG_SETMASK, &previousMask, nullptr);
+
+    // The usage wait4 returns covers the child and all of its descendants it waited for, which is the whole build
+    // unless something in it leaves orphans behind.
+    int status = 0;
+    struct rusage resources = {};
+    pid_t waitResult;
+    while ((waitResult = wait4(pid, &status, 0, &resources)) < 0 && errno == EINTR)
+    {
+    }
+
+    restoreHandlers();
+    childPid = 0;
+
+    if (waitResult < 0)
+    {
+        std::cerr << "Failed to wait for: " << command[0] << std::endl;
+        return -5;
+    }
+    // Same convention as the shells use for $?.
+    exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    usage.userTime = timevalToMicroseconds(resources.ru_utime);
+    usage.systemTime = timevalToMicroseconds(resources.ru_stime);
+#if defined(__APPLE__)
+    usage.maxRss = resources.ru_maxrss / 1024; // Bytes on macOS
+#else
+    usage.maxRss = resources.ru_maxrss;
+#endif
+    usage.blockInputs = resources.ru_inblock;
+    usage.blockOutputs = resources.ru_oublock;
+    usage.voluntaryContextSwitches = resources.ru_nvcsw;
+    usage.involuntaryContextSwitches = resources.ru_nivcsw;
+    return 0;
+}
+#endif
+
+int runBuild(const std::vector<std::string>& command, BuildRunResult& result)
+{
+    if (command.empty())
+    {
+        std::cerr << "No command to run!" << std::endl;
+        return -1;
+    }
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    result.usage = {};
+    const int spawnResult = spawnAndWait(command, result.exitCode, result.usage);
+
+    result.duration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    result.usage.wallTime = result.duration;
+    return spawnResult;
+}
+} // namespace pdrain
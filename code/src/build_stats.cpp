@@ -0,0 +1,682 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "build_stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <time.h>
+
+namespace pdrain
+{
+void gimmeTime(const time_t* theTime, struct tm* result)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    gmtime_s(result, theTime);
+#elif defined(__APPLE__)
+    gmtime_r(theTime, result);
+#elif defined(__linux__)
+    gmtime_r(theTime, result);
+#else
+#error "NIMBY"
+#endif
+}
+
+std::string computeDateStr(int64_t timestamp)
+{
+    struct tm tmbuff;
+    gimmeTime((time_t*) &timestamp, &tmbuff);
+    // gmtime_s(&tmbuff, &timestamp);
+    const std::string dmy = std::to_string(tmbuff.tm_mday) + "." + std::to_string(tmbuff.tm_mon + 1) + "." +
+                            std::to_string(tmbuff.tm_year + 1900);
+    return dmy;
+}
+
+int64_t computeDayIndex(int64_t timestampMs)
+{
+    // Floor division, so timestamps before the epoch end up in the right day too.
+    return timestampMs >= 0 ? timestampMs / millisecondsPerDay : -((-timestampMs - 1) / millisecondsPerDay) - 1;
+}
+
+int64_t computeHourIndex(int64_t timestampMs)
+{
+    return timestampMs >= 0 ? timestampMs / millisecondsPerHour : -((-timestampMs - 1) / millisecondsPerHour) - 1;
+}
+
+int64_t daysFromCivil(int64_t year, int month, int day)
+{
+    // Counted in 400 year eras starting on the 1st of March, so the leap day is the last day of the year.
+    year -= month <= 2 ? 1 : 0;
+    const int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const int64_t yearOfEra = year - era * 400;
+    const int64_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    const int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+bool parseGraphBucket(const std::string& name, GraphBucket& bucket)
+{
+    if (name == "hour")
+    {
+        bucket = GraphBucket::HOUR;
+    }
+    else if (name == "day")
+    {
+        bucket = GraphBucket::DAY;
+    }
+    else if (name == "week")
+    {
+        bucket = GraphBucket::WEEK;
+    }
+    else if (name == "month")
+    {
+        bucket = GraphBucket::MONTH;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+const char* graphBucketName(GraphBucket bucket)
+{
+    const char* const names[] = {"hour", "day", "week", "month"};
+    return names[(int) bucket];
+}
+
+int64_t graphColumnIndex(GraphBucket bucket, int64_t timestampMs)
+{
+    const int64_t day = computeDayIndex(timestampMs);
+    if (bucket == GraphBucket::HOUR)
+    {
+        return computeHourIndex(timestampMs);
+    }
+    if (bucket == GraphBucket::WEEK)
+    {
+        // The epoch was a Thursday, week 0 starts on the Monday before it.
+        return day + 3 >= 0 ? (day + 3) / 7 : -((-(day + 3) - 1) / 7) - 1;
+    }
+    if (bucket == GraphBucket::MONTH)
+    {
+        const time_t dayStart = (time_t) (day * (millisecondsPerDay / 1000));
+        struct tm date;
+        gimmeTime(&dayStart, &date);
+        return (int64_t) (date.tm_year + 1900) * 12 + date.tm_mon;
+    }
+    return day;
+}
+
+int64_t graphColumnStart(GraphBucket bucket, int64_t column)
+{
+    if (bucket == GraphBucket::HOUR)
+    {
+        return column * millisecondsPerHour;
+    }
+    if (bucket == GraphBucket::WEEK)
+    {
+        return (column * 7 - 3) * millisecondsPerDay;
+    }
+    if (bucket == GraphBucket::MONTH)
+    {
+        const int64_t year = column >= 0 ? column / 12 : (column - 11) / 12;
+        return daysFromCivil(year, (int) (column - year * 12) + 1, 1) * millisecondsPerDay;
+    }
+    return column * millisecondsPerDay;
+}
+
+std::vector<GraphColumn> graphColumns(const BuildGraphData& graph)
+{
+    // Prefix sums of the hours, oldest first: whatever its width, a column is the difference of two of them.
+    const size_t hourCount = graph.totalBuildTimes.size();
+    std::vector<int64_t> totalSums(hourCount + 1, 0);
+    std::vector<int64_t> countSums(hourCount + 1, 0);
+    for (size_t i = 0; i < hourCount; ++i)
+    {
+        totalSums[i + 1] = totalSums[i] + graph.totalBuildTimes[hourCount - 1 - i];
+        countSums[i + 1] = countSums[i] + graph.buildCounts[hourCount - 1 - i];
+    }
+
+    const int64_t firstHour = graph.lastHour - (int64_t) hourCount + 1;
+    const int64_t lastColumn = graphColumnIndex(graph.bucket, graph.lastHour * millisecondsPerHour);
+    std::vector<GraphColumn> columns(graph.width > 0 ? graph.width : 0);
+    for (size_t i = 0; i < columns.size(); ++i)
+    {
+        GraphColumn& column = columns[i];
+        const int64_t index = lastColumn - (int64_t) (columns.size() - 1 - i);
+        column.start = graphColumnStart(graph.bucket, index);
+        column.end = graphColumnStart(graph.bucket, index + 1);
+        const size_t from = (size_t) std::clamp<int64_t>(column.start / millisecondsPerHour - firstHour, 0, hourCount);
+        const size_t to = (size_t) std::clamp<int64_t>(column.end / millisecondsPerHour - firstHour, 0, hourCount);
+        column.totalBuildTime = totalSums[to] - totalSums[from];
+        column.buildCount = countSums[to] - countSums[from];
+    }
+    return columns;
+}
+
+void initBuildStats(StatOperationData& data, GraphBucket bucket, int width, int64_t tsNow)
+{
+    BuildGraphData& graph = data.buildGraphData;
+    const int64_t lastColumn = graphColumnIndex(bucket, tsNow);
+    graph.lastHour = graphColumnStart(bucket, lastColumn + 1) / millisecondsPerHour - 1;
+    graph.lastStart = INT64_MIN;
+    graph.bucket = bucket;
+    graph.width = width;
+    const int64_t firstHour = graphColumnStart(bucket, lastColumn - (width - 1)) / millisecondsPerHour;
+    graph.totalBuildTimes.assign((size_t) (graph.lastHour - firstHour + 1), 0);
+    graph.buildCounts.assign((size_t) (graph.lastHour - firstHour + 1), 0);
+}
+
+std::string_view groupKeyOf(std::string_view note, const std::string& groupBy)
+{
+    if (groupBy == "note")
+    {
+        return note;
+    }
+    // Tags are whitespace separated key=value words.
+    size_t position = 0;
+    while (position < note.size())
+    {
+        const size_t tagStart = note.find_first_not_of(" \t", position);
+        if (tagStart == std::string_view::npos)
+        {
+            break;
+        }
+        size_t tagEnd = note.find_first_of(" \t", tagStart);
+        tagEnd = tagEnd == std::string_view::npos ? note.size() : tagEnd;
+        const std::string_view tag = note.substr(tagStart, tagEnd - tagStart);
+        if (tag.size() > groupBy.size() && tag[groupBy.size()] == '=' && tag.compare(0, groupBy.size(), groupBy) == 0)
+        {
+            return tag.substr(groupBy.size() + 1);
+        }
+        position = tagEnd;
+    }
+    return std::string_view();
+}
+
+uint32_t groupOf(StatOperationData& data, std::string_view name)
+{
+    const uint32_t group = data.groupNames.intern(name);
+    if (group >= data.groups.size())
+    {
+        data.groups.resize(group + 1, BuildGroupStats());
+    }
+    return group;
+}
+
+// A build of the group that never stopped, or was stopped by a failing STOP.
+static void countFailedBuild(StatOperationData& data, uint32_t group)
+{
+    if (!data.groupBy.empty())
+    {
+        ++(data.groups[group].buildCount);
+    }
+}
+
+static void aggregateGroupBuild(StatOperationData& data, uint32_t group, bool success, size_t buildTime)
+{
+    BuildGroupStats& stats = data.groups[group];
+    ++(stats.buildCount);
+    if (success)
+    {
+        ++(stats.successfulBuildCount);
+        stats.totalBuildTime += buildTime;
+    }
+    if (buildTime > stats.maxBuildTime)
+    {
+        stats.maxBuildTime = buildTime;
+    }
+}
+
+static void aggregateBuild(StatOperationData& data,
+                           int64_t startTimestamp,
+                           uint32_t group,
+                           const RecordView& stopRecord)
+{
+    const bool success = stopRecord.exitCode == 0;
+    size_t buildTime = stopRecord.timestamp - startTimestamp;
+    if (buildTime >= 0)
+    {
+        if (success)
+        {
+            ++(data.successfulBuildCount);
+            ++(data.totalBuildCount);
+            data.totalBuildTime += buildTime;
+            // A STOP older than its START (clock changed during the build) has no meaningful duration.
+            if (stopRecord.timestamp >= startTimestamp)
+            {
+                data.buildTimeHistogram.record((int64_t) buildTime);
+            }
+        }
+        else
+        {
+            ++(data.totalBuildCount);
+        }
+    }
+    else
+    {
+        ++(data.totalBuildCount);
+    }
+
+    const uint64_t k = data.buildGraphData.lastHour - computeHourIndex(startTimestamp);
+    if (k < data.buildGraphData.totalBuildTimes.size() && success)
+    {
+        data.buildGraphData.totalBuildTimes[k] += buildTime;
+        data.buildGraphData.buildCounts[k] += 1;
+    }
+
+    if (success)
+    {
+        data.buildGraphData.lastStart = std::max(data.buildGraphData.lastStart, startTimestamp);
+        data.lastBuildTime = buildTime;
+        data.lastBuildTimestamp = stopRecord.timestamp;
+        data.lastBuildPosition = data.pairing.position;
+    }
+
+    if (buildTime > data.maxBuildTime)
+    {
+        data.maxBuildTime = buildTime;
+    }
+
+    if (!data.groupBy.empty())
+    {
+        aggregateGroupBuild(data, group, success, buildTime);
+    }
+    if (data.finishedBuilds)
+    {
+        data.finishedBuilds->push_back(FinishedBuild{startTimestamp, stopRecord.timestamp, stopRecord.exitCode, group});
+    }
+}
+
+// Without build ids a START is only paired with the STOP right after it. Every other record (a STOP without a START, or a START that is
+// not followed by a STOP) counts as a failed build. The very first record is never counted on its own.
+void aggregateRecord(StatOperationData& data, const RecordView& record)
+{
+    PairingState& pairing = data.pairing;
+    if (pairing.chunked && !pairing.lastStartedKnown)
+    {
+        pairing.lastStartedKnown = true;
+        if (record.buildId == 0 && record.operation == Operation::STOP)
+        {
+            pairing.deferred.push_back(DeferredRecord{record, pairing.position, DeferredRecord::FIRST_STOP});
+            return;
+        }
+    }
+    const uint32_t group = !data.groupBy.empty() && record.operation == Operation::START ?
+                               groupOf(data, groupKeyOf(record.text, data.groupBy)) :
+                               0;
+    if (record.buildId != 0)
+    {
+        if (record.operation == Operation::START)
+        {
+            const auto inserted = pairing.openBuilds.emplace(record.buildId, OpenBuild{record.timestamp, group});
+            if (!inserted.second)
+            {
+                // Same id started twice, the first one never stopped.
+                ++(data.totalBuildCount);
+                countFailedBuild(data, inserted.first->second.group);
+                inserted.first->second = OpenBuild{record.timestamp, group};
+            }
+            pairing.lastStartedBuildId = record.buildId;
+        }
+        else
+        {
+            pairing.lastStartedBuildId = 0;
+            const auto openBuild = pairing.openBuilds.find(record.buildId);
+            if (openBuild != pairing.openBuilds.end())
+            {
+                aggregateBuild(data, openBuild->second.startTimestamp, openBuild->second.group, record);
+                pairing.openBuilds.erase(openBuild);
+            }
+            else if (pairing.chunked)
+            {
+                pairing.deferred.push_back(DeferredRecord{record, pairing.position, DeferredRecord::ORPHAN_STOP});
+            }
+            else
+            {
+                ++(data.totalBuildCount);
+            }
+        }
+        return;
+    }
+
+    // start prints the build id, but a stop without --id is still paired with it when nothing came in between.
+    if (record.operation == Operation::STOP && pairing.lastStartedBuildId != 0)
+    {
+        const auto openBuild = pairing.openBuilds.find(pairing.lastStartedBuildId);
+        pairing.lastStartedBuildId = 0;
+        if (openBuild != pairing.openBuilds.end())
+        {
+            aggregateBuild(data, openBuild->second.startTimestamp, openBuild->second.group, record);
+            pairing.openBuilds.erase(openBuild);
+            return;
+        }
+    }
+    pairing.lastStartedBuildId = 0;
+
+    if (pairing.chunked && pairing.recordCount < 2)
+    {
+        // The first one may pair with the part before, or be the very first record; the second one is paired or not
+        // depending on that. The ones after it only depend on the part.
+        pairing.deferred.push_back(DeferredRecord{record, pairing.position, DeferredRecord::NEIGHBOUR});
+        ++(pairing.recordCount);
+        pairing.pendingStart = record.operation == Operation::START;
+    }
+    else if (pairing.recordCount++ > 0)
+    {
+        if (pairing.previousOperation == Operation::START && record.operation == Operation::STOP)
+        {
+            pairing.pendingStart = false;
+            aggregateBuild(data, pairing.previousTimestamp, pairing.previousGroup, record);
+        }
+        else
+        {
+            if (pairing.pendingStart)
+            {
+                ++(data.totalBuildCount);
+                countFailedBuild(data, pairing.previousGroup);
+            }
+            pairing.pendingStart = record.operation == Operation::START;
+            if (!pairing.pendingStart)
+            {
+                ++(data.totalBuildCount);
+            }
+        }
+    }
+    pairing.previousOperation = record.operation;
+    pairing.previousTimestamp = record.timestamp;
+    pairing.previousGroup = group;
+}
+
+void aggregateUsage(ResourceUsageStats& usage, const DbUsageRecord& record)
+{
+    ++(usage.buildCount);
+    usage.wallTime += record.wallTime;
+    usage.userTime += record.userTime;
+    usage.systemTime += record.systemTime;
+    usage.totalMaxRss += record.maxRss;
+    if (record.maxRss > usage.maxRss)
+    {
+        usage.maxRss = record.maxRss;
+    }
+    usage.blockInputs += record.blockInputs;
+    usage.blockOutputs += record.blockOutputs;
+    usage.voluntaryContextSwitches += record.voluntaryContextSwitches;
+    usage.involuntaryContextSwitches += record.involuntaryContextSwitches;
+}
+
+static PhaseStats& phaseOf(std::vector<PhaseStats>& phases, const std::string& path)
+{
+    for (PhaseStats& phase : phases)
+    {
+        if (phase.path == path)
+        {
+            return phase;
+        }
+    }
+    phases.push_back(PhaseStats());
+    phases.back().path = path;
+    return phases.back();
+}
+
+void aggregateSpans(std::vector<PhaseStats>& phases, const std::vector<DbSpanRecord>& spans)
+{
+    struct OpenSpan
+    {
+        std::string name;
+        int64_t timestamp;
+    };
+    std::unordered_map<uint64_t, std::vector<OpenSpan>> openSpans; // Build id -> spans open in it, innermost last
+    for (const DbSpanRecord& span : spans)
+    {
+        const std::string name(span.name, strnlen(span.name, sizeof(span.name)));
+        std::vector<OpenSpan>& stack = openSpans[span.buildId];
+        if (span.begin)
+        {
+            stack.push_back(OpenSpan{name, span.timestamp});
+            continue;
+        }
+
+        size_t open = stack.size();
+        while (open > 0 && !name.empty() && stack[open - 1].name != name)
+        {
+            --open;
+        }
+        if (open == 0)
+        {
+            continue;
+        }
+        const int64_t duration = span.timestamp - stack[open - 1].timestamp;
+        // A span-end older than its span-begin (clock changed in between) has no meaningful duration.
+        if (duration >= 0)
+        {
+            std::string path = stack[0].name;
+            for (size_t i = 1; i < open; ++i)
+            {
+                path += '/';
+                path += stack[i].name;
+            }
+            PhaseStats& phase = phaseOf(phases, path);
+            ++(phase.spanCount);
+            phase.totalTime += duration;
+            phase.histogram.record(duration);
+        }
+        stack.resize(open - 1);
+    }
+}
+
+// Adds the counters, everything but the last build and the pairing state.
+static void mergeBuildCounters(StatOperationData& target, const StatOperationData& source)
+{
+    target.totalBuildCount += source.totalBuildCount;
+    target.successfulBuildCount += source.successfulBuildCount;
+    target.compactedBuildCount += source.compactedBuildCount;
+    target.totalBuildTime += source.totalBuildTime;
+    if (source.maxBuildTime > target.maxBuildTime)
+    {
+        target.maxBuildTime = source.maxBuildTime;
+    }
+    target.buildTimeHistogram.merge(source.buildTimeHistogram);
+
+    // The group ids of the databases differ, the groups are matched by name.
+    for (uint32_t sourceGroup = 0; sourceGroup < source.groups.size(); ++sourceGroup)
+    {
+        const BuildGroupStats& sourceStats = source.groups[sourceGroup];
+        BuildGroupStats& stats = target.groups[groupOf(target, source.groupNames.name(sourceGroup))];
+        stats.buildCount += sourceStats.buildCount;
+        stats.successfulBuildCount += sourceStats.successfulBuildCount;
+        stats.totalBuildTime += sourceStats.totalBuildTime;
+        if (sourceStats.maxBuildTime > stats.maxBuildTime)
+        {
+            stats.maxBuildTime = sourceStats.maxBuildTime;
+        }
+    }
+
+    ResourceUsageStats& usage = target.usage;
+    const ResourceUsageStats& sourceUsage = source.usage;
+    usage.buildCount += sourceUsage.buildCount;
+    usage.wallTime += sourceUsage.wallTime;
+    usage.userTime += sourceUsage.userTime;
+    usage.systemTime += sourceUsage.systemTime;
+    usage.totalMaxRss += sourceUsage.totalMaxRss;
+    if (sourceUsage.maxRss > usage.maxRss)
+    {
+        usage.maxRss = sourceUsage.maxRss;
+    }
+    usage.blockInputs += sourceUsage.blockInputs;
+    usage.blockOutputs += sourceUsage.blockOutputs;
+    usage.voluntaryContextSwitches += sourceUsage.voluntaryContextSwitches;
+    usage.involuntaryContextSwitches += sourceUsage.involuntaryContextSwitches;
+
+    for (const PhaseStats& sourcePhase : source.phases)
+    {
+        PhaseStats& phase = phaseOf(target.phases, sourcePhase.path);
+        phase.spanCount += sourcePhase.spanCount;
+        phase.totalTime += sourcePhase.totalTime;
+        phase.histogram.merge(sourcePhase.histogram);
+    }
+
+    // The graphs of the two may have columns of different widths, their buckets end with the last hour of their last
+    // column.
+    BuildGraphData& graph = target.buildGraphData;
+    const BuildGraphData& sourceGraph = source.buildGraphData;
+    const int64_t shift = graph.lastHour - sourceGraph.lastHour;
+    graph.lastStart = std::max(graph.lastStart, sourceGraph.lastStart);
+    for (size_t i = 0; i < sourceGraph.totalBuildTimes.size(); ++i)
+    {
+        const uint64_t k = i + shift;
+        if (k < graph.totalBuildTimes.size())
+        {
+            graph.totalBuildTimes[k] += sourceGraph.totalBuildTimes[i];
+            graph.buildCounts[k] += sourceGraph.buildCounts[i];
+        }
+    }
+}
+
+// Adds the aggregates of another database, both must have been initialized with the same tsNow. Builds never pair
+// across databases, a START still waiting for its STOP at the end of the source counts as a failed build, the same way
+// finishBuildStats counts it.
+void mergeBuildStats(StatOperationData& target, const StatOperationData& source)
+{
+    if (source.successfulBuildCount > 0 &&
+        (target.successfulBuildCount == 0 || source.lastBuildTimestamp > target.lastBuildTimestamp))
+    {
+        target.lastBuildTime = source.lastBuildTime;
+        target.lastBuildTimestamp = source.lastBuildTimestamp;
+    }
+    mergeBuildCounters(target, source);
+
+    target.totalBuildCount += (source.pairing.pendingStart ? 1 : 0) + source.pairing.openBuilds.size();
+    if (!source.groupBy.empty() && source.pairing.pendingStart)
+    {
+        countFailedBuild(target, groupOf(target, source.groupNames.name(source.pairing.previousGroup)));
+    }
+    for (const auto& openBuild : source.pairing.openBuilds)
+    {
+        if (!source.groupBy.empty())
+        {
+            countFailedBuild(target, groupOf(target, source.groupNames.name(openBuild.second.group)));
+        }
+    }
+}
+
+// The deferred records are paired with what the records before the part left open, in the order of the part, then the
+// state at the end of the part replaces the one at its start. The one difference to reading the records in one go: a
+// build id started again in the part while its START before the part is still open only replaces that START if it is
+// still open at the end of the part. The older START is counted as a failed build either way, unless the id is
+// stopped once more after the part stopped it.
+void stitchBuildStats(StatOperationData& target, const StatOperationData& part)
+{
+    PairingState& pairing = target.pairing;
+    const auto targetGroupOf = [&](uint32_t group) {
+        return target.groupBy.empty() ? 0 : groupOf(target, part.groupNames.name(group));
+    };
+    for (const DeferredRecord& deferred : part.pairing.deferred)
+    {
+        pairing.position = deferred.position;
+        if (deferred.kind == DeferredRecord::ORPHAN_STOP)
+        {
+            pairing.lastStartedBuildId = 0;
+            const auto openBuild = pairing.openBuilds.find(deferred.record.buildId);
+            if (openBuild != pairing.openBuilds.end())
+            {
+                aggregateBuild(target, openBuild->second.startTimestamp, openBuild->second.group, deferred.record);
+                pairing.openBuilds.erase(openBuild);
+            }
+            else
+            {
+                ++(target.totalBuildCount);
+            }
+            continue;
+        }
+        if (deferred.kind == DeferredRecord::NEIGHBOUR)
+        {
+            // Its lastStartedBuildId was known, the record wasn't paired with it.
+            pairing.lastStartedBuildId = 0;
+        }
+        aggregateRecord(target, deferred.record);
+    }
+
+    if (part.successfulBuildCount > 0 &&
+        (target.successfulBuildCount == 0 || part.lastBuildPosition > target.lastBuildPosition))
+    {
+        target.lastBuildTime = part.lastBuildTime;
+        target.lastBuildTimestamp = part.lastBuildTimestamp;
+        target.lastBuildPosition = part.lastBuildPosition;
+    }
+    mergeBuildCounters(target, part);
+
+    for (const auto& openBuild : part.pairing.openBuilds)
+    {
+        const OpenBuild start{openBuild.second.startTimestamp, targetGroupOf(openBuild.second.group)};
+        const auto inserted = pairing.openBuilds.emplace(openBuild.first, start);
+        if (!inserted.second)
+        {
+            // Same id started twice, the first one never stopped.
+            ++(target.totalBuildCount);
+            countFailedBuild(target, inserted.first->second.group);
+            inserted.first->second = start;
+        }
+    }
+    if (part.pairing.recordCount > 2)
+    {
+        pairing.recordCount += part.pairing.recordCount - 2;
+        pairing.previousOperation = part.pairing.previousOperation;
+        pairing.previousTimestamp = part.pairing.previousTimestamp;
+        // Only a START has a group.
+        pairing.previousGroup =
+            part.pairing.previousOperation == Operation::START ? targetGroupOf(part.pairing.previousGroup) : 0;
+        pairing.pendingStart = part.pairing.pendingStart;
+    }
+    if (part.pairing.lastStartedKnown)
+    {
+        pairing.lastStartedBuildId = part.pairing.lastStartedBuildId;
+    }
+    pairing.position = part.pairing.position;
+}
+
+void finishBuildStats(StatOperationData& data)
+{
+    if (data.pairing.pendingStart)
+    {
+        // The last build never stopped.
+        ++(data.totalBuildCount);
+        countFailedBuild(data, data.pairing.previousGroup);
+        data.pairing.pendingStart = false;
+    }
+    // Builds that never stopped.
+    data.totalBuildCount += data.pairing.openBuilds.size();
+    for (const auto& openBuild : data.pairing.openBuilds)
+    {
+        countFailedBuild(data, openBuild.second.group);
+    }
+    data.pairing.openBuilds.clear();
+
+    data.avgBuildTime =
+        data.successfulBuildCount ? data.totalBuildTime / data.successfulBuildCount : data.totalBuildTime;
+}
+} // namespace pdrain
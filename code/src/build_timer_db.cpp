@@ -0,0 +1,1638 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "build_timer_db.h"
+#include "string_interner.h"
+
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+
+#if defined(_WIN64) || defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__APPLE__) || defined(__linux__)
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#error "NIMBY"
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#error "The version 2 database format is little endian, big endian hosts are not supported."
+#endif
+
+namespace pdrain
+{
+int32_t parseExitCode(std::string_view exitCode)
+{
+    if (exitCode == "0")
+    {
+        return 0;
+    }
+
+    // Only the exact "0" ever counted as a successful build, so "00" or "+0" must not turn into 0 here.
+    int32_t value = invalidExitCode;
+    const char* end = exitCode.data() + exitCode.size();
+    const std::from_chars_result result = std::from_chars(exitCode.data(), end, value);
+    if (result.ec != std::errc() || result.ptr != end || value == 0)
+    {
+        return invalidExitCode;
+    }
+    return value;
+}
+
+uint64_t generateBuildId()
+{
+    // Mixed with the clock in case random_device is deterministic on the platform.
+    std::random_device randomDevice;
+    uint64_t id = ((uint64_t) randomDevice() << 32) ^ randomDevice();
+    id ^= (uint64_t) std::chrono::high_resolution_clock::now().time_since_epoch().count() * 0x9E3779B97F4A7C15ull;
+    return id ? id : 1;
+}
+
+std::string notesPathFor(const std::string& path)
+{
+    return path + ".notes";
+}
+
+std::string usagePathFor(const std::string& path)
+{
+    return path + ".usage";
+}
+
+std::string spansPathFor(const std::string& path)
+{
+    return path + ".spans";
+}
+
+std::string rollupPathFor(const std::string& path)
+{
+    return path + ".rollup";
+}
+
+std::string segmentPathFor(const std::string& path, int year, int month)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%04d-%02d", year, month);
+    return path + suffix;
+}
+
+// Month of a segment path, year * 12 + month - 1, or -1 if the path doesn't end like a segment does (.YYYY-MM).
+static int segmentMonthOf(const std::string& path)
+{
+    const size_t suffixSize = 8;
+    if (path.size() < suffixSize || path[path.size() - suffixSize] != '.' || path[path.size() - 3] != '-')
+    {
+        return -1;
+    }
+    int year = 0, month = 0;
+    const char* const suffix = path.data() + path.size() - suffixSize;
+    const std::from_chars_result yearResult = std::from_chars(suffix + 1, suffix + 5, year);
+    const std::from_chars_result monthResult = std::from_chars(suffix + 6, suffix + 8, month);
+    if (yearResult.ec != std::errc() || yearResult.ptr != suffix + 5 || monthResult.ec != std::errc() ||
+        monthResult.ptr != suffix + 8 || month < 1 || month > 12)
+    {
+        return -1;
+    }
+    return year * 12 + month - 1;
+}
+
+int mapFile(const std::string& path, MappedFile& file)
+{
+    unmapFile(file);
+#if defined(_WIN64) || defined(_WIN32)
+    HANDLE fileHandle = CreateFileA(path.c_str(),
+                                    GENERIC_READ,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                    nullptr,
+                                    OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                                    nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+    {
+        return -2;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileHandle, &fileSize))
+    {
+        CloseHandle(fileHandle);
+        return -2;
+    }
+    if (fileSize.QuadPart == 0)
+    {
+        // Empty files can't be mapped, there is nothing to read anyway.
+        CloseHandle(fileHandle);
+        return 0;
+    }
+
+    HANDLE mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mappingHandle)
+    {
+        CloseHandle(fileHandle);
+        return -2;
+    }
+    const void* view = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+        CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+        return -2;
+    }
+
+    file.data = (const char*) view;
+    file.size = (size_t) fileSize.QuadPart;
+    file.fileHandle = fileHandle;
+    file.mappingHandle = mappingHandle;
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return -2;
+    }
+
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0)
+    {
+        ::close(fd);
+        return -2;
+    }
+    if (fileInfo.st_size == 0)
+    {
+        // Empty files can't be mapped, there is nothing to read anyway.
+        ::close(fd);
+        return 0;
+    }
+
+    void* view = mmap(nullptr, (size_t) fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file.
+    ::close(fd);
+    if (view == MAP_FAILED)
+    {
+        return -2;
+    }
+    // The records are walked front to back exactly once.
+    madvise(view, (size_t) fileInfo.st_size, MADV_SEQUENTIAL);
+
+    file.data = (const char*) view;
+    file.size = (size_t) fileInfo.st_size;
+#endif
+    return 0;
+}
+
+void unmapFile(MappedFile& file)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    if (file.data)
+    {
+        UnmapViewOfFile(file.data);
+    }
+    if (file.mappingHandle)
+    {
+        CloseHandle((HANDLE) file.mappingHandle);
+    }
+    if (file.fileHandle)
+    {
+        CloseHandle((HANDLE) file.fileHandle);
+    }
+    file.fileHandle = nullptr;
+    file.mappingHandle = nullptr;
+#else
+    if (file.data)
+    {
+        munmap((void*) file.data, file.size);
+    }
+#endif
+    file.data = nullptr;
+    file.size = 0;
+}
+
+void releaseMappedPages(MappedFile& file, size_t offset)
+{
+#if defined(__APPLE__) || defined(__linux__)
+    const size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t alignedSize = offset - offset % pageSize;
+    if (file.data && alignedSize > 0)
+    {
+        madvise((void*) file.data, alignedSize, MADV_DONTNEED);
+    }
+#endif
+}
+
+int fileIdentity(const std::string& path, FileIdentity& identity)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    HANDLE fileHandle = CreateFileA(path.c_str(),
+                                    0,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr,
+                                    OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL,
+                                    nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+    {
+        return -2;
+    }
+    BY_HANDLE_FILE_INFORMATION info;
+    const BOOL success = GetFileInformationByHandle(fileHandle, &info);
+    CloseHandle(fileHandle);
+    if (!success)
+    {
+        return -2;
+    }
+    identity.device = info.dwVolumeSerialNumber;
+    identity.inode = ((uint64_t) info.nFileIndexHigh << 32) | info.nFileIndexLow;
+#else
+    struct stat fileInfo;
+    if (::stat(path.c_str(), &fileInfo) != 0)
+    {
+        return -2;
+    }
+    identity.device = (uint64_t) fileInfo.st_dev;
+    identity.inode = (uint64_t) fileInfo.st_ino;
+#endif
+    return 0;
+}
+
+int replaceFile(const std::string& sourcePath, const std::string& targetPath)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    return MoveFileExA(sourcePath.c_str(), targetPath.c_str(), MOVEFILE_REPLACE_EXISTING) ? 0 : -2;
+#else
+    return rename(sourcePath.c_str(), targetPath.c_str()) == 0 ? 0 : -2;
+#endif
+}
+
+static bool endsWith(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void globFiles(const std::string& pattern, std::vector<std::string>& matches)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    const size_t separatorPos = pattern.find_last_of("/\\");
+    const std::string directory = separatorPos == std::string::npos ? "" : pattern.substr(0, separatorPos + 1);
+    WIN32_FIND_DATAA findData;
+    HANDLE findHandle = FindFirstFileA(pattern.c_str(), &findData);
+    if (findHandle != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                matches.push_back(directory + findData.cFileName);
+            }
+        } while (FindNextFileA(findHandle, &findData));
+        FindClose(findHandle);
+    }
+#else
+    glob_t globResult;
+    if (glob(pattern.c_str(), 0, nullptr, &globResult) == 0)
+    {
+        for (size_t i = 0; i < globResult.gl_pathc; ++i)
+        {
+            matches.push_back(globResult.gl_pathv[i]);
+        }
+    }
+    globfree(&globResult);
+#endif
+}
+
+void listSegments(const std::string& path, std::vector<std::string>& segmentPaths, std::vector<int>& months)
+{
+    std::vector<std::string> matches;
+    globFiles(path + ".????" "-??", matches); // Split, "??-" would be a trigraph
+    std::sort(matches.begin(), matches.end());
+    for (const std::string& match : matches)
+    {
+        const int month = segmentMonthOf(match);
+        if (month >= 0)
+        {
+            segmentPaths.push_back(match);
+            months.push_back(month);
+        }
+    }
+}
+
+int expandPathPattern(const std::string& pattern, std::vector<std::string>& paths)
+{
+    if (pattern.find_first_of("*?[") == std::string::npos)
+    {
+        paths.push_back(pattern);
+        return 0;
+    }
+
+    std::vector<std::string> matches;
+    globFiles(pattern, matches);
+
+    // The files kept next to a database are not databases themselves, segments are read with their database.
+    matches.erase(std::remove_if(matches.begin(),
+                                 matches.end(),
+                                 [](const std::string& path) {
+                                     return endsWith(path, ".notes") || endsWith(path, ".usage") ||
+                                            endsWith(path, ".spans") || endsWith(path, ".ckpt") ||
+                                            endsWith(path, ".sock") ||
+                                            endsWith(path, ".rollup") || endsWith(path, ".rwtmp") ||
+                                            endsWith(path, ".regressions") || endsWith(path, ".metrics") ||
+                                            endsWith(path, ".prom") || segmentMonthOf(path) >= 0 ||
+                                            path.find(".ckpt.tmp") != std::string::npos ||
+                                            path.find(".regressions.tmp") != std::string::npos ||
+                                            path.find(".metrics.tmp") != std::string::npos ||
+                                            path.find(".prom.tmp") != std::string::npos;
+                                 }),
+                  matches.end());
+    if (matches.empty())
+    {
+        return -2;
+    }
+    std::sort(matches.begin(), matches.end());
+    paths.insert(paths.end(), matches.begin(), matches.end());
+    return 0;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static void appendLittleEndian(std::string& out, uint64_t value, size_t size)
+{
+    out.append((const char*) &value, size);
+}
+
+// Encodes a record of a compressed database. state holds what the records before it encoded, hasPrevious is false
+// where an append starts.
+static void encodeCompressedRecord(const RecordView& record,
+                                   uint32_t noteOffset,
+                                   ReaderState& state,
+                                   bool& hasPrevious,
+                                   std::string& out)
+{
+    const bool isStop = record.operation == Operation::STOP;
+    uint8_t buildIdMode = dbNoBuildId;
+    if (record.buildId != 0)
+    {
+        buildIdMode = isStop && hasPrevious && record.buildId == state.lastStartedBuildId ? dbLastStartedBuildId :
+                                                                                             dbExplicitBuildId;
+    }
+
+    // The smallest size the delta fits in, the timestamp itself where an append starts or if it fits in none.
+    const uint64_t delta = zigzag(record.timestamp - state.previousTimestamp);
+    uint8_t timeSizeCode = 7;
+    for (uint8_t i = 0; hasPrevious && i < 7 && timeSizeCode == 7; ++i)
+    {
+        timeSizeCode = delta >> (dbTimeSizes[i] * 8) == 0 ? i : timeSizeCode;
+    }
+    const uint64_t time = timeSizeCode == 7 ? (uint64_t) record.timestamp : delta;
+    const uint32_t value = isStop ? (uint32_t) zigzag(record.exitCode) : noteOffset;
+    const uint8_t valueSizeCode = value == 0 ? 0 : (value <= 0xff ? 1 : (value <= 0xffff ? 2 : 3));
+
+    out.push_back((char) ((isStop ? dbTagStop : 0) | buildIdMode << dbTagBuildIdShift |
+                          timeSizeCode << dbTagTimeSizeShift | valueSizeCode << dbTagValueSizeShift));
+    appendLittleEndian(out, time, dbTimeSizes[timeSizeCode]);
+    appendLittleEndian(out, value, dbValueSizes[valueSizeCode]);
+    if (buildIdMode == dbExplicitBuildId)
+    {
+        appendLittleEndian(out, record.buildId, sizeof(record.buildId));
+    }
+
+    state.previousTimestamp = record.timestamp;
+    if (!isStop)
+    {
+        state.lastStartedBuildId = record.buildId;
+    }
+    hasPrevious = true;
+}
+
+// Sizes of the fields of a compressed record, computed rather than looked up in dbTimeSizes and dbValueSizes: the
+// position of the next record depends on them.
+static inline size_t compressedTimeSize(uint8_t tag)
+{
+    const size_t code = (tag >> dbTagTimeSizeShift) & 7;
+    return code + (code == 7);
+}
+
+static inline size_t compressedValueSize(uint8_t tag)
+{
+    const size_t code = tag >> dbTagValueSizeShift;
+    return code + (code == 3);
+}
+
+static inline size_t compressedRecordSize(uint8_t tag)
+{
+    return 1 + compressedTimeSize(tag) + compressedValueSize(tag) +
+           (((tag >> dbTagBuildIdShift) & 3) == dbExplicitBuildId ? sizeof(uint64_t) : 0);
+}
+
+// Sliced by 8: 8 bytes per step, through the tables of the remainders of the byte shifted by 0..7 bytes.
+struct Crc32Tables
+{
+    uint32_t table[8][256];
+
+    Crc32Tables()
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                crc = (crc >> 1) ^ (0xedb88320u & (0 - (crc & 1)));
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            for (int slice = 1; slice < 8; ++slice)
+            {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+uint32_t crc32(uint32_t crc, const void* data, size_t size)
+{
+    static const Crc32Tables tables;
+    const uint32_t(&table)[8][256] = tables.table;
+    const uint8_t* bytes = (const uint8_t*) data;
+    crc = ~crc;
+    for (; size >= 8; size -= 8, bytes += 8)
+    {
+        uint32_t low, high;
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^
+              table[4][low >> 24] ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+              table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+    for (; size > 0; --size, ++bytes)
+    {
+        crc = (crc >> 8) ^ table[0][(crc ^ *bytes) & 0xff];
+    }
+    return ~crc;
+}
+
+// Whether the bytes at the given file position are a sync marker.
+static bool isSyncMarker(const char* bytes, size_t available, uint64_t position)
+{
+    DbSyncMarker marker;
+    if (available < sizeof(marker))
+    {
+        return false;
+    }
+    memcpy(&marker, bytes, sizeof(marker));
+    return marker.tag == dbSyncTag && memcmp(marker.magic, dbSyncMagic, sizeof(dbSyncMagic)) == 0 &&
+           marker.position == position;
+}
+
+// Ends the block of the writer with a marker, the records after it are encoded from scratch.
+static void writeSyncMarker(CompressedBlockWriter& writer, std::string& out)
+{
+    DbSyncMarker marker = {};
+    marker.tag = dbSyncTag;
+    memcpy(marker.magic, dbSyncMagic, sizeof(dbSyncMagic));
+    marker.blockSize = writer.blockKnown ? (uint32_t) (writer.position - writer.blockStart) : 0;
+    marker.blockChecksum = writer.blockKnown ? writer.blockChecksum : 0;
+    marker.position = writer.position;
+    out.append((const char*) &marker, sizeof(marker));
+
+    writer.state = {};
+    writer.hasPrevious = false;
+    writer.position += sizeof(marker);
+    writer.blockStart = writer.position;
+    writer.blockChecksum = 0;
+    writer.blockKnown = true;
+}
+
+static void writeCompressedRecord(const RecordView& record,
+                                  uint32_t noteOffset,
+                                  CompressedBlockWriter& writer,
+                                  std::string& out)
+{
+    if (writer.position - writer.blockStart >= dbBlockSize)
+    {
+        writeSyncMarker(writer, out);
+    }
+    const size_t recordStart = out.size();
+    encodeCompressedRecord(record, noteOffset, writer.state, writer.hasPrevious, out);
+    writer.blockChecksum = crc32(writer.blockChecksum, out.data() + recordStart, out.size() - recordStart);
+    writer.position += out.size() - recordStart;
+}
+
+BuildTimerDbReader::~BuildTimerDbReader()
+{
+    close();
+}
+
+int BuildTimerDbReader::open(const std::string& filePath)
+{
+    close();
+    path = filePath;
+    end = 0;
+    if (mapFile(path, file) != 0)
+    {
+        std::cerr << "Failed to open input file: " << path << std::endl;
+        return -2;
+    }
+
+    if (file.size >= sizeof(dbMagic) && memcmp(file.data, dbMagic, sizeof(dbMagic)) == 0)
+    {
+        DbFileHeader header = {};
+        if (file.size >= sizeof(header))
+        {
+            memcpy(&header, file.data, sizeof(header));
+        }
+        const bool isCompressed = header.version == dbCompressedVersion;
+        if ((header.version != dbVersion && !isCompressed) || header.headerSize < sizeof(DbFileHeader) ||
+            header.headerSize > file.size || (!isCompressed && header.recordSize != dbRecordSize))
+        {
+            std::cerr << "Unsupported database format: " << path << std::endl;
+            close();
+            return -3;
+        }
+
+        formatVersion = header.version;
+        dataOffset = header.headerSize;
+        offset = dataOffset;
+        // A missing notes heap only means that the notes can't be shown.
+        mapFile(notesPathFor(path), notes);
+    }
+    end = file.size;
+    blockEnd = file.size;
+    if (formatVersion == dbCompressedVersion)
+    {
+        decoderState.blockStart = dataOffset;
+        enterBlock();
+    }
+    return 0;
+}
+
+void BuildTimerDbReader::close()
+{
+    unmapFile(file);
+    unmapFile(notes);
+    formatVersion = dbLegacyVersion;
+    dataOffset = 0;
+    offset = 0;
+    releasedOffset = 0;
+    decoderState = {};
+    blockEnd = 0;
+    end = 0;
+}
+
+// Offset of the first sync marker at or after from, the size of the file if there is none.
+size_t BuildTimerDbReader::findSyncMarker(size_t from) const
+{
+    const char* cursor = file.data + from;
+    const char* const last = file.data + file.size;
+    while ((size_t) (last - cursor) >= sizeof(DbSyncMarker))
+    {
+        cursor = (const char*) memchr(cursor, dbSyncTag, last - cursor - sizeof(DbSyncMarker) + 1);
+        if (!cursor)
+        {
+            break;
+        }
+        if (isSyncMarker(cursor, last - cursor, cursor - file.data))
+        {
+            return cursor - file.data;
+        }
+        ++cursor;
+    }
+    return file.size;
+}
+
+// Finds the end of the block of offset and checks it against the marker there. A block that doesn't match its
+// checksum is skipped, as well as one that doesn't end where the marker says it does: a marker of it was lost.
+void BuildTimerDbReader::enterBlock()
+{
+    const size_t marker = findSyncMarker(offset);
+    blockEnd = marker < end ? marker : end;
+    const size_t blockStart = decoderState.blockStart;
+    if (marker == file.size || blockStart == 0 || blockStart > offset)
+    {
+        return;
+    }
+    DbSyncMarker sync;
+    memcpy(&sync, file.data + marker, sizeof(sync));
+    if (sync.blockSize == 0 || (sync.blockSize == marker - blockStart &&
+                                crc32(0, file.data + blockStart, sync.blockSize) == sync.blockChecksum))
+    {
+        return;
+    }
+    std::cerr << "Skipping a corrupt block of " << marker - blockStart << " bytes at offset " << blockStart << ": "
+              << path << std::endl;
+    offset = blockEnd;
+}
+
+void BuildTimerDbReader::releaseConsumedPages()
+{
+    // Keeps the resident memory bounded while scanning databases that are bigger than the available RAM.
+    const size_t releaseInterval = 64 * 1024 * 1024;
+    if (offset - releasedOffset >= releaseInterval)
+    {
+        releaseMappedPages(file, offset);
+        releasedOffset = offset;
+    }
+}
+
+void BuildTimerDbReader::noteAt(uint64_t noteOffset, RecordView& record) const
+{
+    record.text = std::string_view();
+    if (noteOffset > 0 && notes.size >= dbNoteEntryHeaderSize && noteOffset <= notes.size - dbNoteEntryHeaderSize)
+    {
+        uint32_t noteSize;
+        memcpy(&noteSize, notes.data + noteOffset, sizeof(noteSize));
+        const size_t noteDataOffset = noteOffset + dbNoteEntryHeaderSize;
+        if (noteSize <= notes.size - noteDataOffset)
+        {
+            record.text = std::string_view(notes.data + noteDataOffset, noteSize);
+        }
+    }
+}
+
+bool BuildTimerDbReader::nextCompressed(RecordView& record)
+{
+    uint8_t tag = 0;
+    size_t size = 0;
+    while (true)
+    {
+        if (offset >= blockEnd)
+        {
+            if (blockEnd >= end)
+            {
+                return false;
+            }
+            // The sync marker, the next block is decoded from scratch.
+            offset = blockEnd + sizeof(DbSyncMarker);
+            decoderState = {0, 0, offset};
+            enterBlock();
+            continue;
+        }
+        tag = (uint8_t) file.data[offset];
+        size = compressedRecordSize(tag);
+        if (size <= blockEnd - offset && ((tag >> dbTagBuildIdShift) & 3) <= dbLastStartedBuildId)
+        {
+            break;
+        }
+        if (blockEnd == file.size)
+        {
+            // A record still being written, or bytes that aren't a record: nothing more to read either way.
+            return false;
+        }
+        // The block passed its checksum, this is a record whose write was torn. The appender started a new block
+        // after it.
+        offset = blockEnd;
+    }
+    const uint8_t buildIdMode = (tag >> dbTagBuildIdShift) & 3;
+
+    // The fields are read 8 bytes at a time and masked to their size, the last records are copied out first so the
+    // reads never run past the end of the file.
+    const uint8_t* cursor = (const uint8_t*) file.data + offset;
+    uint8_t last[1 + 8 + 4 + sizeof(uint64_t)] = {};
+    if (file.size - offset < sizeof(last))
+    {
+        memcpy(last, cursor, size);
+        cursor = last;
+    }
+    const size_t timeSize = compressedTimeSize(tag);
+    const size_t valueSize = compressedValueSize(tag);
+    uint64_t time, value, buildId;
+    memcpy(&time, cursor + 1, sizeof(time));
+    memcpy(&value, cursor + 1 + timeSize, sizeof(value));
+    memcpy(&buildId, cursor + 1 + timeSize + valueSize, sizeof(buildId));
+    time &= timeSize == 8 ? ~0ull : (1ull << (timeSize * 8)) - 1;
+    value &= (1ull << (valueSize * 8)) - 1;
+
+    // The state is kept in locals while decoding, the stores into the record could alias it otherwise.
+    ReaderState state = decoderState;
+    const bool isStop = (tag & dbTagStop) != 0;
+    state.previousTimestamp =
+        timeSize == 8 ? (int64_t) time : state.previousTimestamp + ((int64_t) (time >> 1) ^ -(int64_t) (time & 1));
+    buildId = buildIdMode == dbExplicitBuildId ? buildId :
+                                                 (buildIdMode == dbLastStartedBuildId ? state.lastStartedBuildId : 0);
+    if (!isStop)
+    {
+        state.lastStartedBuildId = buildId;
+    }
+    decoderState = state;
+    offset += size;
+
+    record.operation = isStop ? Operation::STOP : Operation::START;
+    record.timestamp = state.previousTimestamp;
+    record.buildId = buildId;
+    if (isStop)
+    {
+        record.exitCode = (int32_t) ((value >> 1) ^ (0 - (value & 1)));
+        record.text = std::string_view();
+    }
+    else
+    {
+        record.exitCode = 0;
+        noteAt(value, record);
+    }
+    releaseConsumedPages();
+    return true;
+}
+
+bool BuildTimerDbReader::next(RecordView& record)
+{
+    if (formatVersion == dbLegacyVersion)
+    {
+        return nextLegacy(record);
+    }
+    if (formatVersion == dbCompressedVersion)
+    {
+        return nextCompressed(record);
+    }
+
+    while (end - offset >= dbRecordSize)
+    {
+        DbRecord raw = {};
+        decodeRecord(file.data + offset, raw);
+        offset += dbRecordSize;
+
+        record.operation = (Operation) raw.operation;
+        if (record.operation != Operation::START && record.operation != Operation::STOP)
+        {
+            continue;
+        }
+
+        record.timestamp = raw.timestamp;
+        record.buildId = raw.buildId;
+        record.exitCode = record.operation == Operation::STOP ? raw.exitCode : 0;
+        record.text = std::string_view();
+        if (record.operation == Operation::START)
+        {
+            noteAt(raw.noteOffset, record);
+        }
+        releaseConsumedPages();
+        return true;
+    }
+    return false;
+}
+
+bool BuildTimerDbReader::seek(size_t position, const ReaderState& state)
+{
+    if (position < dataOffset || position > file.size ||
+        (formatVersion == dbVersion && (position - dataOffset) % dbRecordSize != 0))
+    {
+        return false;
+    }
+    offset = position;
+    releasedOffset = 0;
+    decoderState = state;
+    if (formatVersion == dbCompressedVersion)
+    {
+        enterBlock();
+    }
+    return true;
+}
+
+std::vector<size_t> BuildTimerDbReader::partPositions(size_t count, size_t minPartSize) const
+{
+    std::vector<size_t> positions;
+    if (formatVersion == dbLegacyVersion || count < 2 || end <= offset)
+    {
+        return positions;
+    }
+    const size_t partSize = std::max((end - offset) / count, std::max<size_t>(minPartSize, 1));
+    for (size_t position = offset + partSize; position < end && positions.size() + 1 < count; position += partSize)
+    {
+        // Records start at multiples of the record size, blocks at the sync markers.
+        size_t partStart = formatVersion == dbVersion ? position - (position - dataOffset) % dbRecordSize :
+                                                        findSyncMarker(position);
+        partStart = partStart < end ? partStart : end;
+        if (partStart < end && partStart > (positions.empty() ? offset : positions.back()))
+        {
+            positions.push_back(partStart);
+        }
+        position = partStart;
+    }
+    return positions;
+}
+
+bool BuildTimerDbReader::seekToPart(size_t position)
+{
+    if (formatVersion != dbCompressedVersion)
+    {
+        return seek(position);
+    }
+    if (position > file.size || !isSyncMarker(file.data + position, file.size - position, position))
+    {
+        return false;
+    }
+    const size_t blockStart = position + sizeof(DbSyncMarker);
+    return seek(blockStart, ReaderState{0, 0, blockStart});
+}
+
+void BuildTimerDbReader::limit(size_t position)
+{
+    end = position < file.size ? position : file.size;
+    blockEnd = blockEnd < end ? blockEnd : end;
+}
+
+uint64_t BuildTimerDbReader::seekToTimestamp(int64_t timestamp)
+{
+    if (formatVersion != dbVersion)
+    {
+        // Variable size records can only be scanned.
+        size_t recordStart = offset;
+        ReaderState recordStartState = decoderState;
+        uint64_t skipped = 0;
+        RecordView record;
+        while (next(record) && record.timestamp < timestamp)
+        {
+            recordStart = offset;
+            recordStartState = decoderState;
+            ++skipped;
+        }
+        if (formatVersion == dbCompressedVersion)
+        {
+            seek(recordStart, recordStartState);
+        }
+        else
+        {
+            offset = recordStart;
+        }
+        return skipped;
+    }
+
+    // Only the timestamps of the visited records are read, O(log n) pages are touched.
+    const size_t start = (offset - dataOffset) / dbRecordSize;
+    size_t first = start;
+    size_t last = (end - dataOffset) / dbRecordSize;
+    while (first < last)
+    {
+        const size_t middle = first + (last - first) / 2;
+        DbRecord raw = {};
+        decodeRecord(file.data + dataOffset + middle * dbRecordSize, raw);
+        if (raw.timestamp < timestamp)
+        {
+            first = middle + 1;
+        }
+        else
+        {
+            last = middle;
+        }
+    }
+    offset = dataOffset + first * dbRecordSize;
+    return first - start;
+}
+
+bool BuildTimerDbReader::nextLegacy(RecordView& record)
+{
+    // Record layout: Operation | int64_t timestamp | size_t text size | text bytes
+    const size_t headerSize = sizeof(Operation) + sizeof(int64_t) + sizeof(size_t);
+    while (offset < file.size)
+    {
+        const char* cursor = file.data + offset;
+        const Operation operation = (Operation) cursor[0];
+        if (operation != Operation::START && operation != Operation::STOP)
+        {
+            // Same as the old fread loop, unknown bytes are skipped one by one.
+            ++offset;
+            continue;
+        }
+
+        if (file.size - offset < headerSize)
+        {
+            // Incomplete record at the end of the file, most likely a write that is still in progress.
+            return false;
+        }
+
+        size_t textSize;
+        memcpy(&record.timestamp, cursor + sizeof(Operation), sizeof(int64_t));
+        memcpy(&textSize, cursor + sizeof(Operation) + sizeof(int64_t), sizeof(size_t));
+        if (textSize > file.size - offset - headerSize)
+        {
+            return false;
+        }
+
+        record.operation = operation;
+        record.buildId = 0;
+        record.text = std::string_view(cursor + headerSize, textSize);
+        record.exitCode = operation == Operation::STOP ? parseExitCode(record.text) : 0;
+        offset += headerSize + textSize;
+        releaseConsumedPages();
+        return true;
+    }
+    return false;
+}
+
+static DbFileHeader makeFileHeader(int version = dbVersion)
+{
+    DbFileHeader header = {};
+    memcpy(header.magic, dbMagic, sizeof(dbMagic));
+    header.version = version;
+    header.headerSize = sizeof(DbFileHeader);
+    header.recordSize = version == dbCompressedVersion ? 0 : dbRecordSize;
+    return header;
+}
+
+void encodeRecord(const DbRecord& raw, char* bytes)
+{
+    const bool isStop = raw.operation == (uint8_t) Operation::STOP;
+    const uint64_t timestamp = (uint64_t) raw.timestamp | (isStop ? dbStopBit : 0);
+    memcpy(bytes, &timestamp, sizeof(timestamp));
+    memcpy(bytes + 8, &raw.noteOffset, sizeof(raw.noteOffset));
+    memcpy(bytes + 12, &raw.buildId, sizeof(raw.buildId));
+}
+
+void decodeRecord(const char* bytes, DbRecord& raw)
+{
+    uint64_t timestamp;
+    memcpy(&timestamp, bytes, sizeof(timestamp));
+    memcpy(&raw.noteOffset, bytes + 8, sizeof(raw.noteOffset));
+    memcpy(&raw.buildId, bytes + 12, sizeof(raw.buildId));
+    const bool isStop = (timestamp & dbStopBit) != 0;
+    raw.timestamp = (int64_t) (timestamp & ~dbStopBit);
+    // Timestamps stay far below 2^48 ms, the 0xff bytes a torn record is filled up with don't.
+    const Operation operation = isStop ? Operation::STOP : Operation::START;
+    raw.operation = (uint8_t) (raw.timestamp >> 48 != 0 ? Operation::UNKNOWN : operation);
+}
+
+// A file opened for appending and locked for exclusive use until it is closed. Every append is a single write, so
+// readers and writers that don't take the lock still never see interleaved records.
+struct AppendFile
+{
+#if defined(_WIN64) || defined(_WIN32)
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+};
+
+static int openForAppend(const std::string& path, AppendFile& file)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    file.handle = CreateFileA(path.c_str(),
+                              GENERIC_READ | FILE_APPEND_DATA,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              nullptr,
+                              OPEN_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL,
+                              nullptr);
+    if (file.handle == INVALID_HANDLE_VALUE)
+    {
+        return -2;
+    }
+    OVERLAPPED overlapped = {};
+    if (!LockFileEx(file.handle, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped))
+    {
+        CloseHandle(file.handle);
+        file.handle = INVALID_HANDLE_VALUE;
+        return -2;
+    }
+#else
+    file.fd = ::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (file.fd < 0)
+    {
+        return -2;
+    }
+    if (flock(file.fd, LOCK_EX) != 0)
+    {
+        ::close(file.fd);
+        file.fd = -1;
+        return -2;
+    }
+    // rewriteDatabase replaces the file while holding the lock, whoever waited for it must append to the new one.
+    struct stat lockedInfo, currentInfo;
+    if (fstat(file.fd, &lockedInfo) == 0 && ::stat(path.c_str(), &currentInfo) == 0 &&
+        (lockedInfo.st_dev != currentInfo.st_dev || lockedInfo.st_ino != currentInfo.st_ino))
+    {
+        ::close(file.fd);
+        file.fd = -1;
+        return openForAppend(path, file);
+    }
+#endif
+    return 0;
+}
+
+static void closeAppendFile(AppendFile& file)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    if (file.handle != INVALID_HANDLE_VALUE)
+    {
+        // Closing the handle releases the lock.
+        CloseHandle(file.handle);
+        file.handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (file.fd >= 0)
+    {
+        // Closing the descriptor releases the lock.
+        ::close(file.fd);
+        file.fd = -1;
+    }
+#endif
+}
+
+static uint64_t appendFileSize(AppendFile& file)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    LARGE_INTEGER fileSize;
+    return GetFileSizeEx(file.handle, &fileSize) ? (uint64_t) fileSize.QuadPart : 0;
+#else
+    struct stat fileInfo;
+    return fstat(file.fd, &fileInfo) == 0 ? (uint64_t) fileInfo.st_size : 0;
+#endif
+}
+
+static size_t readAt(AppendFile& file, uint64_t offset, void* buffer, size_t size)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = (DWORD) offset;
+    overlapped.OffsetHigh = (DWORD) (offset >> 32);
+    DWORD bytesRead = 0;
+    return ReadFile(file.handle, buffer, (DWORD) size, &bytesRead, &overlapped) ? bytesRead : 0;
+#else
+    const ssize_t bytesRead = pread(file.fd, buffer, size, (off_t) offset);
+    return bytesRead > 0 ? (size_t) bytesRead : 0;
+#endif
+}
+
+static bool appendBytes(AppendFile& file, const std::string& bytes)
+{
+#if defined(_WIN64) || defined(_WIN32)
+    DWORD bytesWritten = 0;
+    return WriteFile(file.handle, bytes.data(), (DWORD) bytes.size(), &bytesWritten, nullptr) &&
+           bytesWritten == bytes.size();
+#else
+    return write(file.fd, bytes.data(), bytes.size()) == (ssize_t) bytes.size();
+#endif
+}
+
+void appendNoteEntry(std::string& out, std::string_view note)
+{
+    const uint32_t entrySize = (uint32_t) note.size();
+    out.append((const char*) &entrySize, sizeof(entrySize));
+    out.append(note.data(), note.size());
+    out.append((const char*) &entrySize, sizeof(entrySize));
+}
+
+// Appends only look for a note among the entries in the last noteLookbackSize bytes of the heap. A note is mostly used
+// again soon after it was first, and a heap of unique notes (commit hashes, CI job names) doesn't make every append
+// slower than the one before.
+static const size_t noteLookbackSize = 64 * 1024;
+
+// Looks the note up among the last entries of the notes heap and appends it if it isn't there. Called with the
+// database locked, which also serializes the writers of the heap.
+static int storeNote(const std::string& notesPath, std::string_view note, uint32_t& noteOffset)
+{
+    MappedFile heap;
+    mapFile(notesPath, heap);
+    const size_t heapSize = heap.size;
+    size_t entryEnd = heap.size;
+    while (entryEnd >= sizeof(dbNotesMagic) + dbNoteEntryOverhead && heap.size - entryEnd < noteLookbackSize)
+    {
+        uint32_t entrySize, headerEntrySize;
+        memcpy(&entrySize, heap.data + entryEnd - sizeof(entrySize), sizeof(entrySize));
+        if (entrySize > entryEnd - sizeof(dbNotesMagic) - dbNoteEntryOverhead)
+        {
+            break;
+        }
+        // The sizes don't match at the end of a torn entry, the entries before it are not looked at.
+        const size_t entryOffset = entryEnd - dbNoteEntryOverhead - entrySize;
+        memcpy(&headerEntrySize, heap.data + entryOffset, sizeof(headerEntrySize));
+        if (headerEntrySize != entrySize)
+        {
+            break;
+        }
+        const char* const entryData = heap.data + entryOffset + dbNoteEntryHeaderSize;
+        if (entrySize == note.size() && memcmp(entryData, note.data(), entrySize) == 0)
+        {
+            noteOffset = (uint32_t) entryOffset;
+            unmapFile(heap);
+            return 0;
+        }
+        entryEnd = entryOffset;
+    }
+    unmapFile(heap);
+
+    std::string entry;
+    if (heapSize == 0)
+    {
+        entry.append(dbNotesMagic, sizeof(dbNotesMagic));
+    }
+    const uint64_t newEntryOffset = heapSize == 0 ? sizeof(dbNotesMagic) : heapSize;
+    if (newEntryOffset + dbNoteEntryOverhead + note.size() > UINT32_MAX)
+    {
+        std::cerr << "The notes heap is full: " << notesPath << std::endl;
+        return -4;
+    }
+    appendNoteEntry(entry, note);
+
+    AppendFile f;
+    if (openForAppend(notesPath, f) != 0)
+    {
+        std::cerr << "Failed to open notes file: " << notesPath << std::endl;
+        return -2;
+    }
+    const bool written = appendBytes(f, entry);
+    closeAppendFile(f);
+    if (!written)
+    {
+        std::cerr << "Failed to write notes file: " << notesPath << std::endl;
+        return -2;
+    }
+
+    noteOffset = (uint32_t) newEntryOffset;
+    return 0;
+}
+
+// Continues the last block of a compressed database. Only the end of the file is read, the last sync marker is in it
+// unless the database was written before there were markers. A new block is started if the last one is not known, or
+// ends in a torn record or marker, so what was torn can't change how the appended records are decoded.
+static void resumeCompressedBlock(AppendFile& file,
+                                  uint64_t dataOffset,
+                                  uint64_t fileSize,
+                                  CompressedBlockWriter& writer,
+                                  std::string& out)
+{
+    const uint64_t windowSize = dbBlockSize + 2 * sizeof(DbSyncMarker);
+    const uint64_t windowStart = fileSize > dataOffset + windowSize ? fileSize - windowSize : dataOffset;
+    std::string window(fileSize > windowStart ? fileSize - windowStart : 0, '\0');
+    const bool windowRead = window.empty() || readAt(file, windowStart, &window[0], window.size()) == window.size();
+
+    // The block starts after the last marker, or after the header if the window reaches it.
+    bool blockKnown = windowRead && windowStart == dataOffset;
+    size_t blockStart = 0;
+    for (size_t i = window.size(); windowRead && i-- > 0;)
+    {
+        if (isSyncMarker(&window[i], window.size() - i, windowStart + i))
+        {
+            blockKnown = true;
+            blockStart = i + sizeof(DbSyncMarker);
+            break;
+        }
+    }
+
+    writer = {};
+    writer.position = fileSize;
+    writer.blockStart = blockKnown ? windowStart + blockStart : fileSize;
+    writer.blockKnown = blockKnown;
+    if (!blockKnown)
+    {
+        writeSyncMarker(writer, out);
+        return;
+    }
+    writer.blockChecksum = crc32(0, window.data() + blockStart, window.size() - blockStart);
+    size_t recordStart = blockStart;
+    while (recordStart < window.size() &&
+           (((uint8_t) window[recordStart] >> dbTagBuildIdShift) & 3) <= dbLastStartedBuildId)
+    {
+        recordStart += compressedRecordSize((uint8_t) window[recordStart]);
+    }
+    if (recordStart != window.size())
+    {
+        writeSyncMarker(writer, out);
+    }
+}
+
+int appendRecords(const std::string& path, const RecordView* records, size_t count)
+{
+    AppendFile f;
+    if (openForAppend(path, f) != 0)
+    {
+        std::cerr << "Failed to open output file: " << path << std::endl;
+        return -2;
+    }
+
+    DbFileHeader header = {};
+    const size_t headerBytes = readAt(f, 0, &header, sizeof(header));
+    const uint64_t fileSize = appendFileSize(f);
+    const bool isNewFile = fileSize == 0;
+    const bool isLegacy = !isNewFile && (headerBytes < sizeof(dbMagic) ||
+                                         memcmp(header.magic, dbMagic, sizeof(dbMagic)) != 0);
+    const bool isCompressed = !isNewFile && !isLegacy && header.version == dbCompressedVersion;
+    if (!isNewFile && !isLegacy && !isCompressed &&
+        (headerBytes < sizeof(header) || header.version != dbVersion || header.recordSize != dbRecordSize))
+    {
+        std::cerr << "Unsupported database format: " << path << std::endl;
+        closeAppendFile(f);
+        return -3;
+    }
+
+    std::string buffer;
+    if (!isLegacy && isNewFile)
+    {
+        header = makeFileHeader();
+        buffer.append((const char*) &header, sizeof(header));
+    }
+    CompressedBlockWriter encoder = {};
+    if (isCompressed)
+    {
+        resumeCompressedBlock(f, header.headerSize, fileSize, encoder, buffer);
+    }
+    else if (!isNewFile && !isLegacy && fileSize > header.headerSize &&
+             (fileSize - header.headerSize) % dbRecordSize != 0)
+    {
+        // A torn record, filled up so the records after it start where the readers expect them. Unless its timestamp
+        // made it to the disk it is skipped as one of an unknown operation.
+        buffer.append(dbRecordSize - (fileSize - header.headerSize) % dbRecordSize, '\xff');
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        const RecordView& record = records[i];
+        if (isLegacy)
+        {
+            const size_t textSize = record.text.size();
+            buffer.append((const char*) &record.operation, sizeof(record.operation));
+            buffer.append((const char*) &record.timestamp, sizeof(record.timestamp));
+            buffer.append((const char*) &textSize, sizeof(textSize));
+            buffer.append(record.text.data(), textSize);
+            continue;
+        }
+
+        DbRecord raw = {};
+        raw.timestamp = record.timestamp;
+        raw.operation = (uint8_t) record.operation;
+        raw.buildId = record.buildId;
+        if (record.operation == Operation::STOP)
+        {
+            raw.exitCode = record.exitCode;
+        }
+        else if (!record.text.empty())
+        {
+            if (storeNote(notesPathFor(path), record.text, raw.noteOffset) != 0)
+            {
+                closeAppendFile(f);
+                return -2;
+            }
+        }
+        if (isCompressed)
+        {
+            writeCompressedRecord(record, raw.noteOffset, encoder, buffer);
+            continue;
+        }
+        const size_t recordStart = buffer.size();
+        buffer.resize(recordStart + dbRecordSize);
+        encodeRecord(raw, &buffer[recordStart]);
+    }
+
+    const bool written = appendBytes(f, buffer);
+    closeAppendFile(f);
+    if (!written)
+    {
+        std::cerr << "Failed to write output file: " << path << std::endl;
+        return -2;
+    }
+    return 0;
+}
+
+int appendRecord(const std::string& path, const RecordView& record)
+{
+    return appendRecords(path, &record, 1);
+}
+
+// The usage and the spans files: a DbFileHeader followed by fixed size records. Newer versions of the record may be
+// larger, the header says how large.
+template <typename Record>
+static int appendFixedRecord(const std::string& filePath,
+                             const char (&magic)[8],
+                             int version,
+                             const Record& record,
+                             const char* kind)
+{
+    AppendFile f;
+    if (openForAppend(filePath, f) != 0)
+    {
+        std::cerr << "Failed to open " << kind << " file: " << filePath << std::endl;
+        return -2;
+    }
+
+    std::string buffer;
+    DbFileHeader header = {};
+    if (appendFileSize(f) == 0)
+    {
+        memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.headerSize = sizeof(DbFileHeader);
+        header.recordSize = sizeof(Record);
+        buffer.append((const char*) &header, sizeof(header));
+    }
+    else if (readAt(f, 0, &header, sizeof(header)) < sizeof(header) ||
+             memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != (uint32_t) version ||
+             header.recordSize < sizeof(Record))
+    {
+        std::cerr << "Unsupported " << kind << " file format: " << filePath << std::endl;
+        closeAppendFile(f);
+        return -3;
+    }
+
+    const size_t recordStart = buffer.size();
+    buffer.resize(recordStart + header.recordSize, '\0');
+    memcpy(&buffer[recordStart], &record, sizeof(record));
+    const bool written = appendBytes(f, buffer);
+    closeAppendFile(f);
+    if (!written)
+    {
+        std::cerr << "Failed to write " << kind << " file: " << filePath << std::endl;
+        return -2;
+    }
+    return 0;
+}
+
+template <typename Record>
+static int readFixedRecords(const std::string& filePath, const char (&magic)[8], int version, std::vector<Record>& records)
+{
+    MappedFile file;
+    DbFileHeader header = {};
+    if (mapFile(filePath, file) != 0 || file.size < sizeof(header))
+    {
+        // Not created yet, or its header is still being written.
+        unmapFile(file);
+        return 0;
+    }
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != (uint32_t) version ||
+        header.recordSize < sizeof(Record) || header.headerSize < sizeof(header) || header.headerSize > file.size)
+    {
+        unmapFile(file);
+        return -3;
+    }
+
+    for (size_t offset = header.headerSize; file.size - offset >= header.recordSize; offset += header.recordSize)
+    {
+        Record record;
+        memcpy(&record, file.data + offset, sizeof(record));
+        records.push_back(record);
+    }
+    unmapFile(file);
+    return 0;
+}
+
+int appendUsageRecord(const std::string& path, const DbUsageRecord& usage)
+{
+    return appendFixedRecord(usagePathFor(path), dbUsageMagic, dbUsageVersion, usage, "usage");
+}
+
+int readUsageRecords(const std::string& path, std::vector<DbUsageRecord>& records)
+{
+    return readFixedRecords(usagePathFor(path), dbUsageMagic, dbUsageVersion, records);
+}
+
+int appendSpanRecord(const std::string& path, const DbSpanRecord& span)
+{
+    return appendFixedRecord(spansPathFor(path), dbSpanMagic, dbSpanVersion, span, "spans");
+}
+
+int readSpanRecords(const std::string& path, std::vector<DbSpanRecord>& records)
+{
+    return readFixedRecords(spansPathFor(path), dbSpanMagic, dbSpanVersion, records);
+}
+
+DbFileWriter::~DbFileWriter()
+{
+    close();
+}
+
+int DbFileWriter::open(const std::string& targetPath, int version, const std::string& basePath)
+{
+    close();
+    path = targetPath;
+    formatVersion = version;
+    encoder = {};
+    encoder.position = sizeof(DbFileHeader);
+    encoder.blockStart = encoder.position;
+    encoder.blockKnown = true;
+    notes = StringInterner();
+    noteOffsets.clear();
+    notesSize = sizeof(dbNotesMagic);
+    result = 0;
+    out = fopen(path.c_str(), "wb");
+    notesOut = fopen(notesPathFor(path).c_str(), "wb");
+    if (!out || !notesOut)
+    {
+        std::cerr << "Failed to open output file: " << path << std::endl;
+        result = -2;
+        return result;
+    }
+
+    const DbFileHeader header = makeFileHeader(version);
+    fwrite(&header, 1, sizeof(header), out);
+    MappedFile heap;
+    if (!basePath.empty() && mapFile(notesPathFor(basePath), heap) == 0 && heap.size >= sizeof(dbNotesMagic) &&
+        memcmp(heap.data, dbNotesMagic, sizeof(dbNotesMagic)) == 0)
+    {
+        // Up to the last complete entry, a torn one at the end is left behind.
+        while (heap.size > notesSize && heap.size - notesSize >= dbNoteEntryHeaderSize)
+        {
+            uint32_t entrySize;
+            memcpy(&entrySize, heap.data + notesSize, sizeof(entrySize));
+            const size_t dataOffset = notesSize + dbNoteEntryHeaderSize;
+            if (entrySize > heap.size - notesSize - dbNoteEntryOverhead)
+            {
+                break;
+            }
+            // A note appended twice keeps the first offset.
+            if (notes.intern(std::string_view(heap.data + dataOffset, entrySize)) == noteOffsets.size())
+            {
+                noteOffsets.push_back((uint32_t) notesSize);
+            }
+            notesSize += dbNoteEntryOverhead + entrySize;
+        }
+        fwrite(heap.data, 1, notesSize, notesOut);
+    }
+    else
+    {
+        fwrite(dbNotesMagic, 1, sizeof(dbNotesMagic), notesOut);
+    }
+    unmapFile(heap);
+    return 0;
+}
+
+int DbFileWriter::write(const RecordView& record)
+{
+    if (result != 0)
+    {
+        return result;
+    }
+    DbRecord raw = {};
+    raw.timestamp = record.timestamp;
+    raw.operation = (uint8_t) record.operation;
+    raw.buildId = record.buildId;
+    if (record.operation == Operation::STOP)
+    {
+        raw.exitCode = record.exitCode;
+    }
+    else if (!record.text.empty())
+    {
+        const uint32_t note = notes.intern(record.text);
+        if (note == noteOffsets.size())
+        {
+            if (notesSize + dbNoteEntryOverhead + record.text.size() > UINT32_MAX)
+            {
+                std::cerr << "The notes heap is full: " << notesPathFor(path) << std::endl;
+                result = -4;
+                return result;
+            }
+            buffer.clear();
+            appendNoteEntry(buffer, record.text);
+            fwrite(buffer.data(), 1, buffer.size(), notesOut);
+            noteOffsets.push_back((uint32_t) notesSize);
+            notesSize += buffer.size();
+        }
+        raw.noteOffset = noteOffsets[note];
+    }
+
+    if (formatVersion == dbCompressedVersion)
+    {
+        buffer.clear();
+        writeCompressedRecord(record, record.operation == Operation::START ? raw.noteOffset : 0, encoder, buffer);
+        fwrite(buffer.data(), 1, buffer.size(), out);
+        return 0;
+    }
+    char bytes[dbRecordSize];
+    encodeRecord(raw, bytes);
+    fwrite(bytes, 1, sizeof(bytes), out);
+    return 0;
+}
+
+int DbFileWriter::close()
+{
+    if (!out && !notesOut)
+    {
+        return result;
+    }
+    if (result == 0 && ((out && ferror(out)) || (notesOut && ferror(notesOut))))
+    {
+        result = -2;
+    }
+    const bool outClosed = !out || fclose(out) == 0;
+    const bool notesClosed = !notesOut || fclose(notesOut) == 0;
+    out = nullptr;
+    notesOut = nullptr;
+    if (result == 0 && (!outClosed || !notesClosed))
+    {
+        result = -2;
+    }
+    if (result == -2)
+    {
+        std::cerr << "Failed to write output file: " << path << std::endl;
+    }
+    return result;
+}
+
+int convertDatabase(const std::string& path, const std::string& targetPath, int version)
+{
+    BuildTimerDbReader reader;
+    if (reader.open(path) != 0)
+    {
+        return -2;
+    }
+    if (reader.version() == version)
+    {
+        std::cerr << "The database is already in the version " << reader.version() << " format: " << path
+                  << std::endl;
+        return -3;
+    }
+
+    DbFileWriter writer;
+    if (writer.open(targetPath, version) != 0)
+    {
+        return writer.close();
+    }
+    RecordView record;
+    while (reader.next(record) && writer.write(record) == 0)
+    {
+    }
+    return writer.close();
+}
+
+int rewriteDatabase(const std::string& path,
+                    const std::function<int(BuildTimerDbReader& reader, DbFileWriter& writer)>& rewrite,
+                    const std::function<void(const std::string& rewrittenPath)>& rewritten)
+{
+    AppendFile lock;
+    if (openForAppend(path, lock) != 0)
+    {
+        std::cerr << "Failed to open output file: " << path << std::endl;
+        return -2;
+    }
+    BuildTimerDbReader reader;
+    if (reader.open(path) != 0)
+    {
+        closeAppendFile(lock);
+        return -2;
+    }
+    if (reader.version() == dbLegacyVersion)
+    {
+        std::cerr << "Convert the legacy database first: " << path << std::endl;
+        closeAppendFile(lock);
+        return -3;
+    }
+
+    const std::string tmpPath = path + ".rwtmp";
+    DbFileWriter writer;
+    // The new heap starts with the old one, so the old records resolve their notes in it just the same.
+    int result = writer.open(tmpPath, reader.version(), path);
+    if (result == 0)
+    {
+        result = rewrite(reader, writer);
+    }
+    const int writeResult = writer.close();
+    result = result != 0 ? result : writeResult;
+    reader.close();
+    if (result == 0 && rewritten)
+    {
+        rewritten(tmpPath);
+    }
+    // Readers don't take the lock. The notes go first: the old records still find their notes in the new heap, and the
+    // new records never see the old heap.
+    if (result == 0 && (replaceFile(notesPathFor(tmpPath), notesPathFor(path)) != 0 || replaceFile(tmpPath, path) != 0))
+    {
+        std::cerr << "Failed to replace the database: " << path << std::endl;
+        result = -2;
+    }
+    if (result != 0)
+    {
+        remove(tmpPath.c_str());
+        remove(notesPathFor(tmpPath).c_str());
+    }
+    closeAppendFile(lock);
+    return result;
+}
+} // namespace pdrain
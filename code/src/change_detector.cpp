@@ -0,0 +1,184 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "change_detector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace pdrain
+{
+static const float allowance = 0.75f;   // Deviations per build the sums let go, smaller shifts are not looked for
+static const float threshold = 8.0f;    // Sum of deviations that confirms a shift
+static const float maxDeviation = 3.0f; // What a single build can add to the sums
+static const float minScale = 0.1f;     // About 10%, builds vary that much without anything changing
+
+std::string regressionCheckpointPathFor(const std::string& path)
+{
+    return path + ".regressions";
+}
+
+// The log durations of the builds since from, at most the last windowSize of them.
+static std::vector<float> recentBuilds(const ChangeDetector& detector, uint64_t from)
+{
+    const uint64_t first = std::max(from, detector.buildCount - std::min<uint64_t>(detector.buildCount,
+                                                                                  ChangeDetector::windowSize));
+    std::vector<float> values;
+    for (uint64_t i = first; i < detector.buildCount; ++i)
+    {
+        values.push_back(detector.recent[i % ChangeDetector::windowSize]);
+    }
+    return values;
+}
+
+static float median(std::vector<float>& values)
+{
+    const auto middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    return *middle;
+}
+
+// The level of the builds since levelStart is what the next ones are compared to.
+static void calibrate(ChangeDetector& detector)
+{
+    std::vector<float> values = recentBuilds(detector, detector.levelStart);
+    detector.baseline = median(values);
+    for (float& value : values)
+    {
+        value = std::fabs(value - detector.baseline);
+    }
+    // The MAD times 1.4826 estimates the standard deviation of normally distributed values.
+    detector.scale = std::max(1.4826f * median(values), minScale);
+    detector.calibrated = 1;
+}
+
+bool detectChange(ChangeDetector& detector, int64_t startTimestamp, int64_t duration, ChangePoint& change)
+{
+    const float value = std::log((float) std::max<int64_t>(duration, 1));
+    const uint64_t build = detector.buildCount++;
+    detector.recent[build % ChangeDetector::windowSize] = value;
+    if (!detector.calibrated)
+    {
+        if (detector.buildCount - detector.levelStart >= ChangeDetector::calibrationSize)
+        {
+            calibrate(detector);
+        }
+        return false;
+    }
+
+    // A shift starts with the first build that takes a sum above zero.
+    if (detector.upper == 0)
+    {
+        detector.upperStart = build;
+        detector.upperStartTimestamp = startTimestamp;
+    }
+    if (detector.lower == 0)
+    {
+        detector.lowerStart = build;
+        detector.lowerStartTimestamp = startTimestamp;
+    }
+    const float deviation = std::clamp((value - detector.baseline) / detector.scale, -maxDeviation, maxDeviation);
+    detector.upper = std::max(0.0f, detector.upper + deviation - allowance);
+    detector.lower = std::max(0.0f, detector.lower - deviation - allowance);
+    if (detector.upper <= threshold && detector.lower <= threshold)
+    {
+        // The median of the few builds a level is calibrated with is off by a good part of their deviation, which
+        // would add up in one of the sums. It is refined with the builds that follow, up to a window of them, unless
+        // they are halfway to a shift already.
+        if (detector.buildCount - detector.levelStart <= ChangeDetector::windowSize &&
+            std::max(detector.upper, detector.lower) < threshold / 2)
+        {
+            calibrate(detector);
+        }
+        return false;
+    }
+
+    const bool slower = detector.upper > threshold;
+    const uint64_t shiftStart = slower ? detector.upperStart : detector.lowerStart;
+    std::vector<float> values = recentBuilds(detector, shiftStart);
+    change.timestamp = slower ? detector.upperStartTimestamp : detector.lowerStartTimestamp;
+    change.before = std::llround(std::exp(detector.baseline));
+    change.after = std::llround(std::exp(median(values)));
+    change.buildCount = (uint32_t) (detector.buildCount - shiftStart);
+    change.group = 0;
+
+    // The builds since the shift start the new level, it is calibrated once there are enough of them.
+    detector.levelStart = shiftStart;
+    detector.calibrated = 0;
+    detector.upper = 0;
+    detector.lower = 0;
+    if (detector.buildCount - detector.levelStart >= ChangeDetector::calibrationSize)
+    {
+        calibrate(detector);
+    }
+    return true;
+}
+
+// detector count | detectors | change count | changes
+void saveDetectors(std::string& out, const std::vector<ChangeDetector>& detectors, const std::vector<ChangePoint>& changes)
+{
+    const uint32_t detectorCount = (uint32_t) detectors.size();
+    const uint32_t changeCount = (uint32_t) changes.size();
+    out.append((const char*) &detectorCount, sizeof(detectorCount));
+    out.append((const char*) detectors.data(), detectors.size() * sizeof(ChangeDetector));
+    out.append((const char*) &changeCount, sizeof(changeCount));
+    out.append((const char*) changes.data(), changes.size() * sizeof(ChangePoint));
+}
+
+bool loadDetectors(std::string_view in, std::vector<ChangeDetector>& detectors, std::vector<ChangePoint>& changes)
+{
+    uint32_t detectorCount = 0, changeCount = 0;
+    if (in.size() < sizeof(detectorCount))
+    {
+        return false;
+    }
+    memcpy(&detectorCount, in.data(), sizeof(detectorCount));
+    in.remove_prefix(sizeof(detectorCount));
+    if (in.size() / sizeof(ChangeDetector) < detectorCount)
+    {
+        return false;
+    }
+    detectors.resize(detectorCount);
+    memcpy(detectors.data(), in.data(), detectorCount * sizeof(ChangeDetector));
+    in.remove_prefix(detectorCount * sizeof(ChangeDetector));
+
+    if (in.size() < sizeof(changeCount))
+    {
+        return false;
+    }
+    memcpy(&changeCount, in.data(), sizeof(changeCount));
+    in.remove_prefix(sizeof(changeCount));
+    if (in.size() != changeCount * sizeof(ChangePoint))
+    {
+        return false;
+    }
+    changes.resize(changeCount);
+    memcpy(changes.data(), in.data(), in.size());
+    return true;
+}
+} // namespace pdrain
@@ -0,0 +1,345 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "collector.h"
+
+#include <cstring>
+#include <iostream>
+
+#if defined(_WIN64) || defined(_WIN32)
+#elif defined(__APPLE__) || defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#else
+#error "NIMBY"
+#endif
+
+namespace pdrain
+{
+// Requests are small, anything bigger is not from profitDrain.
+static const uint32_t maxMessageSize = 16 * 1024 * 1024;
+
+std::string collectorSocketPath(const std::string& path)
+{
+    return path + ".sock";
+}
+
+#if defined(_WIN64) || defined(_WIN32)
+int collectorRequest(const std::string&, const std::string&, std::string&)
+{
+    return collectorNotRunning;
+}
+
+CollectorServer::~CollectorServer()
+{
+}
+
+int CollectorServer::open(const std::string&)
+{
+    std::cerr << "The collector is not supported on Windows!" << std::endl;
+    return -5;
+}
+
+void CollectorServer::close()
+{
+}
+
+bool CollectorServer::receive(int, std::vector<Request>&)
+{
+    return false;
+}
+
+void CollectorServer::respond(int, const std::string&)
+{
+}
+#else
+static bool makeAddress(const std::string& socketPath, sockaddr_un& address)
+{
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    return true;
+}
+
+static bool sendAll(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return false;
+        }
+        data += sent;
+        size -= (size_t) sent;
+    }
+    return true;
+}
+
+static bool sendMessage(int fd, const std::string& payload)
+{
+    const uint32_t size = (uint32_t) payload.size();
+    return sendAll(fd, (const char*) &size, sizeof(size)) && sendAll(fd, payload.data(), payload.size());
+}
+
+static bool receiveAll(int fd, char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t received = recv(fd, data, size, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return false;
+        }
+        data += received;
+        size -= (size_t) received;
+    }
+    return true;
+}
+
+static int connectTo(const std::string& socketPath)
+{
+    sockaddr_un address;
+    if (!makeAddress(socketPath, address))
+    {
+        return -1;
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (connect(fd, (const sockaddr*) &address, sizeof(address)) != 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int collectorRequest(const std::string& path, const std::string& request, std::string& response)
+{
+    const int fd = connectTo(collectorSocketPath(path));
+    if (fd < 0)
+    {
+        return collectorNotRunning;
+    }
+
+    // A collector that stopped responding must not hang the build.
+    timeval timeout = {};
+    timeout.tv_sec = 10;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    uint32_t size = 0;
+    bool success = sendMessage(fd, request) && receiveAll(fd, (char*) &size, sizeof(size)) && size <= maxMessageSize;
+    if (success)
+    {
+        response.resize(size);
+        success = receiveAll(fd, &response[0], size);
+    }
+    ::close(fd);
+    if (!success)
+    {
+        std::cerr << "No response from the collector: " << collectorSocketPath(path) << std::endl;
+        return -5;
+    }
+    return 0;
+}
+
+CollectorServer::~CollectorServer()
+{
+    close();
+}
+
+int CollectorServer::open(const std::string& path)
+{
+    close();
+    socketPath = collectorSocketPath(path);
+    sockaddr_un address;
+    if (!makeAddress(socketPath, address))
+    {
+        std::cerr << "The socket path is too long: " << socketPath << std::endl;
+        return -2;
+    }
+
+    // A socket file nobody listens on is left behind by a collector that didn't shut down cleanly.
+    const int existing = connectTo(socketPath);
+    if (existing >= 0)
+    {
+        ::close(existing);
+        std::cerr << "A collector is already running for the database: " << socketPath << std::endl;
+        socketPath.clear();
+        return -5;
+    }
+    unlink(socketPath.c_str());
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || bind(listenFd, (const sockaddr*) &address, sizeof(address)) != 0 || listen(listenFd, 128) != 0)
+    {
+        std::cerr << "Failed to listen on: " << socketPath << std::endl;
+        close();
+        return -2;
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+void CollectorServer::close()
+{
+    for (const Connection& connection : connections)
+    {
+        ::close(connection.fd);
+    }
+    connections.clear();
+    if (listenFd >= 0)
+    {
+        ::close(listenFd);
+        listenFd = -1;
+        unlink(socketPath.c_str());
+    }
+    socketPath.clear();
+}
+
+bool CollectorServer::readFrom(Connection& connection, std::vector<Request>& requests)
+{
+    char buffer[64 * 1024];
+    const ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+    if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return true;
+    }
+    if (received <= 0)
+    {
+        return false;
+    }
+    connection.received.append(buffer, (size_t) received);
+
+    uint32_t size = 0;
+    if (connection.received.size() < sizeof(size))
+    {
+        return true;
+    }
+    memcpy(&size, connection.received.data(), sizeof(size));
+    if (size > maxMessageSize)
+    {
+        return false;
+    }
+    if (connection.received.size() - sizeof(size) >= size)
+    {
+        requests.push_back(Request{connection.fd, connection.received.substr(sizeof(size), size)});
+        connection.received.clear();
+    }
+    return true;
+}
+
+bool CollectorServer::receive(int timeoutMs, std::vector<Request>& requests)
+{
+    for (bool first = true;; first = false)
+    {
+        std::vector<pollfd> fds;
+        fds.push_back(pollfd{listenFd, POLLIN, 0});
+        for (const Connection& connection : connections)
+        {
+            fds.push_back(pollfd{connection.fd, POLLIN, 0});
+        }
+        const int ready = poll(fds.data(), fds.size(), first ? timeoutMs : 0);
+        if (ready < 0)
+        {
+            return errno != EINTR;
+        }
+        if (ready == 0)
+        {
+            return true;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int client;
+            while ((client = accept(listenFd, nullptr, nullptr)) >= 0)
+            {
+                fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+                connections.push_back(Connection{client, std::string()});
+            }
+        }
+        // Connections are only dropped after all of them were polled, the indices of fds must stay valid.
+        std::vector<int> closed;
+        for (size_t i = 1; i < fds.size(); ++i)
+        {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                Connection& connection = connections[i - 1];
+                if (!readFrom(connection, requests))
+                {
+                    closed.push_back(connection.fd);
+                }
+            }
+        }
+        for (const int fd : closed)
+        {
+            respond(fd, std::string());
+        }
+    }
+}
+
+void CollectorServer::respond(int client, const std::string& response)
+{
+    for (size_t i = 0; i < connections.size(); ++i)
+    {
+        if (connections[i].fd == client)
+        {
+            // The response is small, the blocking send doesn't stall the collector for long.
+            fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);
+            if (!response.empty())
+            {
+                sendMessage(client, response);
+            }
+            ::close(client);
+            connections.erase(connections.begin() + i);
+            return;
+        }
+    }
+}
+#endif
+} // namespace pdrain
@@ -0,0 +1,273 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "db_generator.h"
+
+#include "build_timer_db.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <string_view>
+#include <vector>
+
+namespace pdrain
+{
+namespace
+{
+struct PendingStop
+{
+    int64_t timestamp;
+    uint64_t buildId;
+    int32_t exitCode;
+
+    bool operator>(const PendingStop& other) const
+    {
+        return timestamp > other.timestamp;
+    }
+};
+
+// Notes look like the ones people write: a few key=value tags, then free text.
+std::string makeNote(std::mt19937_64& random, size_t length, uint32_t index)
+{
+    static const char* const configurations[] = {"debug", "release", "asan"};
+    static const char* const words[] = {"fix", "link", "after", "rebase", "toolchain", "upgrade", "clean", "ci"};
+    std::string note = "target=t" + std::to_string(index % 7) + " cfg=" + configurations[index % 3];
+    while (note.size() < length)
+    {
+        note += " ";
+        note += words[random() % (sizeof(words) / sizeof(words[0]))];
+    }
+    note.resize(std::max<size_t>(length, 1));
+    return note;
+}
+
+class RecordWriter
+{
+public:
+    RecordWriter(FILE* out, int formatVersion) : out(out), formatVersion(formatVersion)
+    {
+    }
+
+    void write(Operation operation, int64_t timestamp, std::string_view text, int32_t exitCode, uint32_t noteOffset,
+               uint64_t buildId)
+    {
+        if (formatVersion == dbLegacyVersion)
+        {
+            const size_t textSize = text.size();
+            buffer.append((const char*) &operation, sizeof(operation));
+            buffer.append((const char*) &timestamp, sizeof(timestamp));
+            buffer.append((const char*) &textSize, sizeof(textSize));
+            buffer.append(text.data(), textSize);
+        }
+        else
+        {
+            DbRecord raw = {};
+            raw.timestamp = timestamp;
+            raw.operation = (uint8_t) operation;
+            raw.buildId = buildId;
+            if (operation == Operation::STOP)
+            {
+                raw.exitCode = exitCode;
+            }
+            else
+            {
+                raw.noteOffset = noteOffset;
+            }
+            char bytes[dbRecordSize];
+            encodeRecord(raw, bytes);
+            buffer.append(bytes, sizeof(bytes));
+        }
+        if (buffer.size() >= 1024 * 1024)
+        {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        fwrite(buffer.data(), 1, buffer.size(), out);
+        buffer.clear();
+    }
+
+private:
+    FILE* out;
+    int formatVersion;
+    std::string buffer;
+};
+} // namespace
+
+int generateDatabase(const std::string& path, const GeneratorOptions& options)
+{
+    if (options.formatVersion == dbCompressedVersion)
+    {
+        // Generated in the version 2 format, then encoded the same way convert encodes it.
+        GeneratorOptions fixedOptions = options;
+        fixedOptions.formatVersion = dbVersion;
+        const std::string fixedPath = path + ".gentmp";
+        int result = generateDatabase(fixedPath, fixedOptions);
+        result = result != 0 ? result : convertDatabase(fixedPath, path, dbCompressedVersion);
+        remove(fixedPath.c_str());
+        remove(notesPathFor(fixedPath).c_str());
+        return result;
+    }
+    if (options.formatVersion != dbLegacyVersion && options.formatVersion != dbVersion)
+    {
+        std::cerr << "Unsupported database format version: " << options.formatVersion << std::endl;
+        return -3;
+    }
+
+    FILE* out = fopen(path.c_str(), "wb");
+    FILE* notesOut = options.formatVersion == dbVersion ? fopen(notesPathFor(path).c_str(), "wb") : nullptr;
+    if (!out || (options.formatVersion == dbVersion && !notesOut))
+    {
+        std::cerr << "Failed to open output file: " << path << std::endl;
+        if (out)
+        {
+            fclose(out);
+        }
+        if (notesOut)
+        {
+            fclose(notesOut);
+        }
+        return -2;
+    }
+
+    std::mt19937_64 random(options.seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::exponential_distribution<double> noteLength(1.0 / std::max(options.meanNoteLength, 1.0));
+    std::lognormal_distribution<double> buildTime(std::log(std::max(options.medianBuildTime, 0.001) * 1000.0), 0.6);
+
+    // The pool of notes, written to the heap up front so every START only references one.
+    std::vector<std::string> notes(std::max<uint32_t>(options.distinctNotes, 1));
+    std::vector<uint32_t> noteOffsets(notes.size(), 0);
+    uint64_t notesSize = sizeof(dbNotesMagic);
+    if (notesOut)
+    {
+        fwrite(dbNotesMagic, 1, sizeof(dbNotesMagic), notesOut);
+    }
+    for (uint32_t i = 0; i < notes.size(); ++i)
+    {
+        notes[i] = makeNote(random, (size_t) noteLength(random) + 1, i);
+        if (notesOut)
+        {
+            std::string entry;
+            appendNoteEntry(entry, notes[i]);
+            fwrite(entry.data(), 1, entry.size(), notesOut);
+            noteOffsets[i] = (uint32_t) notesSize;
+            notesSize += entry.size();
+        }
+    }
+
+    if (options.formatVersion == dbVersion)
+    {
+        DbFileHeader header = {};
+        memcpy(header.magic, dbMagic, sizeof(dbMagic));
+        header.version = dbVersion;
+        header.headerSize = sizeof(DbFileHeader);
+        header.recordSize = dbRecordSize;
+        fwrite(&header, 1, sizeof(header), out);
+    }
+
+    const int64_t endTimestamp =
+        options.endTimestamp != 0 ?
+            options.endTimestamp :
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+                .count();
+    const uint64_t buildCount = options.recordCount / 2;
+    const int64_t span = (int64_t) options.spanDays * 24 * 60 * 60 * 1000;
+    // Starts are spread evenly over the span, builds that don't overlap wait for the previous STOP. When the builds
+    // take longer than the gaps the records run past endTimestamp.
+    const double meanGap = buildCount > 0 ? (double) span / buildCount : 0;
+    int64_t timestamp = endTimestamp - span;
+
+    RecordWriter writer(out, options.formatVersion);
+    std::priority_queue<PendingStop, std::vector<PendingStop>, std::greater<PendingStop>> pendingStops;
+    const auto writeStop = [&](const PendingStop& stop) {
+        const std::string exitCode = std::to_string(stop.exitCode);
+        writer.write(Operation::STOP, stop.timestamp, exitCode, stop.exitCode, 0, stop.buildId);
+    };
+    for (uint64_t i = 0; i < buildCount; ++i)
+    {
+        const int64_t duration = (int64_t) buildTime(random);
+        const bool overlaps = uniform(random) < options.interleaveRate;
+        // Everything that stopped before this build starts is written first, the records stay in time order.
+        while (!pendingStops.empty() && (!overlaps || pendingStops.top().timestamp <= timestamp))
+        {
+            timestamp = std::max(timestamp, pendingStops.top().timestamp);
+            writeStop(pendingStops.top());
+            pendingStops.pop();
+        }
+
+        // A few notes are used much more often than the rest.
+        const double pick = uniform(random);
+        const uint32_t note = (uint32_t) (pick * pick * pick * notes.size()) % notes.size();
+        const bool hasNote = uniform(random) >= options.emptyNoteRate;
+        uint64_t buildId = random();
+        buildId = buildId == 0 ? 1 : buildId;
+        writer.write(Operation::START,
+                     timestamp,
+                     hasNote ? std::string_view(notes[note]) : std::string_view(),
+                     0,
+                     hasNote ? noteOffsets[note] : 0,
+                     options.formatVersion == dbVersion ? buildId : 0);
+
+        static const int32_t failureExitCodes[] = {1, 2, 137};
+        const int32_t exitCode = uniform(random) < options.failureRate ? failureExitCodes[random() % 3] : 0;
+        pendingStops.push(PendingStop{timestamp + duration, options.formatVersion == dbVersion ? buildId : 0, exitCode});
+        timestamp += (int64_t) (meanGap * 2 * uniform(random)) + 1;
+    }
+    while (!pendingStops.empty())
+    {
+        writeStop(pendingStops.top());
+        pendingStops.pop();
+    }
+    writer.flush();
+
+    int result = 0;
+    if (ferror(out) || (notesOut && ferror(notesOut)))
+    {
+        result = -2;
+    }
+    const bool outClosed = fclose(out) == 0;
+    const bool notesClosed = !notesOut || fclose(notesOut) == 0;
+    if (!outClosed || !notesClosed)
+    {
+        result = -2;
+    }
+    if (result != 0)
+    {
+        std::cerr << "Failed to write output file: " << path << std::endl;
+    }
+    return result;
+}
+} // namespace pdrain
@@ -0,0 +1,515 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "db_segments.h"
+#include "stat_checkpoint.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+
+namespace pdrain
+{
+int monthOfDay(int64_t day)
+{
+    const time_t dayStart = (time_t) (day * (millisecondsPerDay / 1000));
+    struct tm date;
+    gimmeTime(&dayStart, &date);
+    return (date.tm_year + 1900) * 12 + date.tm_mon;
+}
+
+int64_t firstDayOfMonth(int month)
+{
+    return daysFromCivil(month / 12, month % 12 + 1, 1);
+}
+
+// Reads the whole rollup file. A database without one has no rollups, compactedUntil is INT64_MIN then.
+static int readRollupFile(const std::string& path, std::string& contents, int64_t& compactedUntil)
+{
+    contents.clear();
+    compactedUntil = INT64_MIN;
+    MappedFile file;
+    if (mapFile(rollupPathFor(path), file) != 0)
+    {
+        return 0;
+    }
+    DbFileHeader header = {};
+    if (file.size < sizeof(header))
+    {
+        unmapFile(file);
+        return 0;
+    }
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, dbRollupMagic, sizeof(dbRollupMagic)) != 0 || header.version != dbRollupVersion ||
+        header.headerSize < sizeof(header) || header.headerSize > file.size ||
+        header.recordSize != sizeof(DbRollupRecord))
+    {
+        unmapFile(file);
+        std::cerr << "Unsupported rollup file format: " << rollupPathFor(path) << std::endl;
+        return -3;
+    }
+    contents.assign(file.data, file.size);
+    compactedUntil = (int64_t) header.reserved1;
+    unmapFile(file);
+    return 0;
+}
+
+int aggregateRollups(const std::string& path,
+                     int64_t firstDay,
+                     int64_t lastDay,
+                     StatOperationData& data,
+                     int64_t& compactedUntil)
+{
+    std::string contents;
+    const int result = readRollupFile(path, contents, compactedUntil);
+    if (result != 0 || contents.empty())
+    {
+        return result;
+    }
+
+    DbFileHeader header;
+    memcpy(&header, contents.data(), sizeof(header));
+    size_t offset = header.headerSize;
+    while (contents.size() - offset >= sizeof(DbRollupRecord))
+    {
+        DbRollupRecord rollup;
+        memcpy(&rollup, contents.data() + offset, sizeof(rollup));
+        offset += sizeof(rollup);
+        const size_t histogramSize = rollup.histogramEntryCount * sizeof(DbRollupHistogramEntry);
+        if (contents.size() - offset < histogramSize)
+        {
+            break;
+        }
+        const char* const histogram = contents.data() + offset;
+        offset += histogramSize;
+        if (rollup.day < firstDay || rollup.day > lastDay)
+        {
+            continue;
+        }
+
+        data.totalBuildCount += rollup.buildCount;
+        data.compactedBuildCount += rollup.buildCount;
+        data.successfulBuildCount += rollup.successfulBuildCount;
+        data.totalBuildTime += rollup.totalBuildTime;
+        data.maxBuildTime = std::max<size_t>(data.maxBuildTime, rollup.maxBuildTime);
+        if (rollup.lastBuildTimestamp != 0 && rollup.lastBuildTimestamp >= data.lastBuildTimestamp)
+        {
+            data.lastBuildTime = rollup.lastBuildTime;
+            data.lastBuildTimestamp = rollup.lastBuildTimestamp;
+        }
+        for (uint32_t i = 0; i < rollup.histogramEntryCount; ++i)
+        {
+            DbRollupHistogramEntry entry;
+            memcpy(&entry, histogram + i * sizeof(entry), sizeof(entry));
+            if (entry.bucket < DurationHistogram::bucketCount)
+            {
+                data.buildTimeHistogram.record(DurationHistogram::lowestValue(entry.bucket), entry.count);
+            }
+        }
+        data.buildTimeHistogram.record(rollup.histogramMax, 0);
+
+        // Rollups only know the day, the hourly graphs show their builds at midnight.
+        const uint64_t k = data.buildGraphData.lastHour - rollup.day * 24;
+        if (k < data.buildGraphData.totalBuildTimes.size())
+        {
+            data.buildGraphData.totalBuildTimes[k] += rollup.startedBuildTime;
+            data.buildGraphData.buildCounts[k] += rollup.startedBuildCount;
+        }
+    }
+    return 0;
+}
+
+static bool isSameRecord(const RecordView& a, const RecordView& b)
+{
+    return a.operation == b.operation && a.timestamp == b.timestamp && a.buildId == b.buildId &&
+           (a.operation == Operation::START ? a.text == b.text : a.exitCode == b.exitCode);
+}
+
+// Number of the first records the segment already ends with. A rotate that failed to replace the database, or didn't
+// live to, wrote them to the segment and left them in the database as well.
+static size_t heldRecordCount(const std::string& segmentPath, const std::vector<RecordView>& records)
+{
+    BuildTimerDbReader reader;
+    if (records.empty() || reader.open(segmentPath) != 0)
+    {
+        return 0;
+    }
+    std::vector<RecordView> held;
+    RecordView record;
+    while (reader.next(record))
+    {
+        held.push_back(record);
+    }
+    for (size_t first = held.size() > records.size() ? held.size() - records.size() : 0; first < held.size(); ++first)
+    {
+        if (std::equal(held.begin() + first, held.end(), records.begin(), isSameRecord))
+        {
+            return held.size() - first;
+        }
+    }
+    return 0;
+}
+
+int rotateDatabase(const std::string& path,
+                   int64_t tsNow,
+                   int version,
+                   const std::vector<CarriedCheckpoint>& checkpoints)
+{
+    const int currentMonth = monthOfDay(computeDayIndex(tsNow));
+    std::string rollups;
+    int64_t compactedUntil = INT64_MIN;
+    if (readRollupFile(path, rollups, compactedUntil) != 0)
+    {
+        return -3;
+    }
+    const int firstOpenMonth = compactedUntil != INT64_MIN ? monthOfDay(compactedUntil) : 0;
+
+    {
+        // Nothing to do if the oldest record is of the current month, the database isn't rewritten then.
+        BuildTimerDbReader reader;
+        RecordView record;
+        if (reader.open(path) != 0)
+        {
+            return -2;
+        }
+        if (!reader.next(record) || monthOfDay(computeDayIndex(record.timestamp)) >= currentMonth)
+        {
+            return 0;
+        }
+    }
+
+    size_t movedCount = 0, createdCount = 0;
+    std::vector<StatOperationData> checkpointData(checkpoints.size());
+    std::vector<std::string> checkpointExtras(checkpoints.size());
+    std::vector<bool> carried(checkpoints.size(), false);
+    const auto rewrite = [&](BuildTimerDbReader& reader, DbFileWriter& writer) {
+        // Nothing can be appended until the database is replaced, the checkpoints cover every record of both.
+        for (size_t i = 0; i < checkpoints.size(); ++i)
+        {
+            carried[i] = checkpoints[i].update(checkpointData[i], checkpointExtras[i]);
+        }
+
+        // A STOP goes where its START went: records are paired the same way aggregateRecord pairs them.
+        std::map<int, std::vector<RecordView>> segments;
+        std::unordered_map<uint64_t, int> openBuilds; // Build id -> month of the START
+        bool previousIsStart = false;
+        int previousMonth = 0;
+        uint64_t previousBuildId = 0;
+        RecordView record;
+        while (reader.next(record))
+        {
+            int month = std::max(monthOfDay(computeDayIndex(record.timestamp)), firstOpenMonth);
+            if (record.operation == Operation::STOP)
+            {
+                const auto openBuild = openBuilds.find(record.buildId != 0 ? record.buildId : previousBuildId);
+                if ((record.buildId != 0 || previousIsStart) && openBuild != openBuilds.end())
+                {
+                    month = openBuild->second;
+                    openBuilds.erase(openBuild);
+                }
+                else if (record.buildId == 0 && previousIsStart)
+                {
+                    month = previousMonth;
+                }
+            }
+            else if (record.buildId != 0)
+            {
+                openBuilds[record.buildId] = month;
+            }
+            previousIsStart = record.operation == Operation::START;
+            previousMonth = month;
+            previousBuildId = previousIsStart ? record.buildId : 0;
+
+            if (month < currentMonth)
+            {
+                segments[month].push_back(record);
+            }
+            else if (writer.write(record) != 0)
+            {
+                return -2;
+            }
+        }
+
+        // The segments are complete before the records disappear from the database.
+        for (const auto& segment : segments)
+        {
+            const std::string segmentPath = segmentPathFor(path, segment.first / 12, segment.first % 12 + 1);
+            FILE* existing = fopen(segmentPath.c_str(), "rb");
+            if (existing)
+            {
+                // Records that arrived late for a month that was rotated already, or records a rotate that didn't
+                // replace the database moved already.
+                fclose(existing);
+                const size_t heldCount = heldRecordCount(segmentPath, segment.second);
+                const size_t lateCount = segment.second.size() - heldCount;
+                if (lateCount > 0 && appendRecords(segmentPath, segment.second.data() + heldCount, lateCount) != 0)
+                {
+                    return -2;
+                }
+                continue;
+            }
+            DbFileWriter segmentWriter;
+            if (segmentWriter.open(segmentPath, version) == 0)
+            {
+                for (const RecordView& segmentRecord : segment.second)
+                {
+                    segmentWriter.write(segmentRecord);
+                }
+            }
+            if (segmentWriter.close() != 0)
+            {
+                return -2;
+            }
+            ++createdCount;
+        }
+        for (const auto& segment : segments)
+        {
+            movedCount += segment.second.size();
+        }
+        return 0;
+    };
+    const auto carryCheckpoints = [&](const std::string& rewrittenPath) {
+        // Not being able to carry a checkpoint over only costs reading the database again, it can't be any worse.
+        BuildTimerDbReader reader;
+        RecordView record;
+        if (reader.open(rewrittenPath) != 0)
+        {
+            return;
+        }
+        while (reader.next(record))
+        {
+        }
+        for (size_t i = 0; i < checkpoints.size(); ++i)
+        {
+            if (carried[i])
+            {
+                saveCheckpoint(checkpoints[i].path, rewrittenPath, reader, checkpointData[i], checkpointExtras[i]);
+            }
+        }
+    };
+    const int result = rewriteDatabase(path, rewrite, carryCheckpoints);
+    if (result == 0)
+    {
+        std::cout << "Rotated " << movedCount << " records into " << createdCount << " new segments." << std::endl;
+    }
+    return result;
+}
+
+// Adds the counters aggregated since the last call to the rollup of a day and starts them over. The pairing state is
+// kept, a build may stop on a later day than it started.
+static void takeDay(StatOperationData& data, DbRollupRecord& rollup, DurationHistogram& histogram)
+{
+    rollup.buildCount += data.totalBuildCount;
+    rollup.successfulBuildCount += data.successfulBuildCount;
+    rollup.totalBuildTime += data.totalBuildTime;
+    rollup.maxBuildTime = std::max<uint64_t>(rollup.maxBuildTime, data.maxBuildTime);
+    if (data.successfulBuildCount > 0 && data.lastBuildTimestamp >= rollup.lastBuildTimestamp)
+    {
+        rollup.lastBuildTime = data.lastBuildTime;
+        rollup.lastBuildTimestamp = data.lastBuildTimestamp;
+    }
+    histogram.merge(data.buildTimeHistogram);
+
+    data.totalBuildCount = 0;
+    data.successfulBuildCount = 0;
+    data.totalBuildTime = 0;
+    data.maxBuildTime = 0;
+    data.lastBuildTime = 0;
+    data.lastBuildTimestamp = 0;
+    data.buildTimeHistogram = DurationHistogram();
+}
+
+// Appends the per day rollups of a segment to out.
+static int compactSegment(const std::string& segmentPath, int month, std::string& out)
+{
+    BuildTimerDbReader reader;
+    if (reader.open(segmentPath) != 0)
+    {
+        return -2;
+    }
+    const int64_t firstDay = firstDayOfMonth(month);
+    const int64_t dayCount = firstDayOfMonth(month + 1) - firstDay;
+
+    // The graph columns of data are the days of the month, they collect the builds by the day they started on.
+    StatOperationData data = {};
+    initBuildStats(data, GraphBucket::DAY, (int) dayCount, (firstDay + dayCount - 1) * millisecondsPerDay);
+    std::vector<DbRollupRecord> rollups(dayCount, DbRollupRecord());
+    std::vector<DurationHistogram> histograms(dayCount);
+    int64_t currentDay = 0;
+    RecordView record;
+    while (reader.next(record))
+    {
+        // A build is counted on the day it started, the same as a range of raw records counts it.
+        int64_t timestamp = record.timestamp;
+        const PairingState& pairing = data.pairing;
+        const uint64_t startedBuildId = record.buildId != 0 ? record.buildId : pairing.lastStartedBuildId;
+        const auto openBuild = pairing.openBuilds.find(startedBuildId);
+        if (record.operation == Operation::STOP && startedBuildId != 0 && openBuild != pairing.openBuilds.end())
+        {
+            timestamp = openBuild->second.startTimestamp;
+        }
+        else if (record.operation == Operation::STOP && record.buildId == 0 && pairing.recordCount > 0 &&
+                 pairing.previousOperation == Operation::START)
+        {
+            timestamp = pairing.previousTimestamp;
+        }
+        const int64_t day = std::min(std::max(computeDayIndex(timestamp) - firstDay, int64_t(0)), dayCount - 1);
+        if (day != currentDay)
+        {
+            takeDay(data, rollups[currentDay], histograms[currentDay]);
+            currentDay = day;
+        }
+        aggregateRecord(data, record);
+    }
+    // Builds that never stopped count as failed, the same as finishBuildStats counts them.
+    data.totalBuildCount += (data.pairing.pendingStart ? 1 : 0) + data.pairing.openBuilds.size();
+    takeDay(data, rollups[currentDay], histograms[currentDay]);
+
+    const std::vector<GraphColumn> days = graphColumns(data.buildGraphData);
+    for (int64_t i = 0; i < dayCount; ++i)
+    {
+        DbRollupRecord& rollup = rollups[i];
+        rollup.day = firstDay + i;
+        rollup.startedBuildTime = (uint64_t) days[i].totalBuildTime;
+        rollup.startedBuildCount = (uint64_t) days[i].buildCount;
+        if (rollup.buildCount == 0 && rollup.startedBuildCount == 0)
+        {
+            continue;
+        }
+
+        std::vector<DbRollupHistogramEntry> entries;
+        for (size_t bucket = 0; bucket < DurationHistogram::bucketCount; ++bucket)
+        {
+            uint64_t count = histograms[i].countAt(bucket);
+            while (count > 0)
+            {
+                // A day doesn't have billions of builds, but the entry count is no reason to lose any.
+                const uint32_t entryCount = (uint32_t) std::min<uint64_t>(count, UINT32_MAX);
+                entries.push_back(DbRollupHistogramEntry{(uint32_t) bucket, entryCount});
+                count -= entryCount;
+            }
+        }
+        rollup.histogramMax = histograms[i].maxValue();
+        rollup.histogramEntryCount = (uint32_t) entries.size();
+        out.append((const char*) &rollup, sizeof(rollup));
+        out.append((const char*) entries.data(), entries.size() * sizeof(DbRollupHistogramEntry));
+    }
+    return 0;
+}
+
+static void removeSegment(const std::string& segmentPath)
+{
+    remove(segmentPath.c_str());
+    remove(notesPathFor(segmentPath).c_str());
+    remove(checkpointPathFor(segmentPath).c_str());
+}
+
+int compactDatabase(const std::string& path,
+                    int keepMonths,
+                    int64_t tsNow,
+                    int version,
+                    const std::vector<CarriedCheckpoint>& checkpoints)
+{
+    int result = rotateDatabase(path, tsNow, version, checkpoints);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    std::string rollups;
+    int64_t compactedUntil = INT64_MIN;
+    if (readRollupFile(path, rollups, compactedUntil) != 0)
+    {
+        return -3;
+    }
+    if (rollups.empty())
+    {
+        DbFileHeader header = {};
+        memcpy(header.magic, dbRollupMagic, sizeof(dbRollupMagic));
+        header.version = dbRollupVersion;
+        header.headerSize = sizeof(DbFileHeader);
+        header.recordSize = sizeof(DbRollupRecord);
+        rollups.append((const char*) &header, sizeof(header));
+    }
+
+    std::vector<std::string> segmentPaths;
+    std::vector<int> months;
+    listSegments(path, segmentPaths, months);
+    const int compactBefore = monthOfDay(computeDayIndex(tsNow)) - keepMonths;
+    std::vector<std::string> compacted;
+    int64_t newCompactedUntil = compactedUntil;
+    for (size_t i = 0; i < segmentPaths.size() && months[i] < compactBefore; ++i)
+    {
+        // Already in the rollups, a previous compaction stopped before deleting it.
+        if (compactedUntil == INT64_MIN || firstDayOfMonth(months[i]) >= compactedUntil)
+        {
+            result = compactSegment(segmentPaths[i], months[i], rollups);
+            if (result != 0)
+            {
+                return result;
+            }
+            newCompactedUntil = firstDayOfMonth(months[i] + 1);
+        }
+        compacted.push_back(segmentPaths[i]);
+    }
+    if (compacted.empty())
+    {
+        return 0;
+    }
+
+    if (newCompactedUntil != compactedUntil)
+    {
+        DbFileHeader header;
+        memcpy(&header, rollups.data(), sizeof(header));
+        header.reserved1 = (uint64_t) newCompactedUntil;
+        memcpy(&rollups[0], &header, sizeof(header));
+
+        // The rollups are complete on disk before any segment goes away.
+        const std::string tmpPath = rollupPathFor(path) + ".tmp";
+        FILE* out = fopen(tmpPath.c_str(), "wb");
+        bool written = out && fwrite(rollups.data(), 1, rollups.size(), out) == rollups.size();
+        written = out && fclose(out) == 0 && written;
+        if (!written || replaceFile(tmpPath, rollupPathFor(path)) != 0)
+        {
+            std::cerr << "Failed to write the rollup file: " << rollupPathFor(path) << std::endl;
+            remove(tmpPath.c_str());
+            return -2;
+        }
+    }
+    for (const std::string& segmentPath : compacted)
+    {
+        removeSegment(segmentPath);
+    }
+    std::cout << "Compacted " << compacted.size() << " segments into " << rollupPathFor(path) << std::endl;
+    return 0;
+}
+} // namespace pdrain
@@ -0,0 +1,122 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "duration_histogram.h"
+
+#include <cmath>
+
+namespace pdrain
+{
+DurationHistogram::DurationHistogram() : counts(bucketCount, 0), total(0), max(0)
+{
+}
+
+size_t DurationHistogram::bucketIndex(int64_t value)
+{
+    if (value < subBucketCount)
+    {
+        return value < 0 ? 0 : (size_t) value;
+    }
+    // The highest set bit picks the power of two range, the subBucketBits below it the bucket within the range.
+    int magnitude = 63;
+    while (!(value & (int64_t(1) << magnitude)))
+    {
+        --magnitude;
+    }
+    const int shift = magnitude - subBucketBits;
+    return (size_t) ((shift + 1) * subBucketCount + ((value >> shift) - subBucketCount));
+}
+
+int64_t DurationHistogram::lowestValue(size_t index)
+{
+    if (index < (size_t) subBucketCount * 2)
+    {
+        return (int64_t) index;
+    }
+    const int shift = (int) (index / subBucketCount) - 1;
+    return (subBucketCount + (int64_t) (index % subBucketCount)) << shift;
+}
+
+int64_t DurationHistogram::highestValue(size_t index)
+{
+    if (index < (size_t) subBucketCount * 2)
+    {
+        return (int64_t) index;
+    }
+    const int shift = (int) (index / subBucketCount) - 1;
+    return lowestValue(index) + ((int64_t(1) << shift) - 1);
+}
+
+void DurationHistogram::record(int64_t value, uint64_t count)
+{
+    if (value < 0)
+    {
+        value = 0;
+    }
+    counts[bucketIndex(value)] += count;
+    total += count;
+    if (value > max)
+    {
+        max = value;
+    }
+}
+
+void DurationHistogram::merge(const DurationHistogram& other)
+{
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    if (other.max > max)
+    {
+        max = other.max;
+    }
+}
+
+int64_t DurationHistogram::valueAtPercentile(double percentile) const
+{
+    if (total == 0)
+    {
+        return 0;
+    }
+    // Nearest rank: the smallest value with at least percentile % of the values at or below it.
+    uint64_t rank = (uint64_t) std::ceil(percentile / 100.0 * total);
+    rank = rank < 1 ? 1 : (rank > total ? total : rank);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            const int64_t value = highestValue(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+} // namespace pdrain
@@ -25,37 +25,35 @@
  * SOFTWARE.
  **********************************************************************************/
 
+#include "build_runner.h"
+#include "build_stats.h"
+#include "build_timer_db.h"
+#include "change_detector.h"
+#include "collector.h"
+#include "db_segments.h"
+#include "metrics_export.h"
+#include "profiler.h"
+#include "record_export.h"
+#include "stat_checkpoint.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <time.h>
-
-// TODO(Feature): Allow stat to run across multiple database files..
+#include <unordered_set>
+#include <variant>
+#include <vector>
 
 namespace pdrain
 {
-void gimmeTime(const time_t* theTime, struct tm* result)
-{
-#if defined(_WIN64) || defined(_WIN32)
-    gmtime_s(result, theTime);
-#elif defined(__APPLE__)
-    gmtime_r(theTime, result);
-#elif defined(__linux__)
-    gmtime_r(theTime, result);
-#else
-#error "NIMBY"
-#endif
-}
-
-enum class Operation : char
-{
-    START,
-    STOP,
-    STAT,
-    DUMP,
-    UNKNOWN,
-};
-
 Operation convert(const std::string& op)
 {
     if (op == "start")
@@ -74,6 +72,42 @@ Operation convert(const std::string& op)
     {
         return Operation::DUMP;
     }
+    else if (op == "convert")
+    {
+        return Operation::CONVERT;
+    }
+    else if (op == "run")
+    {
+        return Operation::RUN;
+    }
+    else if (op == "serve")
+    {
+        return Operation::SERVE;
+    }
+    else if (op == "rotate")
+    {
+        return Operation::ROTATE;
+    }
+    else if (op == "compact")
+    {
+        return Operation::COMPACT;
+    }
+    else if (op == "regressions")
+    {
+        return Operation::REGRESSIONS;
+    }
+    else if (op == "export-metrics")
+    {
+        return Operation::EXPORT_METRICS;
+    }
+    else if (op == "span-begin")
+    {
+        return Operation::SPAN_BEGIN;
+    }
+    else if (op == "span-end")
+    {
+        return Operation::SPAN_END;
+    }
     return Operation::UNKNOWN;
 }
 
@@ -122,50 +156,113 @@ struct StartOperationData
 {
     int64_t timestamp;
     std::string note;
+    uint64_t buildId;
 };
 
 struct StopOperationData
 {
     std::string exitCode;
     int64_t timestamp;
+    uint64_t buildId;
 };
 
-struct BuildGraphData
+struct SpanOperationData
 {
-    std::vector<int64_t> totalBuildTimes;
-    std::vector<double> avgBuildTimes;
-    std::vector<std::string> buildDates;
+    std::string name; // Empty for a span-end that closes the innermost span
 };
 
-struct StatOperationData
+struct ConvertOperationData
 {
-    std::vector<std::pair<Operation, void*>>
-        ops; // Note: Don't bother deleting the data, allocated once, OS will reclaim in the end
+    std::string targetPath; // Empty when converting in place
+};
+
+struct CompactOperationData
+{
+    int keepMonths = 3; // Finished months kept as raw records
+};
 
-    size_t totalBuildCount;
-    size_t successfulBuildCount;
-    size_t totalBuildTime;
-    double avgBuildTime;
-    size_t lastBuildTime;
-    size_t maxBuildTime;
-    BuildGraphData buildGraphData;
+struct ExportMetricsOperationData
+{
+    std::string targetPath; // Empty for <database>.prom
 };
 
 struct Context
 {
-    void* additionalOperationData; // Note: Don't bother deleting the data, allocated once, OS will reclaim in the end
+    // Parameters of the operation, owned by the context.
+    std::variant<std::monostate,
+                 StartOperationData,
+                 StopOperationData,
+                 ConvertOperationData,
+                 CompactOperationData,
+                 ExportMetricsOperationData,
+                 SpanOperationData>
+        operationData;
     Operation operation;
     std::string outFilePath;
+    std::vector<std::string> dbFilePaths; // All the -o files, stat can aggregate several databases
+    GraphBucket graphBucket = GraphBucket::DAY; // Width of the columns of the stat graphs
+    int graphWidth = 120; // Number of columns of the stat graphs
+    bool graphWidthSet = false;
+    int64_t since = INT64_MIN; // Only the builds started in [since, until) are looked at, milliseconds since epoch
+    int64_t until = INT64_MAX;
+    std::string groupBy; // stat --group-by, empty if the builds are not grouped
+    DumpFormat dumpFormat = DumpFormat::TEXT;
+    int encoding = dbVersion; // Format written by convert and rotate, --encoding=compressed is dbCompressedVersion
+    unsigned threadCount = 0; // stat --threads, 0 for as many as there are cores
+    std::string buildId;  // Build id given to stop, the START it belongs to printed it
+    std::vector<std::string> runCommand; // Everything after "--", the command run times
 };
 
-std::string computeDateStr(int64_t timestamp)
+// Accepts a UTC date and time (2024-03-01, 2024-03-01T14:30, 2024-03-01 14:30:15), a time relative to now
+// (12h, 30d, 2w) or milliseconds since epoch, the same as dump prints.
+bool parseTimeArgument(const std::string& str, int64_t tsNow, int64_t& timestamp)
 {
-    struct tm tmbuff;
-    gimmeTime((time_t*) &timestamp, &tmbuff);
-    // gmtime_s(&tmbuff, &timestamp);
-    const std::string dmy = std::to_string(tmbuff.tm_mday) + "." + std::to_string(tmbuff.tm_mon + 1) + "." +
-                            std::to_string(tmbuff.tm_year + 1900);
-    return dmy;
+    const std::string text = trimWhiteSpace(str);
+    const char* begin = text.data();
+    const char* end = begin + text.size();
+    int64_t number = 0;
+    const std::from_chars_result numberResult = std::from_chars(begin, end, number);
+    if (text.empty() || numberResult.ec != std::errc() || number < 0)
+    {
+        return false;
+    }
+    if (numberResult.ptr == end)
+    {
+        timestamp = number;
+        return true;
+    }
+    if (numberResult.ptr + 1 == end && number <= 1000000)
+    {
+        const char unit = *numberResult.ptr;
+        const int64_t unitMs = unit == 'h' ? 60 * 60 * 1000 :
+                                             (unit == 'd' ? millisecondsPerDay : (unit == 'w' ? 7 * millisecondsPerDay : 0));
+        timestamp = tsNow - number * unitMs;
+        return unitMs != 0;
+    }
+
+    int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0;
+    char separator = 'T';
+    int consumed = 0;
+    const int fields = sscanf(text.c_str(),
+                              "%4d-%2d-%2d%n%c%2d:%2d%n:%2d%n",
+                              &year,
+                              &month,
+                              &day,
+                              &consumed,
+                              &separator,
+                              &hour,
+                              &minute,
+                              &consumed,
+                              &second,
+                              &consumed);
+    if (fields < 3 || (fields > 3 && fields < 6) || consumed != (int) text.size() ||
+        (separator != 'T' && separator != ' ') || month < 1 || month > 12 || day < 1 || day > 31 || hour < 0 ||
+        hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59)
+    {
+        return false;
+    }
+    timestamp = daysFromCivil(year, month, day) * millisecondsPerDay + ((hour * 60 + minute) * 60 + second) * 1000;
+    return true;
 }
 
 bool init(const std::vector<std::pair<std::string, std::string>>& arguments, Context& ctx)
@@ -179,20 +276,90 @@ bool init(const std::vector<std::pair<std::string, std::string>>& arguments, Con
         std::cout << "Usage: " << std::endl;
         std::cout << "    profitDrain -o=<timer database file> -x=<Operation To Execute>" << std::endl;
         std::cout << "       -x=<Operation to execute>" << std::endl;
-        std::cout << "           \"start <note>\" - start timer" << std::endl;
+        std::cout << "           \"start <note>\" - start timer, prints the id of the build" << std::endl;
         std::cout << "           \"stop <exit code>\" - stop timer" << std::endl;
+        std::cout << "           \"run <note>\" -- <command> - run the command and record its duration, exit code and "
+                     "resource usage"
+                  << std::endl;
+        std::cout << "           \"span-begin <name>\", \"span-end [name]\" - start and end a phase of the build, spans "
+                     "nest"
+                  << std::endl;
         std::cout << "           stat - print build time statistics" << std::endl;
-        std::cout << "           dump - dump raw data as text" << std::endl;
-        std::cout << "       -o=<Timer database file name>" << std::endl;
+        std::cout << "           dump - dump raw data as text, or in the --format given" << std::endl;
+        std::cout << "           \"convert [target file]\" - convert the database to the --encoding format, in place "
+                     "(the original is kept as <file>.v<version>) or into the target file"
+                  << std::endl;
+        std::cout << "           serve - keep the database open for start, stop and stat, until interrupted (not on "
+                     "Windows)"
+                  << std::endl;
+        std::cout << "           rotate - move the records of the finished months into monthly segments, <file>.YYYY-MM"
+                  << std::endl;
+        std::cout << "           \"compact [months]\" - rotate, then replace the segments older than the given number of "
+                     "months (default 3) with per day rollups"
+                  << std::endl;
+        std::cout << "           regressions - report the shifts of the build time, continuing from where the last run "
+                     "stopped"
+                  << std::endl;
+        std::cout << "           \"export-metrics [target file]\" - write the build counters and build time histogram "
+                     "in the Prometheus text format, to <file>.prom or the target file"
+                  << std::endl;
+        std::cout << "       -o=<Timer database file name>, stat accepts several -o options and wildcard patterns"
+                  << std::endl;
+        std::cout << "       --bucket=<hour|day|week|month> - width of the columns of the stat graphs, default day"
+                  << std::endl;
+        std::cout << "       --width=<Number of columns of the stat graphs, default 120 or the --since range>, --days is "
+                     "the same"
+                  << std::endl;
+        std::cout << "       --since=<time>, --until=<time> - stat and dump only look at the builds started in "
+                     "[since, until), regressions only reports the shifts in it. Times are UTC dates (2024-03-01, "
+                     "2024-03-01T14:30), relative to now (12h, 30d, 2w) or milliseconds since epoch"
+                  << std::endl;
+        std::cout << "       --group-by=<note|tag key> - stat, regressions, export-metrics and the trace dump break the "
+                     "builds down by their note, or by the value of a key=value tag in it"
+                  << std::endl;
+        std::cout << "       --threads=<Number of threads stat reads the databases with, default one per core>"
+                  << std::endl;
+        std::cout << "       --format=<text|csv|jsonl|bin|trace> - output format of dump, default text. trace is a "
+                     "Chrome Trace Event JSON timeline for Perfetto"
+                  << std::endl;
+        std::cout << "       --encoding=<fixed|compressed> - format convert, rotate and compact write, default fixed. "
+                     "Compressed databases take about a third of the space"
+                  << std::endl;
+        std::cout << "       --id=<Build id printed by start, stop and the spans pair with that START. The spans default to "
+                     "the PROFITDRAIN_BUILD_ID environment variable, which run sets for its command>"
+                  << std::endl;
+        std::cout << "       --profile - report the time of the stages of stat, the records and bytes read, the "
+                     "allocations and the peak RSS on stderr"
+                  << std::endl;
         std::cout << "       -h Help" << std::endl << std::endl;
 
         std::cout << "Usage examples: " << std::endl;
         std::cout << "    profitDrain -o=t.db -x=stat" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=stat --days=365" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=stat --bucket=hour --width=48" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=stat --since=2024-03-01 --until=2024-03-15" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=\"start target=app cfg=debug\"" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=stat --group-by=cfg" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=regressions --group-by=target" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=\"export-metrics /var/lib/node_exporter/builds.prom\" --group-by=target"
+                  << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=dump --format=csv > t.csv" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=dump --format=trace --group-by=host > t.json" << std::endl;
+        std::cout << "    profitDrain -o=\"team/*.db\" -o=ci.db -x=stat" << std::endl;
         std::cout << "    profitDrain -o=t.db -x=dump" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=convert" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=convert --encoding=compressed" << std::endl;
         std::cout << "    profitDrain -o=t.db -x=start" << std::endl;
         std::cout << "    profitDrain -o=t.db -x=\"start First build after integrating library xyz.\"" << std::endl;
         std::cout << "    profitDrain -o=t.db -x=\"stop 0\"" << std::endl;
-        std::cout << "    profitDrain -o=t.db -x=\"stop 32\"" << std::endl << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=\"stop 32\"" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=\"run Release build\" -- make -j8" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=\"span-begin link\" --id=$id" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=serve &" << std::endl;
+        std::cout << "    profitDrain -o=t.db -x=\"compact 6\"" << std::endl;
+        std::cout << "    id=$(profitDrain -o=t.db -x=start) && make; profitDrain -o=t.db -x=\"stop $?\" --id=$id"
+                  << std::endl
+                  << std::endl;
 
         std::cout << "Motivation:" << std::endl;
         std::cout << "    Waiting for builds instead of actively working on solving problems is wasted time and can "
@@ -242,7 +409,7 @@ bool init(const std::vector<std::pair<std::string, std::string>>& arguments, Con
             }
             else if (ctx.operation == Operation::START)
             {
-                StartOperationData* startData = new StartOperationData();
+                StartOperationData* startData = &ctx.operationData.emplace<StartOperationData>();
                 const std::string rawOption = trimWhiteSpace(val.second);
                 const size_t firstSpacePos = rawOption.find_first_of(' ', 0);
 
@@ -254,22 +421,99 @@ bool init(const std::vector<std::pair<std::string, std::string>>& arguments, Con
                         startData->note = trimWhiteSpace(note);
                     }
                 }
-                ctx.additionalOperationData = startData;
                 operationSpecified = true;
             }
             else if (ctx.operation == Operation::STOP)
             {
-                StopOperationData* stopData = new StopOperationData();
+                StopOperationData* stopData = &ctx.operationData.emplace<StopOperationData>();
                 stopData->exitCode = trimWhiteSpace(val.second.substr(val.second.find_first_of(' ', 0)));
-                ctx.additionalOperationData = stopData;
                 operationSpecified = true;
             }
             else if (ctx.operation == Operation::STAT)
             {
                 operationSpecified = true;
             }
-            else if (ctx.operation == Operation::DUMP)
+            else if (ctx.operation == Operation::DUMP || ctx.operation == Operation::SERVE ||
+                     ctx.operation == Operation::ROTATE || ctx.operation == Operation::REGRESSIONS)
+            {
+                operationSpecified = true;
+            }
+            else if (ctx.operation == Operation::COMPACT)
+            {
+                CompactOperationData* compactData = &ctx.operationData.emplace<CompactOperationData>();
+                const std::string rawOption = trimWhiteSpace(val.second);
+                const size_t firstSpacePos = rawOption.find_first_of(' ', 0);
+                if (firstSpacePos != std::string::npos)
+                {
+                    const std::string months = trimWhiteSpace(rawOption.substr(firstSpacePos));
+                    char* end = nullptr;
+                    const long keepMonths = strtol(months.c_str(), &end, 10);
+                    if (*end != '\0' || keepMonths < 0 || keepMonths > 1200)
+                    {
+                        std::cerr << "Invalid number of months specified: " << months << std::endl;
+                        printHelp();
+                        return false;
+                    }
+                    compactData->keepMonths = (int) keepMonths;
+                }
+                operationSpecified = true;
+            }
+            else if (ctx.operation == Operation::RUN)
+            {
+                // Same as for start, the note is optional.
+                StartOperationData* startData = &ctx.operationData.emplace<StartOperationData>();
+                const std::string rawOption = trimWhiteSpace(val.second);
+                const size_t firstSpacePos = rawOption.find_first_of(' ', 0);
+                if (firstSpacePos != std::string::npos)
+                {
+                    startData->note = trimWhiteSpace(rawOption.substr(firstSpacePos));
+                }
+                operationSpecified = true;
+            }
+            else if (ctx.operation == Operation::SPAN_BEGIN || ctx.operation == Operation::SPAN_END)
+            {
+                SpanOperationData* spanData = &ctx.operationData.emplace<SpanOperationData>();
+                const std::string rawOption = trimWhiteSpace(val.second);
+                const size_t firstSpacePos = rawOption.find_first_of(' ', 0);
+                if (firstSpacePos != std::string::npos)
+                {
+                    spanData->name = trimWhiteSpace(rawOption.substr(firstSpacePos));
+                }
+                if (spanData->name.empty() && ctx.operation == Operation::SPAN_BEGIN)
+                {
+                    std::cerr << "span-begin needs the name of the span!" << std::endl;
+                    printHelp();
+                    return false;
+                }
+                if (spanData->name.size() > dbSpanNameSize)
+                {
+                    std::cerr << "Span names can't be longer than " << dbSpanNameSize << " bytes: " << spanData->name
+                              << std::endl;
+                    printHelp();
+                    return false;
+                }
+                operationSpecified = true;
+            }
+            else if (ctx.operation == Operation::EXPORT_METRICS)
+            {
+                ExportMetricsOperationData* exportData = &ctx.operationData.emplace<ExportMetricsOperationData>();
+                const std::string rawOption = trimWhiteSpace(val.second);
+                const size_t firstSpacePos = rawOption.find_first_of(' ', 0);
+                if (firstSpacePos != std::string::npos)
+                {
+                    exportData->targetPath = trimWhiteSpace(rawOption.substr(firstSpacePos));
+                }
+                operationSpecified = true;
+            }
+            else if (ctx.operation == Operation::CONVERT)
             {
+                ConvertOperationData* convertData = &ctx.operationData.emplace<ConvertOperationData>();
+                const std::string rawOption = trimWhiteSpace(val.second);
+                const size_t firstSpacePos = rawOption.find_first_of(' ', 0);
+                if (firstSpacePos != std::string::npos)
+                {
+                    convertData->targetPath = trimWhiteSpace(rawOption.substr(firstSpacePos));
+                }
                 operationSpecified = true;
             }
         }
@@ -281,9 +525,98 @@ bool init(const std::vector<std::pair<std::string, std::string>>& arguments, Con
                 printHelp();
                 return false;
             }
-            ctx.outFilePath = val.second;
+            if (expandPathPattern(val.second, ctx.dbFilePaths) != 0)
+            {
+                std::cerr << "No database file matches: " << val.second << std::endl;
+                return false;
+            }
+            ctx.outFilePath = ctx.dbFilePaths.front();
             outputFileSet = true;
         }
+        else if (val.first == "days" || val.first == "width")
+        {
+            char* end = nullptr;
+            const long width = strtol(val.second.c_str(), &end, 10);
+            if (val.second.empty() || *end != '\0' || width < 1 || width > 100000)
+            {
+                std::cerr << "Invalid graph width specified: " << val.second << std::endl;
+                printHelp();
+                return false;
+            }
+            ctx.graphWidth = (int) width;
+            ctx.graphWidthSet = true;
+        }
+        else if (val.first == "bucket")
+        {
+            if (!parseGraphBucket(trimWhiteSpace(val.second), ctx.graphBucket))
+            {
+                std::cerr << "Invalid graph bucket specified: " << val.second << std::endl;
+                printHelp();
+                return false;
+            }
+        }
+        else if (val.first == "threads")
+        {
+            char* end = nullptr;
+            const long threads = strtol(val.second.c_str(), &end, 10);
+            if (val.second.empty() || *end != '\0' || threads < 1 || threads > 1024)
+            {
+                std::cerr << "Invalid number of threads specified: " << val.second << std::endl;
+                printHelp();
+                return false;
+            }
+            ctx.threadCount = (unsigned) threads;
+        }
+        else if (val.first == "since" || val.first == "until")
+        {
+            const int64_t tsNow = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                      std::chrono::system_clock::now().time_since_epoch())
+                                      .count();
+            if (!parseTimeArgument(val.second, tsNow, val.first == "since" ? ctx.since : ctx.until))
+            {
+                std::cerr << "Invalid time specified: " << val.second << std::endl;
+                printHelp();
+                return false;
+            }
+        }
+        else if (val.first == "group-by")
+        {
+            ctx.groupBy = trimWhiteSpace(val.second);
+            if (ctx.groupBy.empty() || ctx.groupBy.find_first_of(" \t=") != std::string::npos)
+            {
+                std::cerr << "Invalid group specified: " << val.second << std::endl;
+                printHelp();
+                return false;
+            }
+        }
+        else if (val.first == "encoding")
+        {
+            const std::string encoding = trimWhiteSpace(val.second);
+            if (encoding != "fixed" && encoding != "compressed")
+            {
+                std::cerr << "Invalid encoding specified: " << val.second << std::endl;
+                printHelp();
+                return false;
+            }
+            ctx.encoding = encoding == "compressed" ? dbCompressedVersion : dbVersion;
+        }
+        else if (val.first == "format")
+        {
+            if (!parseDumpFormat(trimWhiteSpace(val.second), ctx.dumpFormat))
+            {
+                std::cerr << "Invalid dump format specified: " << val.second << std::endl;
+                printHelp();
+                return false;
+            }
+        }
+        else if (val.first == "id")
+        {
+            ctx.buildId = val.second;
+        }
+        else if (val.first == "profile")
+        {
+            profiling = true;
+        }
         else if (val.first == "h")
         {
             printHelp();
@@ -295,123 +628,161 @@ bool init(const std::vector<std::pair<std::string, std::string>>& arguments, Con
         }
     }
 
-    return outputFileSet && operationSpecified;
-}
-
-int writeData(const Context& context, StopOperationData* data)
-{
-    FILE* f = fopen(context.outFilePath.c_str(), "ab");
-    if (!f)
+    if (ctx.operation == Operation::RUN && ctx.runCommand.empty())
     {
-        std::cerr << "Failed to open output file: " << context.outFilePath << std::endl;
-        return -2;
+        std::cerr << "No command specified for run, add it after --" << std::endl;
+        return false;
     }
 
-    fwrite(&context.operation, 1, sizeof(Operation::STOP), f);
-    fwrite(&data->timestamp, 1, sizeof(data->timestamp), f);
-
-    const size_t exitCodeSize = data->exitCode.size();
-    fwrite(&exitCodeSize, 1, sizeof(exitCodeSize), f);
-
-    fwrite(data->exitCode.c_str(), 1, exitCodeSize, f);
+    if (ctx.since >= ctx.until)
+    {
+        std::cerr << "Empty time range, --since must be before --until!" << std::endl;
+        return false;
+    }
+    // The graphs are summed up from hourly buckets, they can't reach back further than 100000 days.
+    const int daysPerColumn[] = {1, 1, 7, 31};
+    if ((int64_t) ctx.graphWidth * daysPerColumn[(int) ctx.graphBucket] > 100000)
+    {
+        std::cerr << "The stat graphs can't reach back more than 100000 days!" << std::endl;
+        return false;
+    }
+    if (ctx.dbFilePaths.size() > 1 && ctx.operation != Operation::STAT)
+    {
+        std::cerr << "Only stat can work with multiple database files!" << std::endl;
+        return false;
+    }
 
-    fclose(f);
+    return outputFileSet && operationSpecified;
+}
 
-    return 0;
+// Collector requests, one per line: "record", START or STOP, timestamp, build id (hex), note or exit code
+std::string formatRecordRequest(const RecordView& record)
+{
+    std::string request = "record\n";
+    request += record.operation == Operation::START ? "start\n" : "stop\n";
+    request += std::to_string(record.timestamp) + "\n";
+    char buildId[17];
+    snprintf(buildId, sizeof(buildId), "%llx", (unsigned long long) record.buildId);
+    request += buildId;
+    request += "\n";
+    request += record.text;
+    return request;
 }
 
-int writeData(const Context& context, StartOperationData* data)
+// Hands the record to the collector of the database if one is running, otherwise appends it to the file.
+int appendThroughCollector(const std::string& path, const RecordView& record)
 {
-    FILE* f = fopen(context.outFilePath.c_str(), "ab");
-    if (!f)
+    std::string response;
+    const int result = collectorRequest(path, formatRecordRequest(record), response);
+    if (result == collectorNotRunning)
     {
-        std::cerr << "Failed to open output file: " << context.outFilePath << std::endl;
-        return -2;
+        return appendRecord(path, record);
     }
-
-    fwrite(&context.operation, 1, sizeof(context.operation), f);
-
-    fwrite(&data->timestamp, 1, sizeof(data->timestamp), f);
-
-    const size_t noteSize = data->note.size();
-    fwrite(&noteSize, 1, sizeof(noteSize), f);
-
-    if (noteSize > 0)
+    // Once the request is sent the collector may have written the record, writing it again could duplicate it.
+    if (result != 0 || response.compare(0, 3, "OK\n") != 0)
     {
-        fwrite(data->note.c_str(), 1, noteSize, f);
+        std::cerr << "The collector failed to record the build: " << response << std::endl;
+        return result != 0 ? result : -2;
     }
+    return 0;
+}
 
-    fclose(f);
+int writeData(const Context& context, StopOperationData* data)
+{
+    RecordView record = {};
+    record.operation = Operation::STOP;
+    record.timestamp = data->timestamp;
+    record.text = data->exitCode;
+    record.exitCode = parseExitCode(data->exitCode);
+    record.buildId = data->buildId;
+    return appendThroughCollector(context.outFilePath, record);
+}
 
-    return 0;
+int writeData(const Context& context, StartOperationData* data)
+{
+    RecordView record = {};
+    record.operation = Operation::START;
+    record.timestamp = data->timestamp;
+    record.text = data->note;
+    record.buildId = data->buildId;
+    return appendThroughCollector(context.outFilePath, record);
+}
+
+std::string formatBuildId(uint64_t buildId)
+{
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long) buildId);
+    return buffer;
+}
+
+bool parseBuildId(const std::string& str, uint64_t& buildId)
+{
+    const std::string trimmed = trimWhiteSpace(str);
+    const char* end = trimmed.data() + trimmed.size();
+    const std::from_chars_result result = std::from_chars(trimmed.data(), end, buildId, 16);
+    return !trimmed.empty() && result.ec == std::errc() && result.ptr == end && buildId != 0;
 }
 
 int start(Context& context)
 {
-    StartOperationData* data = (StartOperationData*) context.additionalOperationData;
+    StartOperationData* data = std::get_if<StartOperationData>(&context.operationData);
     data->timestamp =
         std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
             .count();
-    return writeData(context, data);
+    data->buildId = generateBuildId();
+    const int result = writeData(context, data);
+    if (result == 0)
+    {
+        // Handed to stop, so the STOP pairs with this START even if other builds record in between.
+        std::cout << formatBuildId(data->buildId) << std::endl;
+    }
+    return result;
+}
+
+// The build id given with --id, or the one run sets in the environment of its command if fromRun is set. Only the spans
+// take that one, a stop under run belongs to a build the command started itself. 0 if there is none, false if it is not
+// a build id.
+bool buildIdOf(const Context& context, bool fromRun, uint64_t& buildId)
+{
+    const char* buildIdFromEnv = fromRun ? getenv("PROFITDRAIN_BUILD_ID") : nullptr;
+    const std::string id = !context.buildId.empty() ? context.buildId : (buildIdFromEnv ? buildIdFromEnv : "");
+    buildId = 0;
+    if (!id.empty() && !parseBuildId(id, buildId))
+    {
+        std::cerr << "Invalid build id: " << id << std::endl;
+        return false;
+    }
+    return true;
 }
 
 int stop(Context& context)
 {
-    StopOperationData* data = (StopOperationData*) context.additionalOperationData;
+    StopOperationData* data = std::get_if<StopOperationData>(&context.operationData);
     data->timestamp =
         std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
             .count();
-    return writeData(context, data);
-}
 
-int readBuildTimerData(Context& ctx, StatOperationData& data)
-{
-    FILE* f = fopen(ctx.outFilePath.c_str(), "rb");
-    if (!f)
+    if (!buildIdOf(context, false, data->buildId))
     {
-        std::cerr << "Failed to open input file: " << ctx.outFilePath << std::endl;
-        return -2;
+        return -1;
     }
+    return writeData(context, data);
+}
 
-    int i = 0;
-    Operation op;
-    fread((void*) &op, 1, sizeof(op), f);
-    while (feof(f) == 0)
+int span(Context& context)
+{
+    const SpanOperationData* data = std::get_if<SpanOperationData>(&context.operationData);
+    DbSpanRecord record = {};
+    record.timestamp =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    record.begin = context.operation == Operation::SPAN_BEGIN ? 1 : 0;
+    memcpy(record.name, data->name.data(), data->name.size());
+    if (!buildIdOf(context, true, record.buildId))
     {
-        ++i;
-        if (op == Operation::START)
-        {
-            StartOperationData* sd = new StartOperationData();
-            fread((void*) &sd->timestamp, 1, sizeof(sd->timestamp), f);
-
-            size_t noteSize = 0;
-            fread((void*) &noteSize, 1, sizeof(noteSize), f);
-
-            sd->note.resize(noteSize, '\0');
-            fread((void*) sd->note.data(), 1, noteSize, f);
-            // std::cout << "Start " << sd->timestamp << " note size: " << noteSize << " note: "<< sd->note <<
-            // std::endl;
-            data.ops.push_back(std::make_pair(op, sd));
-        }
-        else if (op == Operation::STOP)
-        {
-            StopOperationData* sd = new StopOperationData();
-            fread((void*) &sd->timestamp, 1, sizeof(sd->timestamp), f);
-
-            size_t exitCodeSize;
-            fread((void*) &exitCodeSize, 1, sizeof(exitCodeSize), f);
-
-            sd->exitCode.resize(exitCodeSize, '\0');
-            fread((void*) sd->exitCode.data(), 1, exitCodeSize, f);
-
-            // std::cout << "Stop " << sd->timestamp << " exit code: " << sd->exitCode << std::endl;
-            data.ops.push_back(std::make_pair(op, sd));
-        }
-        fread((void*) &op, 1, sizeof(op), f);
+        return -1;
     }
-    fclose(f);
-
-    return 0;
+    return appendSpanRecord(context.outFilePath, record);
 }
 
 void printBuildStats(const StatOperationData& data)
@@ -440,266 +811,1423 @@ void printBuildStats(const StatOperationData& data)
               << "(" << data.lastBuildTime << " ms total)" << std::endl;
     std::cout << "    Total build count: " << data.totalBuildCount << std::endl;
     std::cout << "    Successful build count: " << data.successfulBuildCount << std::endl;
-}
 
-void drawBuildTimeGraph(const StatOperationData& data)
-{
-    if (data.buildGraphData.buildDates.size() < 1)
+    const ResourceUsageStats& usage = data.usage;
+    if (usage.buildCount == 0)
     {
         return;
     }
+    const double count = (double) usage.buildCount;
+    const double cpuSeconds = (usage.userTime + usage.systemTime) / 1000000.0;
+    std::cout << "Resource usage of the " << usage.buildCount << " builds run by profitDrain: " << std::endl;
+    std::cout << "    CPU time: " << usage.userTime / 1000000.0 << " s user, " << usage.systemTime / 1000000.0
+              << " s system. (avg " << usage.userTime / 1000000.0 / count << " s user, "
+              << usage.systemTime / 1000000.0 / count << " s system)" << std::endl;
+    // CPU time over wall time: how many cores the builds kept busy on average.
+    std::cout << "    Parallelism: " << (usage.wallTime > 0 ? cpuSeconds / (usage.wallTime / 1000.0) : 0)
+              << " cores busy on average" << std::endl;
+    std::cout << "    Max RSS: " << usage.maxRss / 1024.0 << " MiB peak, " << usage.totalMaxRss / 1024.0 / count
+              << " MiB avg" << std::endl;
+    std::cout << "    Block I/O: " << usage.blockInputs << " in, " << usage.blockOutputs << " out. (avg "
+              << usage.blockInputs / count << " in, " << usage.blockOutputs / count << " out)" << std::endl;
+    std::cout << "    Context switches: " << usage.voluntaryContextSwitches << " voluntary, "
+              << usage.involuntaryContextSwitches << " involuntary. (avg " << usage.voluntaryContextSwitches / count
+              << " voluntary, " << usage.involuntaryContextSwitches / count << " involuntary)" << std::endl;
+}
 
-    double minAvgBuildTime = data.buildGraphData.avgBuildTimes[0];
-    double maxAvgBuildTime = data.buildGraphData.avgBuildTimes[0];
-    int64_t minTotalBuildTime = data.buildGraphData.totalBuildTimes[0];
-    int64_t maxTotalBuildTime = data.buildGraphData.totalBuildTimes[0];
-    for (int i = 0; i < data.buildGraphData.buildDates.size(); ++i)
+std::string formatDuration(int64_t milliseconds)
+{
+    char text[32];
+    if (milliseconds < 1000)
     {
-        if (minAvgBuildTime > data.buildGraphData.avgBuildTimes[i])
-        {
-            minAvgBuildTime = data.buildGraphData.avgBuildTimes[i];
-        }
-        if (maxAvgBuildTime < data.buildGraphData.avgBuildTimes[i])
-        {
-            maxAvgBuildTime = data.buildGraphData.avgBuildTimes[i];
-        }
-
-        if (minTotalBuildTime > data.buildGraphData.totalBuildTimes[i])
-        {
-            minTotalBuildTime = data.buildGraphData.totalBuildTimes[i];
-        }
-        if (maxTotalBuildTime < data.buildGraphData.totalBuildTimes[i])
-        {
-            maxTotalBuildTime = data.buildGraphData.totalBuildTimes[i];
-        }
+        snprintf(text, sizeof(text), "%lld ms", (long long) milliseconds);
     }
-    const double maxHeight = 11.0;
-    const double maxWidth = data.buildGraphData.buildDates.size();
-
-    const int64_t tsNow =
-        std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-    const int64_t tsOld = (tsNow - (maxWidth * 24 * 60 * 60));
+    else if (milliseconds < 60 * 1000)
+    {
+        snprintf(text, sizeof(text), "%.1f s", milliseconds / 1000.0);
+    }
+    else if (milliseconds < 60 * 60 * 1000)
+    {
+        snprintf(text, sizeof(text), "%.1f min", milliseconds / 60000.0);
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "%.1f h", milliseconds / 3600000.0);
+    }
+    return text;
+}
 
-    // Draw avg build time graph
-    std::cout << "Average build times for the last " << maxWidth << " days (" << computeDateStr(tsOld) << " - "
-              << computeDateStr(tsNow) << "):" << std::endl;
-    std::cout << "            ";
-    for (int j = maxHeight - 1; j >= 0; --j)
+// The phases nested in a phase follow it, indented, the phases next to each other are ordered by their total time.
+void printBuildPhases(const StatOperationData& data)
+{
+    if (data.phases.empty())
     {
-        for (int i = maxWidth - 1; i >= 0; --i)
+        return;
+    }
+    std::unordered_map<std::string, int64_t> totalTimes;
+    for (const PhaseStats& phase : data.phases)
+    {
+        totalTimes[phase.path] = phase.totalTime;
+    }
+    // The phases the path of a phase goes through, a phase whose span was never closed itself counts as 0.
+    auto ancestors = [&totalTimes](const std::string& path) {
+        std::vector<std::pair<int64_t, std::string>> levels;
+        for (size_t end = path.find('/'); ; end = path.find('/', end + 1))
         {
-            const int columnHeight = data.buildGraphData.avgBuildTimes[i] * maxHeight / (double) maxAvgBuildTime;
-            if (j <= columnHeight)
+            const std::string prefix = path.substr(0, end);
+            const auto found = totalTimes.find(prefix);
+            levels.emplace_back(found != totalTimes.end() ? found->second : 0, prefix);
+            if (end == std::string::npos)
             {
-                std::cout << "*";
+                break;
             }
-            else
+        }
+        return levels;
+    };
+    std::vector<const PhaseStats*> order;
+    for (const PhaseStats& phase : data.phases)
+    {
+        order.push_back(&phase);
+    }
+    std::sort(order.begin(), order.end(), [&](const PhaseStats* a, const PhaseStats* b) {
+        const std::vector<std::pair<int64_t, std::string>> pathA = ancestors(a->path), pathB = ancestors(b->path);
+        for (size_t i = 0; i < pathA.size() && i < pathB.size(); ++i)
+        {
+            if (pathA[i].second != pathB[i].second)
             {
-                std::cout << " ";
+                return pathA[i].first != pathB[i].first ? pathA[i].first > pathB[i].first :
+                                                          pathA[i].second < pathB[i].second;
             }
+        }
+        return pathA.size() < pathB.size();
+    });
+
+    std::cout << "Build phases: " << std::endl;
+    char line[256];
+    snprintf(line, sizeof(line), "    %-40s %10s %12s %12s %12s", "PHASE", "COUNT", "TOTAL", "AVG", "P90");
+    std::cout << line << std::endl;
+    for (const PhaseStats* phase : order)
+    {
+        const size_t depth = std::count(phase->path.begin(), phase->path.end(), '/');
+        std::string name = std::string(2 * depth, ' ') + phase->path.substr(phase->path.rfind('/') + 1);
+        name = name.size() > 40 ? name.substr(0, 37) + "..." : name;
+        snprintf(line,
+                 sizeof(line),
+                 "    %-40s %10zu %12s %12s %12s",
+                 name.c_str(),
+                 phase->spanCount,
+                 formatDuration(phase->totalTime).c_str(),
+                 formatDuration(phase->totalTime / (int64_t) phase->spanCount).c_str(),
+                 formatDuration(phase->histogram.valueAtPercentile(90)).c_str());
+        std::cout << line << std::endl;
+    }
+}
 
-            if (i == 0)
-            {
-                std::cout << "| ";
-                if (j == 0)
-                {
-                    std::cout << minAvgBuildTime / 1000.0 << " s";
-                }
-                if (j == (int) (maxHeight / 2))
-                {
-                    std::cout << (minAvgBuildTime + maxAvgBuildTime) / 2000.0 << " s";
-                }
-                if (j == maxHeight - 1)
-                {
-                    std::cout << maxAvgBuildTime / 1000.0 << " s";
-                }
-            }
+// d.m.yyyy hh:mm, UTC
+std::string formatTimestamp(int64_t timestampMs)
+{
+    const time_t seconds = (time_t) (timestampMs >= 0 ? timestampMs / 1000 : -((-timestampMs - 1) / 1000) - 1);
+    struct tm date;
+    gimmeTime(&seconds, &date);
+    char text[32];
+    snprintf(text,
+             sizeof(text),
+             "%d.%d.%d %02d:%02d",
+             date.tm_mday,
+             date.tm_mon + 1,
+             date.tm_year + 1900,
+             date.tm_hour,
+             date.tm_min);
+    return text;
+}
+
+void printBuildTimeDistribution(const StatOperationData& data)
+{
+    const DurationHistogram& histogram = data.buildTimeHistogram;
+    if (histogram.totalCount() == 0)
+    {
+        return;
+    }
+
+    std::cout << "Build time percentiles: " << std::endl;
+    std::cout << "    p50: " << formatDuration(histogram.valueAtPercentile(50))
+              << ", p90: " << formatDuration(histogram.valueAtPercentile(90))
+              << ", p95: " << formatDuration(histogram.valueAtPercentile(95))
+              << ", p99: " << formatDuration(histogram.valueAtPercentile(99)) << std::endl;
+
+    // One row per power of two, row 0 holds the builds that took 0 ms. The buckets of the histogram never cross a
+    // power of two, so the rows are exact.
+    std::vector<uint64_t> rows(65, 0);
+    for (size_t i = 0; i < DurationHistogram::bucketCount; ++i)
+    {
+        int64_t value = DurationHistogram::lowestValue(i);
+        size_t row = 0;
+        while (value > 0)
+        {
+            ++row;
+            value >>= 1;
         }
-        std::cout << std::endl;
-        std::cout << "            ";
+        rows[row] += histogram.countAt(i);
     }
-    for (int i = maxWidth - 1; i >= 0; --i)
+    size_t firstRow = 0;
+    size_t lastRow = rows.size() - 1;
+    while (rows[firstRow] == 0)
     {
-        std::cout << "-";
+        ++firstRow;
     }
-    std::cout << std::endl;
-    std::cout << std::endl;
+    while (rows[lastRow] == 0)
+    {
+        --lastRow;
+    }
+    const uint64_t maxRowCount = *std::max_element(rows.begin() + firstRow, rows.begin() + lastRow + 1);
+
+    const int barWidth = 60;
+    std::cout << "Build time distribution: " << std::endl;
+    for (size_t row = firstRow; row <= lastRow; ++row)
+    {
+        const int64_t low = row == 0 ? 0 : int64_t(1) << (row - 1);
+        const int64_t high = int64_t(1) << row;
+        char label[48];
+        snprintf(label, sizeof(label), "%10s - %-10s|", formatDuration(low).c_str(), formatDuration(high).c_str());
+        const int barLength = (int) ((rows[row] * barWidth + maxRowCount - 1) / maxRowCount);
+        std::cout << "    " << label << std::string(barLength, '*') << " " << rows[row] << std::endl;
+    }
+}
 
-    // Draw max build time graph
-    std::cout << "Total build times for the last " << maxWidth << " days (" << computeDateStr(tsOld) << " - "
-              << computeDateStr(tsNow) << "):" << std::endl;
-    std::cout << "            ";
+void printBuildGroups(const StatOperationData& data)
+{
+    if (data.groupBy.empty())
+    {
+        return;
+    }
+
+    // Where the build time goes first.
+    std::vector<uint32_t> order(data.groups.size());
+    for (uint32_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return data.groups[a].totalBuildTime > data.groups[b].totalBuildTime;
+    });
+
+    std::cout << "Builds by " << (data.groupBy == "note" ? std::string("note") : data.groupBy + " tag") << ": "
+              << std::endl;
+    char line[256];
+    snprintf(line, sizeof(line), "    %-40s %10s %8s %12s %12s %12s", "GROUP", "COUNT", "SUCCESS", "TOTAL", "AVG", "MAX");
+    std::cout << line << std::endl;
+    size_t groupedBuildCount = 0;
+    for (const uint32_t group : order)
+    {
+        const BuildGroupStats& stats = data.groups[group];
+        std::string name(data.groupNames.name(group));
+        name = name.empty() ? "(none)" : (name.size() > 40 ? name.substr(0, 37) + "..." : name);
+        snprintf(line,
+                 sizeof(line),
+                 "    %-40s %10zu %7.1f%% %12s %12s %12s",
+                 name.c_str(),
+                 stats.buildCount,
+                 stats.buildCount ? 100.0 * stats.successfulBuildCount / stats.buildCount : 0.0,
+                 formatDuration((int64_t) stats.totalBuildTime).c_str(),
+                 formatDuration(stats.successfulBuildCount ? (int64_t) (stats.totalBuildTime /
+                                                                        stats.successfulBuildCount) :
+                                                             0)
+                     .c_str(),
+                 formatDuration((int64_t) stats.maxBuildTime).c_str());
+        std::cout << line << std::endl;
+        groupedBuildCount += stats.buildCount;
+    }
+    // Compacted builds have no notes left.
+    if (data.compactedBuildCount > 0)
+    {
+        snprintf(line, sizeof(line), "    %-40s %10zu", "(compacted)", data.compactedBuildCount);
+        std::cout << line << std::endl;
+        groupedBuildCount += data.compactedBuildCount;
+    }
+    // STOPs without a START have no note, they are failed builds of no group.
+    if (groupedBuildCount < data.totalBuildCount)
+    {
+        snprintf(line, sizeof(line), "    %-40s %10zu", "(STOP without START)", data.totalBuildCount - groupedBuildCount);
+        std::cout << line << std::endl;
+    }
+}
+
+// Appends a graph of the values to the frame, one column per value, with the scale on the right.
+void drawGraph(std::string& frame, const std::string& title, const std::vector<double>& values)
+{
+    const double maxHeight = 11.0;
+    double minValue = values[0];
+    double maxValue = values[0];
+    for (const double value : values)
+    {
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+    }
+
+    char scale[64];
+    frame += title;
+    frame += "            ";
     for (int j = maxHeight - 1; j >= 0; --j)
     {
-        for (int i = maxWidth - 1; i >= 0; --i)
+        for (const double value : values)
+        {
+            const int columnHeight = maxValue > 0 ? (int) (value * maxHeight / maxValue) : -1;
+            frame += j <= columnHeight ? '*' : ' ';
+        }
+        frame += "| ";
+        if (j == 0)
+        {
+            snprintf(scale, sizeof(scale), "%g s", minValue / 1000.0);
+            frame += scale;
+        }
+        if (j == (int) (maxHeight / 2))
+        {
+            snprintf(scale, sizeof(scale), "%g s", (minValue + maxValue) / 2000.0);
+            frame += scale;
+        }
+        if (j == maxHeight - 1)
+        {
+            snprintf(scale, sizeof(scale), "%g s", maxValue / 1000.0);
+            frame += scale;
+        }
+        frame += "\n            ";
+    }
+    frame.append(values.size(), '-');
+    frame += "\n\n";
+}
+
+// The whole frame is put together in memory and written at once.
+void drawBuildTimeGraph(const StatOperationData& data)
+{
+    const BuildGraphData& graph = data.buildGraphData;
+    const std::vector<GraphColumn> columns = graphColumns(graph);
+    if (columns.empty())
+    {
+        return;
+    }
+
+    std::vector<double> avgBuildTimes(columns.size());
+    std::vector<double> totalBuildTimes(columns.size());
+    for (size_t i = 0; i < columns.size(); ++i)
+    {
+        avgBuildTimes[i] = columns[i].buildCount != 0 ? columns[i].totalBuildTime / (double) columns[i].buildCount : 0;
+        totalBuildTimes[i] = (double) columns[i].totalBuildTime;
+    }
+
+    const int64_t lastColumn = graphColumnIndex(graph.bucket, columns.back().start);
+    const int64_t tsNow = columns.back().start / 1000;
+    const int64_t tsOld = graphColumnStart(graph.bucket, lastColumn - graph.width) / 1000;
+    const std::string period = std::to_string(graph.width) + " " + graphBucketName(graph.bucket) + "s (" +
+                               computeDateStr(tsOld) + " - " + computeDateStr(tsNow) + "):\n";
+
+    std::string frame;
+    drawGraph(frame, "Average build times for the last " + period, avgBuildTimes);
+    drawGraph(frame, "Total build times for the last " + period, totalBuildTimes);
+    std::cout.write(frame.data(), frame.size());
+    std::cout.flush();
+}
+
+// Aggregates the records of the builds started in [since, until). The first record of the range is found by binary
+// search, so only the records of the range are read. The ids of the builds started in the range are collected.
+int aggregateRange(BuildTimerDbReader& reader,
+                   int64_t since,
+                   int64_t until,
+                   StatOperationData& data,
+                   std::unordered_set<uint64_t>& buildIds)
+{
+    reader.seekToTimestamp(since);
+    ReadProfile profile(reader);
+    RecordView record;
+    while (profile.next(reader, record))
+    {
+        const bool isStop = record.operation == Operation::STOP;
+        if (record.timestamp >= until)
         {
-            const int columnHeight = data.buildGraphData.totalBuildTimes[i] * maxHeight / (double) maxTotalBuildTime;
-            if (j <= columnHeight)
+            // Past the range only the STOPs of the builds started in it matter, a STOP without an id pairs with the
+            // START right before it. The reading goes on until every build of the range has stopped, to the end of the
+            // file if one never does.
+            const uint64_t stoppedBuildId = record.buildId != 0 ? record.buildId : data.pairing.lastStartedBuildId;
+            const bool closesOpenBuild = stoppedBuildId != 0 ? data.pairing.openBuilds.count(stoppedBuildId) != 0 :
+                                                               data.pairing.pendingStart && data.pairing.recordCount > 0;
+            if (isStop && closesOpenBuild)
             {
-                std::cout << "*";
+                aggregateRecord(data, record);
             }
             else
             {
-                std::cout << " ";
+                // Skipped, but it still comes between the START before it and the next STOP.
+                data.pairing.lastStartedBuildId = 0;
             }
-
-            if (i == 0)
+            if (data.pairing.openBuilds.empty())
             {
-                std::cout << "| ";
-                if (j == 0)
-                {
-                    std::cout << minTotalBuildTime / 1000.0 << " s";
-                }
-                if (j == (int) (maxHeight / 2))
-                {
-                    std::cout << (minTotalBuildTime + maxTotalBuildTime) / 2000.0 << " s";
-                }
-                if (j == maxHeight - 1)
-                {
-                    std::cout << maxTotalBuildTime / 1000.0 << " s";
-                }
+                break;
             }
+            continue;
         }
-        std::cout << std::endl;
-        std::cout << "            ";
+        if (isStop && record.buildId != 0 && data.pairing.openBuilds.count(record.buildId) == 0)
+        {
+            // The build started before the range.
+            data.pairing.lastStartedBuildId = 0;
+            continue;
+        }
+        if (!isStop && record.buildId != 0)
+        {
+            buildIds.insert(record.buildId);
+        }
+        aggregateRecord(data, record);
     }
-    for (int i = maxWidth - 1; i >= 0; --i)
+    profile.finish(reader);
+    return 0;
+}
+
+// Aggregates the records after the position of the reader. A big database is split into parts, each read on a thread
+// of its own and stitched to the parts before it in order, the reader ends up after the last record either way.
+int aggregateRecords(const std::string& path,
+                     BuildTimerDbReader& reader,
+                     const Context& context,
+                     int64_t tsNow,
+                     StatOperationData& data)
+{
+    const size_t minPartSize = 4 * 1024 * 1024;
+    const size_t threadCount = context.threadCount != 0 ? context.threadCount : std::thread::hardware_concurrency();
+    const std::vector<size_t> partStarts = reader.partPositions(threadCount, minPartSize);
+    struct Part
     {
-        std::cout << "-";
+        BuildTimerDbReader reader;
+        StatOperationData data;
+    };
+    std::vector<Part> parts(partStarts.size());
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        // Appended since the reader was opened or not, every part ends where the next one starts.
+        Part& part = parts[i];
+        if (profiled(ProfileStage::OPEN, [&]() { return part.reader.open(path); }) != 0 ||
+            !part.reader.seekToPart(partStarts[i]))
+        {
+            return -33;
+        }
+        part.reader.limit(i + 1 < parts.size() ? partStarts[i + 1] : reader.size());
+        initBuildStats(part.data, context.graphBucket, context.graphWidth, tsNow);
+        part.data.groupBy = data.groupBy;
+        part.data.pairing.chunked = true;
     }
-    std::cout << std::endl;
-    std::cout << std::endl;
+
+    const auto readPart = [](BuildTimerDbReader& partReader, StatOperationData& partData) {
+        ReadProfile profile(partReader);
+        RecordView record;
+        while (profile.next(partReader, record))
+        {
+            partData.pairing.position = partReader.position();
+            aggregateRecord(partData, record);
+        }
+        profile.finish(partReader);
+    };
+    std::vector<std::thread> threads;
+    for (Part& part : parts)
+    {
+        threads.emplace_back(readPart, std::ref(part.reader), std::ref(part.data));
+    }
+    if (!parts.empty())
+    {
+        reader.limit(partStarts.front());
+    }
+    readPart(reader, data);
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const ProfileScope mergeScope(ProfileStage::MERGE);
+    for (const Part& part : parts)
+    {
+        stitchBuildStats(data, part.data);
+    }
+    if (!parts.empty())
+    {
+        reader.limit(reader.size());
+        reader.seek(parts.back().reader.position(), parts.back().reader.state());
+    }
+    return 0;
+}
+
+// Aggregates a single file, the database itself or one of its segments.
+int aggregateFile(const std::string& path,
+                  const Context& context,
+                  int64_t tsNow,
+                  StatOperationData& data,
+                  std::unordered_set<uint64_t>& buildIdsInRange)
+{
+    BuildTimerDbReader reader;
+    if (profiled(ProfileStage::OPEN, [&]() { return reader.open(path); }) != 0)
+    {
+        return -33;
+    }
+
+    const bool isRange = context.since != INT64_MIN || context.until != INT64_MAX;
+    if (isRange)
+    {
+        initBuildStats(data, context.graphBucket, context.graphWidth, tsNow);
+        data.groupBy = context.groupBy;
+        aggregateRange(reader, context.since, context.until, data, buildIdsInRange);
+    }
+    else if (!context.groupBy.empty())
+    {
+        // The stat checkpoint is kept for the builds that aren't grouped, a --group-by of any key would replace it.
+        initBuildStats(data, context.graphBucket, context.graphWidth, tsNow);
+        data.groupBy = context.groupBy;
+        return aggregateRecords(path, reader, context, tsNow, data);
+    }
+    else
+    {
+        // Only the records appended since the last run are read when there is a valid checkpoint.
+        if (!profiled(ProfileStage::CHECKPOINT, [&]() {
+                return loadStatCheckpoint(path, reader, context.graphBucket, context.graphWidth, tsNow, data);
+            }))
+        {
+            initBuildStats(data, context.graphBucket, context.graphWidth, tsNow);
+        }
+        const int result = aggregateRecords(path, reader, context, tsNow, data);
+        if (result != 0)
+        {
+            return result;
+        }
+        // Not being able to write the checkpoint (e.g. read only database directory) only costs time on the next run.
+        profiled(ProfileStage::CHECKPOINT, [&]() { return saveStatCheckpoint(path, reader, data); });
+    }
+    return 0;
+}
+
+// Adds the builds moved out of the database by rotate and compact: the rollups and the segments, each segment is
+// aggregated on its own, with its own checkpoint. Rollups only know days, a range includes the days it touches.
+int aggregateHistory(const std::string& path,
+                     const Context& context,
+                     int64_t tsNow,
+                     StatOperationData& data,
+                     std::unordered_set<uint64_t>& buildIdsInRange)
+{
+    const int64_t firstDay = context.since == INT64_MIN ? INT64_MIN : computeDayIndex(context.since);
+    const int64_t lastDay = context.until == INT64_MAX ? INT64_MAX : computeDayIndex(context.until - 1);
+    int64_t compactedUntil = INT64_MIN;
+    if (profiled(ProfileStage::SIDE_FILES,
+                 [&]() { return aggregateRollups(path, firstDay, lastDay, data, compactedUntil); }) != 0)
+    {
+        return -3;
+    }
+
+    std::vector<std::string> segmentPaths;
+    std::vector<int> months;
+    listSegments(path, segmentPaths, months);
+    for (size_t i = 0; i < segmentPaths.size(); ++i)
+    {
+        // A segment only holds the builds started in its month.
+        const int64_t segmentStart = firstDayOfMonth(months[i]) * millisecondsPerDay;
+        const int64_t segmentEnd = firstDayOfMonth(months[i] + 1) * millisecondsPerDay;
+        if ((compactedUntil != INT64_MIN && segmentEnd <= compactedUntil * millisecondsPerDay) ||
+            segmentEnd <= context.since || segmentStart >= context.until)
+        {
+            continue;
+        }
+        StatOperationData segmentData = {};
+        const int result = aggregateFile(segmentPaths[i], context, tsNow, segmentData, buildIdsInRange);
+        if (result != 0)
+        {
+            return result;
+        }
+        const ProfileScope mergeScope(ProfileStage::MERGE);
+        mergeBuildStats(data, segmentData);
+    }
+    return 0;
+}
+
+int aggregateDatabase(const std::string& path, const Context& context, int64_t tsNow, StatOperationData& data)
+{
+    initBuildStats(data, context.graphBucket, context.graphWidth, tsNow);
+    data.groupBy = context.groupBy;
+    std::unordered_set<uint64_t> buildIdsInRange;
+    int result = aggregateHistory(path, context, tsNow, data, buildIdsInRange);
+    StatOperationData fileData = {};
+    result = result != 0 ? result : aggregateFile(path, context, tsNow, fileData, buildIdsInRange);
+    if (result != 0)
+    {
+        return result;
+    }
+    profiled(ProfileStage::MERGE, [&]() { mergeBuildStats(data, fileData); });
+
+    const ProfileScope sideFilesScope(ProfileStage::SIDE_FILES);
+    const bool isRange = context.since != INT64_MIN || context.until != INT64_MAX;
+    std::vector<DbUsageRecord> usageRecords;
+    if (readUsageRecords(path, usageRecords) != 0)
+    {
+        std::cerr << "Ignoring the unsupported usage file of " << path << std::endl;
+    }
+    data.usage = {};
+    for (const DbUsageRecord& usage : usageRecords)
+    {
+        if (!isRange || buildIdsInRange.count(usage.buildId) != 0)
+        {
+            aggregateUsage(data.usage, usage);
+        }
+    }
+
+    std::vector<DbSpanRecord> spans;
+    if (readSpanRecords(path, spans) != 0)
+    {
+        std::cerr << "Ignoring the unsupported spans file of " << path << std::endl;
+    }
+    // The spans recorded without a build id are in the range if they are themselves.
+    spans.erase(std::remove_if(spans.begin(),
+                               spans.end(),
+                               [&](const DbSpanRecord& span) {
+                                   return isRange && (span.buildId != 0 ? buildIdsInRange.count(span.buildId) == 0 :
+                                                                          span.timestamp < context.since ||
+                                                                              span.timestamp >= context.until);
+                               }),
+                spans.end());
+    data.phases.clear();
+    aggregateSpans(data.phases, spans);
+
+    return 0;
+}
+
+void printStat(const StatOperationData& data)
+{
+    profiled(ProfileStage::GRAPHS, [&]() { drawBuildTimeGraph(data); });
+    const ProfileScope reportScope(ProfileStage::REPORT);
+    printBuildStats(data);
+    printBuildTimeDistribution(data);
+    printBuildGroups(data);
+    printBuildPhases(data);
+}
+
+// Asks the collector of the database for the statistics. Returns collectorNotRunning if the files have to be read,
+// because there is no collector or it can't answer the query from what it keeps in memory.
+int statFromCollector(const Context& context)
+{
+    const bool isPlainQuery = context.dbFilePaths.size() == 1 && context.since == INT64_MIN &&
+                              context.until == INT64_MAX && context.groupBy.empty();
+    if (!isPlainQuery)
+    {
+        return collectorNotRunning;
+    }
+    std::string response;
+    const int result = collectorRequest(context.outFilePath,
+                                        "stat\n" + std::string(graphBucketName(context.graphBucket)) + " " +
+                                            std::to_string(context.graphWidth),
+                                        response);
+    // Reading the files gives the same answer, a collector in trouble only makes stat slower.
+    if (result != 0 || response.compare(0, 3, "OK\n") != 0)
+    {
+        return collectorNotRunning;
+    }
+    std::cout.write(response.data() + 3, response.size() - 3);
+    std::cout.flush();
+    return 0;
 }
 
 int stat(Context& context)
 {
+    const int collectorResult = profiled(ProfileStage::COLLECTOR, [&]() { return statFromCollector(context); });
+    if (collectorResult != collectorNotRunning)
+    {
+        return collectorResult;
+    }
+
+    int64_t tsNow =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    // The graphs end with the range and, unless --width says otherwise, show all of it.
+    if (context.until != INT64_MAX && context.until - 1 < tsNow)
+    {
+        tsNow = context.until - 1;
+    }
+    if (context.since != INT64_MIN && !context.graphWidthSet)
+    {
+        const int64_t rangeColumns =
+            graphColumnIndex(context.graphBucket, tsNow) - graphColumnIndex(context.graphBucket, context.since) + 1;
+        context.graphWidth = (int) std::min<int64_t>(std::max<int64_t>(rangeColumns, 1), 366);
+    }
+
+    // Every database is aggregated on its own, then the results are merged. The databases and the parts of each share
+    // the --threads budget: a worker per database up to the budget, each reading its databases with its share of it.
+    const size_t fileCount = context.dbFilePaths.size();
+    std::vector<StatOperationData> partials(fileCount);
+    std::vector<int> results(fileCount, 0);
+    std::atomic<size_t> nextFile(0);
+    const auto worker = [&](const Context& workerContext) {
+        for (size_t i = nextFile++; i < fileCount; i = nextFile++)
+        {
+            results[i] = aggregateDatabase(context.dbFilePaths[i], workerContext, tsNow, partials[i]);
+        }
+    };
+
+    const size_t threadBudget =
+        context.threadCount != 0 ? context.threadCount : std::max(1u, std::thread::hardware_concurrency());
+    const size_t threadCount = std::max<size_t>(std::min(fileCount, threadBudget), 1);
+    std::vector<Context> workerContexts(threadCount, context);
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        workerContexts[i].threadCount = (unsigned) (threadBudget / threadCount + (i < threadBudget % threadCount));
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; ++i)
+    {
+        threads.emplace_back(worker, std::cref(workerContexts[i]));
+    }
+    worker(workerContexts[0]);
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < fileCount; ++i)
+    {
+        if (results[i] != 0)
+        {
+            std::cerr << "Failed to read build timer data!" << std::endl;
+            return results[i];
+        }
+    }
     StatOperationData data = {};
-    if (readBuildTimerData(context, data) != 0)
+    profiled(ProfileStage::MERGE, [&]() {
+        initBuildStats(data, context.graphBucket, context.graphWidth, tsNow);
+        data.groupBy = context.groupBy;
+        for (const StatOperationData& partial : partials)
+        {
+            mergeBuildStats(data, partial);
+        }
+        finishBuildStats(data);
+    });
+    printStat(data);
+
+    return 0;
+}
+
+int takeDump(Context& context)
+{
+    BuildTimerDbReader reader;
+    if (reader.open(context.outFilePath) != 0)
     {
         std::cerr << "Failed to read build timer data!" << std::endl;
         return -33;
     }
-    // std::cout << "Ops read from storage: " << data.ops.size() << std::endl;
 
-    const int daysToCheck = 120;
-    std::vector<std::pair<std::string, int64_t>> buildDays;
-    buildDays.reserve(daysToCheck);
-    const int64_t tsNow =
+    OutputBuffer out(stdout);
+    writeDumpHeader(out, context.dumpFormat);
+    // The records keep the index they have in the dump of the whole database.
+    uint64_t firstIndex = 0;
+    if (context.since != INT64_MIN)
+    {
+        firstIndex = reader.seekToTimestamp(context.since);
+    }
+    const bool exitCodeAsText = reader.version() == dbLegacyVersion;
+    TraceWriter trace(out, context.outFilePath, context.groupBy, exitCodeAsText);
+    RecordView record;
+    for (uint64_t i = firstIndex; reader.next(record) && record.timestamp < context.until; ++i)
+    {
+        if (context.dumpFormat == DumpFormat::TRACE)
+        {
+            trace.write(record);
+        }
+        else
+        {
+            writeDumpRecord(out, context.dumpFormat, i, record, exitCodeAsText);
+        }
+    }
+    if (context.dumpFormat == DumpFormat::TRACE)
+    {
+        trace.finish();
+    }
+
+    if (!out.flush())
+    {
+        std::cerr << "Failed to write the dump!" << std::endl;
+        return -2;
+    }
+    return 0;
+}
+
+bool fileExists(const std::string& path)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f)
+    {
+        fclose(f);
+    }
+    return f != nullptr;
+}
+
+int convertFormat(Context& context)
+{
+    ConvertOperationData* data = std::get_if<ConvertOperationData>(&context.operationData);
+    if (!data->targetPath.empty())
+    {
+        if (fileExists(data->targetPath))
+        {
+            std::cerr << "The target file already exists: " << data->targetPath << std::endl;
+            return -2;
+        }
+        return convertDatabase(context.outFilePath, data->targetPath, context.encoding);
+    }
+
+    BuildTimerDbReader reader;
+    if (reader.open(context.outFilePath) != 0)
+    {
+        return -2;
+    }
+    const int originalVersion = reader.version();
+    reader.close();
+
+    // Convert next to the original, then swap the files, keeping the original database around.
+    const std::string tmpPath = context.outFilePath + ".convtmp";
+    const std::string originalPath = context.outFilePath + ".v" + std::to_string(originalVersion);
+    if (fileExists(originalPath))
+    {
+        std::cerr << "A converted original database already exists: " << originalPath << std::endl;
+        return -2;
+    }
+
+    const int result = convertDatabase(context.outFilePath, tmpPath, context.encoding);
+    if (result != 0)
+    {
+        remove(tmpPath.c_str());
+        remove(notesPathFor(tmpPath).c_str());
+        return result;
+    }
+
+    // Legacy databases have no notes heap.
+    const bool hasNotes = fileExists(notesPathFor(context.outFilePath));
+    if (rename(context.outFilePath.c_str(), originalPath.c_str()) != 0 ||
+        (hasNotes && rename(notesPathFor(context.outFilePath).c_str(), notesPathFor(originalPath).c_str()) != 0) ||
+        rename(tmpPath.c_str(), context.outFilePath.c_str()) != 0 ||
+        rename(notesPathFor(tmpPath).c_str(), notesPathFor(context.outFilePath).c_str()) != 0)
+    {
+        std::cerr << "Failed to replace the database with the converted one: " << context.outFilePath << std::endl;
+        return -2;
+    }
+    std::cout << "Converted " << context.outFilePath << ", the original database was kept as " << originalPath
+              << std::endl;
+    return 0;
+}
+
+int run(Context& context)
+{
+    StartOperationData* data = std::get_if<StartOperationData>(&context.operationData);
+    data->timestamp =
         std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
             .count();
+    data->buildId = generateBuildId();
+    // The steps of the command find the build in the environment, the spans they record belong to it.
+#if defined(_WIN64) || defined(_WIN32)
+    _putenv_s("PROFITDRAIN_BUILD_ID", formatBuildId(data->buildId).c_str());
+#else
+    setenv("PROFITDRAIN_BUILD_ID", formatBuildId(data->buildId).c_str(), 1);
+#endif
+    // The START is appended before the command is launched, the same as start does: the ranges of stat and dump rely
+    // on the records being appended in time order, and the builds the command records itself come after it.
+    const bool started = writeData(context, data) == 0;
+    if (!started)
+    {
+        std::cerr << "Failed to record the build!" << std::endl;
+    }
+
+    BuildRunResult result = {};
+    const int runResult = runBuild(context.runCommand, result);
+    // A command that couldn't be started fails the way the shells report it, with 127.
+    const int exitCode = runResult == 0 ? result.exitCode : 127;
 
-    for (int i = 0; i < daysToCheck; ++i)
+    // The STOP time is derived from the monotonic duration, a wall clock adjustment during the build can't skew it.
+    StopOperationData stop = {std::to_string(exitCode), data->timestamp + result.duration, data->buildId};
+    result.usage.buildId = data->buildId;
+    if (started && (writeData(context, &stop) != 0 ||
+                    (runResult == 0 && appendUsageRecord(context.outFilePath, result.usage) != 0)))
     {
-        const int64_t tsAux = (tsNow / 1000.0 - (i * 24 * 60 * 60));
-        data.buildGraphData.buildDates.push_back(computeDateStr(tsAux));
-        data.buildGraphData.avgBuildTimes.push_back(0);
-        data.buildGraphData.totalBuildTimes.push_back(0);
+        std::cerr << "Failed to record the build!" << std::endl;
     }
 
-    int i;
-    for (i = 1; i < data.ops.size(); ++i)
+    // Transparent to the caller, the build script sees the exit code of the command.
+    return runResult == 0 ? exitCode : -5;
+}
+
+static volatile std::sig_atomic_t stopServing = 0;
+
+void requestStopServing(int)
+{
+    stopServing = 1;
+}
+
+// What the collector keeps in memory: the running totals of the database up to the reader position, the same as the
+// stat checkpoint holds.
+struct CollectorState
+{
+    StatOperationData data;
+    BuildTimerDbReader reader;
+    FileIdentity identity;
+    bool loaded = false;
+};
+
+// Brings the live aggregates up to date with the records appended since the last call, by the collector or anyone
+// else writing the file. The state starts over from the checkpoint when the last column of the graphs changes or the
+// file was replaced.
+int refreshCollectorState(const Context& context, int64_t tsNow, CollectorState& state)
+{
+    FileIdentity identity = {};
+    const int64_t nextColumn = graphColumnIndex(context.graphBucket, tsNow) + 1;
+    const bool sameColumn = state.loaded && state.data.buildGraphData.lastHour ==
+                                                computeHourIndex(graphColumnStart(context.graphBucket, nextColumn) - 1);
+    const bool sameFile = fileIdentity(context.outFilePath, identity) == 0 && state.loaded &&
+                          identity.device == state.identity.device && identity.inode == state.identity.inode;
+    const size_t position = state.reader.position();
+    const ReaderState readerState = state.reader.state();
+    if (sameColumn && sameFile)
     {
-        if (data.ops[i - 1].first == Operation::START && data.ops[i].first == Operation::STOP)
+        state.reader.close();
+        if (state.reader.open(context.outFilePath) != 0)
+        {
+            state.loaded = false;
+            return -2;
+        }
+        if (state.reader.size() < position || !state.reader.seek(position, readerState))
         {
-            StartOperationData* startData = (StartOperationData*) (data.ops[i - 1].second);
-            StopOperationData* stopData = (StopOperationData*) (data.ops[i].second);
-            size_t buildTime = stopData->timestamp - startData->timestamp;
-            if (buildTime >= 0)
+            state.loaded = false;
+        }
+    }
+    else
+    {
+        if (state.loaded)
+        {
+            saveStatCheckpoint(context.outFilePath, state.reader, state.data);
+        }
+        state.loaded = false;
+    }
+
+    if (!state.loaded)
+    {
+        state.reader.close();
+        if (state.reader.open(context.outFilePath) != 0)
+        {
+            return -2;
+        }
+        state.data = StatOperationData();
+        if (!loadStatCheckpoint(
+                context.outFilePath, state.reader, context.graphBucket, context.graphWidth, tsNow, state.data))
+        {
+            initBuildStats(state.data, context.graphBucket, context.graphWidth, tsNow);
+        }
+        fileIdentity(context.outFilePath, state.identity);
+        state.loaded = true;
+    }
+
+    RecordView record;
+    while (state.reader.next(record))
+    {
+        aggregateRecord(state.data, record);
+    }
+    return 0;
+}
+
+// The query is the <bucket> <width> of the graphs.
+std::string collectorStat(const Context& context, const std::string& graphs, CollectorState& state)
+{
+    int64_t tsNow =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    Context query;
+    const size_t separator = graphs.find(' ');
+    char* end = nullptr;
+    const long width = separator != std::string::npos ? strtol(graphs.c_str() + separator + 1, &end, 10) : 0;
+    if (separator == std::string::npos || !parseGraphBucket(graphs.substr(0, separator), query.graphBucket) ||
+        separator + 1 == graphs.size() || *end != '\0' || width < 1 || width > 100000)
+    {
+        return "FALLBACK\n";
+    }
+    query.graphWidth = (int) width;
+    if (refreshCollectorState(context, tsNow, state) != 0)
+    {
+        return "FALLBACK\n";
+    }
+
+    // The same merge stat does with the aggregates of a database, the live state is not touched.
+    StatOperationData data = {};
+    initBuildStats(data, query.graphBucket, query.graphWidth, tsNow);
+    const BuildGraphData& graph = data.buildGraphData;
+    const BuildGraphData& liveGraph = state.data.buildGraphData;
+    if (graph.lastHour > liveGraph.lastHour || graph.lastHour - (int64_t) graph.totalBuildTimes.size() <
+                                                   liveGraph.lastHour - (int64_t) liveGraph.totalBuildTimes.size())
+    {
+        // The graphs reach further than the ones the collector keeps buckets for.
+        return "FALLBACK\n";
+    }
+    std::unordered_set<uint64_t> buildIdsInRange;
+    if (aggregateHistory(context.outFilePath, query, tsNow, data, buildIdsInRange) != 0)
+    {
+        return "FALLBACK\n";
+    }
+    mergeBuildStats(data, state.data);
+    std::vector<DbUsageRecord> usageRecords;
+    readUsageRecords(context.outFilePath, usageRecords);
+    data.usage = {};
+    for (const DbUsageRecord& usage : usageRecords)
+    {
+        aggregateUsage(data.usage, usage);
+    }
+    std::vector<DbSpanRecord> spans;
+    readSpanRecords(context.outFilePath, spans);
+    data.phases.clear();
+    aggregateSpans(data.phases, spans);
+    finishBuildStats(data);
+
+    std::ostringstream output;
+    std::streambuf* stdoutBuffer = std::cout.rdbuf(output.rdbuf());
+    printStat(data);
+    std::cout.rdbuf(stdoutBuffer);
+    return "OK\n" + output.str();
+}
+
+bool parseRecordRequest(const std::string& request, RecordView& record)
+{
+    // record\n<start|stop>\n<timestamp>\n<build id>\n<text>
+    size_t fields[4];
+    size_t position = 0;
+    for (size_t& field : fields)
+    {
+        position = request.find('\n', position);
+        if (position == std::string::npos)
+        {
+            return false;
+        }
+        field = ++position;
+    }
+    const std::string_view operation(request.data() + fields[0], fields[1] - fields[0] - 1);
+    const char* const timestampEnd = request.data() + fields[2] - 1;
+    const char* const buildIdEnd = request.data() + fields[3] - 1;
+    record = {};
+    record.operation = operation == "start" ? Operation::START : Operation::STOP;
+    record.text = std::string_view(request.data() + fields[3], request.size() - fields[3]);
+    record.exitCode = record.operation == Operation::STOP ? parseExitCode(record.text) : 0;
+    const std::from_chars_result timestamp =
+        std::from_chars(request.data() + fields[1], timestampEnd, record.timestamp);
+    const std::from_chars_result buildId = std::from_chars(request.data() + fields[2], buildIdEnd, record.buildId, 16);
+    return (operation == "start" || operation == "stop") && timestamp.ec == std::errc() &&
+           timestamp.ptr == timestampEnd && buildId.ec == std::errc() && buildId.ptr == buildIdEnd;
+}
+
+// Keeps the database open and answers the requests of the commands sent to <database>.sock: START and STOP records
+// arriving together are appended with a single write (group commit), stat is answered from the live aggregates.
+int serve(Context& context)
+{
+    CollectorServer server;
+    const int openResult = server.open(context.outFilePath);
+    if (openResult != 0)
+    {
+        return openResult;
+    }
+    std::signal(SIGINT, requestStopServing);
+    std::signal(SIGTERM, requestStopServing);
+    std::cout << "Collecting builds of " << context.outFilePath << " on " << collectorSocketPath(context.outFilePath)
+              << std::endl;
+
+    CollectorState state;
+    std::vector<CollectorServer::Request> requests;
+    std::vector<RecordView> records;
+    std::vector<int> recordClients;
+    while (!stopServing)
+    {
+        requests.clear();
+        // Wakes up now and then, a signal arriving outside of the wait is noticed anyway.
+        server.receive(1000, requests);
+
+        records.clear();
+        recordClients.clear();
+        for (const CollectorServer::Request& request : requests)
+        {
+            RecordView record;
+            if (request.payload.compare(0, 7, "record\n") != 0)
             {
-                if (stopData->exitCode == "0")
-                {
-                    ++(data.successfulBuildCount);
-                    ++(data.totalBuildCount);
-                    data.totalBuildTime += buildTime;
-                }
-                else
-                {
-                    ++(data.totalBuildCount);
-                }
+                continue;
             }
-            else
+            if (!parseRecordRequest(request.payload, record))
             {
-                ++(data.totalBuildCount);
+                server.respond(request.client, "ERROR\ninvalid record");
+                continue;
             }
-
-            const int64_t tsAux = startData->timestamp / 1000.0;
-            const std::string dmy = computeDateStr(tsAux);
-            for (int k = 0; k < data.buildGraphData.buildDates.size(); ++k)
+            records.push_back(record);
+            recordClients.push_back(request.client);
+        }
+        if (!records.empty())
+        {
+            // Readers binary search the timestamps, the records of a batch are written in time order.
+            std::stable_sort(records.begin(), records.end(), [](const RecordView& left, const RecordView& right) {
+                return left.timestamp < right.timestamp;
+            });
+            const bool written = appendRecords(context.outFilePath, records.data(), records.size()) == 0;
+            for (const int client : recordClients)
             {
-                if (dmy == data.buildGraphData.buildDates[k] && stopData->exitCode == "0")
-                {
-                    data.buildGraphData.totalBuildTimes[k] += buildTime;
-                    data.buildGraphData.avgBuildTimes[k] += 1;
-                }
+                server.respond(client, written ? "OK\n" : "ERROR\nfailed to write the database");
             }
+        }
 
-            if (stopData->exitCode == "0")
+        // Queries see the records of the batch they arrived with.
+        for (const CollectorServer::Request& request : requests)
+        {
+            if (request.payload.compare(0, 5, "stat\n") == 0)
             {
-                data.lastBuildTime = buildTime;
+                server.respond(request.client, collectorStat(context, request.payload.substr(5), state));
             }
+            else if (request.payload.compare(0, 7, "record\n") != 0)
+            {
+                server.respond(request.client, "ERROR\nunknown request");
+            }
+        }
+    }
+
+    server.close();
+    if (state.loaded)
+    {
+        // The next stat, by a collector or not, continues from where this one got.
+        const int64_t tsNow = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::system_clock::now().time_since_epoch())
+                                  .count();
+        refreshCollectorState(context, tsNow, state);
+        saveStatCheckpoint(context.outFilePath, state.reader, state.data);
+    }
+    std::cout << "Collector stopped." << std::endl;
+    return 0;
+}
+
+
+void printRegressions(const Context& context,
+                      const StatOperationData& data,
+                      const std::vector<ChangeDetector>& detectors,
+                      const std::vector<ChangePoint>& changes,
+                      size_t newChangeIndex)
+{
+    uint64_t buildCount = 0;
+    for (const ChangeDetector& detector : detectors)
+    {
+        buildCount += detector.buildCount;
+    }
+    // The shifts are found in the order they are confirmed, a group may take longer than another to confirm its own.
+    std::vector<size_t> order(changes.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&changes](size_t a, size_t b) {
+        return changes[a].timestamp < changes[b].timestamp;
+    });
+    size_t shown = 0;
+    char line[256];
+    for (size_t i : order)
+    {
+        const ChangePoint& change = changes[i];
+        if (change.timestamp < context.since || change.timestamp >= context.until)
+        {
+            continue;
+        }
+        if (shown++ == 0)
+        {
+            std::cout << "Build time shifts: " << std::endl;
+            snprintf(line,
+                     sizeof(line),
+                     "    %-17s %8s %12s %12s %8s%s",
+                     "SINCE",
+                     "CHANGE",
+                     "BEFORE",
+                     "AFTER",
+                     "BUILDS",
+                     data.groupBy.empty() ? "" : "  GROUP");
+            std::cout << line << std::endl;
+        }
+        std::string tail;
+        if (!data.groupBy.empty())
+        {
+            const std::string name(data.groupNames.name(change.group));
+            tail = "  " + (name.empty() ? std::string("(none)") : name);
+        }
+        // Found by this run.
+        if (i >= newChangeIndex)
+        {
+            tail += " (new)";
+        }
+        snprintf(line,
+                 sizeof(line),
+                 "    %-17s %+7.1f%% %12s %12s %8u%s",
+                 formatTimestamp(change.timestamp).c_str(),
+                 change.before > 0 ? 100.0 * (change.after - change.before) / change.before : 0.0,
+                 formatDuration(change.before).c_str(),
+                 formatDuration(change.after).c_str(),
+                 change.buildCount,
+                 tail.c_str());
+        std::cout << line << std::endl;
+    }
+    if (shown == 0 && (context.since != INT64_MIN || context.until != INT64_MAX))
+    {
+        std::cout << "No build time shifts found in the time range." << std::endl;
+    }
+    else if (shown == 0)
+    {
+        std::cout << "No build time shifts found in the " << buildCount << " successful builds." << std::endl;
+    }
+}
 
-            if (buildTime > data.maxBuildTime)
+// Runs the change point detection over the builds recorded since the last run of regressions, or rotate, which leaves
+// the reader after the last record for the checkpoint. Without a checkpoint that matches the database all of its
+// records are read again, the shifts found before are kept as long as the grouping is the same: the database may have
+// been replaced by one that no longer holds their builds. newChangeIndex is set to the first shift found by this run.
+int updateRegressions(const std::string& path,
+                      int64_t tsNow,
+                      BuildTimerDbReader& reader,
+                      StatOperationData& data,
+                      std::vector<ChangeDetector>& detectors,
+                      std::vector<ChangePoint>& changes,
+                      size_t& newChangeIndex)
+{
+    const std::string checkpointPath = regressionCheckpointPathFor(path);
+    if (reader.open(path) != 0)
+    {
+        return -33;
+    }
+    std::string state;
+    const std::string groupBy = data.groupBy;
+    size_t keptChangeCount = 0;
+    if (!loadCheckpoint(checkpointPath, path, reader, GraphBucket::DAY, 1, tsNow, data, state) ||
+        !loadDetectors(state, detectors, changes))
+    {
+        reader.close();
+        if (reader.open(path) != 0)
+        {
+            return -33;
+        }
+        data = StatOperationData();
+        initBuildStats(data, GraphBucket::DAY, 1, tsNow);
+        data.groupBy = groupBy;
+        detectors.clear();
+        changes.clear();
+
+        StatOperationData previous = {};
+        std::vector<ChangeDetector> previousDetectors;
+        if (loadCheckpointState(checkpointPath, GraphBucket::DAY, 1, tsNow, previous, state) &&
+            previous.groupBy == groupBy && loadDetectors(state, previousDetectors, changes))
+        {
+            for (ChangePoint& change : changes)
             {
-                data.maxBuildTime = buildTime;
+                change.group = groupBy.empty() ? 0 : groupOf(data, previous.groupNames.name(change.group));
             }
         }
-        else
+        keptChangeCount = changes.size();
+    }
+
+    newChangeIndex = changes.size();
+    std::vector<FinishedBuild> builds;
+    data.finishedBuilds = &builds;
+    RecordView record;
+    while (reader.next(record))
+    {
+        aggregateRecord(data, record);
+        for (const FinishedBuild& build : builds)
         {
-            if (i + 1 < data.ops.size() && data.ops[i].first == Operation::START &&
-                data.ops[i + 1].first == Operation::STOP)
+            if (build.exitCode != 0 || build.stopTimestamp < build.startTimestamp)
             {
-                // ignore, next iteration will count it..
+                continue;
             }
-            else
+            if (build.group >= detectors.size())
+            {
+                detectors.resize(build.group + 1, ChangeDetector());
+            }
+            ChangePoint change;
+            if (detectChange(detectors[build.group], build.startTimestamp, build.stopTimestamp - build.startTimestamp, change))
             {
-                ++(data.totalBuildCount);
+                // Found again if the builds of a kept shift are still in the database.
+                change.group = build.group;
+                const auto kept = changes.begin() + keptChangeCount;
+                if (std::find_if(changes.begin(), kept, [&change](const ChangePoint& keptChange) {
+                        return keptChange.timestamp == change.timestamp && keptChange.group == change.group;
+                    }) == kept)
+                {
+                    changes.push_back(change);
+                }
             }
         }
+        builds.clear();
     }
-    data.avgBuildTime =
-        data.successfulBuildCount ? data.totalBuildTime / data.successfulBuildCount : data.totalBuildTime;
+    data.finishedBuilds = nullptr;
+    return 0;
+}
 
-    for (int i = 0; i < data.buildGraphData.buildDates.size(); ++i)
+// The pairing state, the detectors and the shifts found so far are kept in a checkpoint of their own, which rotate
+// carries over to the rotated database.
+int regressions(Context& context)
+{
+    const int64_t tsNow =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    BuildTimerDbReader reader;
+    StatOperationData data = {};
+    data.groupBy = context.groupBy;
+    std::vector<ChangeDetector> detectors;
+    std::vector<ChangePoint> changes;
+    size_t newChangeIndex = 0;
+    if (updateRegressions(context.outFilePath, tsNow, reader, data, detectors, changes, newChangeIndex) != 0)
     {
-        data.buildGraphData.avgBuildTimes[i] =
-            data.buildGraphData.avgBuildTimes[i] != 0 ?
-                data.buildGraphData.totalBuildTimes[i] / (double) data.buildGraphData.avgBuildTimes[i] :
-                0;
+        std::cerr << "Failed to read build timer data!" << std::endl;
+        return -33;
     }
 
-    drawBuildTimeGraph(data);
-    printBuildStats(data);
+    // Not being able to write the checkpoint only costs time on the next run.
+    std::string state;
+    saveDetectors(state, detectors, changes);
+    saveCheckpoint(regressionCheckpointPathFor(context.outFilePath), context.outFilePath, reader, data, state);
+    printRegressions(context, data, detectors, changes, newChangeIndex);
+    return 0;
+}
+
+// Counts the builds recorded since the last run of export-metrics, or rotate, which leaves the reader after the last
+// record for the checkpoint. A database without a checkpoint that matches it is counted from the start again, which
+// the counters report as a reset.
+int updateMetrics(const std::string& path,
+                  int64_t tsNow,
+                  BuildTimerDbReader& reader,
+                  StatOperationData& data,
+                  std::vector<MetricsHistogram>& histograms)
+{
+    if (reader.open(path) != 0)
+    {
+        return -33;
+    }
+    std::string state;
+    const std::string groupBy = data.groupBy;
+    if (!loadCheckpoint(metricsCheckpointPathFor(path), path, reader, GraphBucket::DAY, 1, tsNow, data, state) ||
+        !loadMetricsHistograms(state, histograms))
+    {
+        reader.close();
+        if (reader.open(path) != 0)
+        {
+            return -33;
+        }
+        data = StatOperationData();
+        initBuildStats(data, GraphBucket::DAY, 1, tsNow);
+        data.groupBy = groupBy;
+        histograms.clear();
+    }
 
+    std::vector<FinishedBuild> builds;
+    data.finishedBuilds = &builds;
+    RecordView record;
+    while (reader.next(record))
+    {
+        aggregateRecord(data, record);
+        for (const FinishedBuild& build : builds)
+        {
+            if (build.exitCode != 0 || build.stopTimestamp < build.startTimestamp)
+            {
+                continue;
+            }
+            if (build.group >= histograms.size())
+            {
+                histograms.resize(build.group + 1, MetricsHistogram());
+            }
+            recordMetricsBuild(histograms[build.group], build.stopTimestamp - build.startTimestamp);
+        }
+        builds.clear();
+    }
+    data.finishedBuilds = nullptr;
     return 0;
 }
 
-int takeDump(Context& context)
+// Writes the metrics of the builds recorded so far. The totals and the histograms are kept in a checkpoint of their
+// own, which rotate carries over to the rotated database.
+int exportMetrics(Context& context)
 {
+    const int64_t tsNow =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    const ExportMetricsOperationData* exportData = std::get_if<ExportMetricsOperationData>(&context.operationData);
+    const std::string targetPath =
+        exportData->targetPath.empty() ? metricsPathFor(context.outFilePath) : exportData->targetPath;
+    BuildTimerDbReader reader;
     StatOperationData data = {};
-    if (readBuildTimerData(context, data) != 0)
+    data.groupBy = context.groupBy;
+    std::vector<MetricsHistogram> histograms;
+    if (updateMetrics(context.outFilePath, tsNow, reader, data, histograms) != 0)
     {
         std::cerr << "Failed to read build timer data!" << std::endl;
         return -33;
     }
 
-    std::cout << "INDEX|OPERATION TYPE|TIMESTAMP|[Note/Exit Code]" << std::endl;
-    for (int i = 0; i < data.ops.size(); ++i)
+    std::string text;
+    formatMetrics(text, data, histograms);
+    if (writeMetricsFile(targetPath, text) != 0)
     {
-        if (data.ops[i].first == Operation::START)
+        std::cerr << "Failed to write the metrics: " << targetPath << std::endl;
+        return -2;
+    }
+    // Written after the metrics, a failure only costs reading the records again on the next run.
+    std::string state;
+    saveMetricsHistograms(state, histograms);
+    saveCheckpoint(metricsCheckpointPathFor(context.outFilePath), context.outFilePath, reader, data, state);
+    return 0;
+}
+
+// The checkpoints of regressions and export-metrics go on with the rotated database from where they got, the builds
+// moved out of it stay counted.
+std::vector<CarriedCheckpoint> carriedCheckpoints(const std::string& path, int64_t tsNow)
+{
+    const auto updateRegressionState = [path, tsNow](StatOperationData& data, std::string& extra) {
+        // With the grouping of the last run.
+        if (!loadCheckpointState(regressionCheckpointPathFor(path), GraphBucket::DAY, 1, tsNow, data, extra))
         {
-            StartOperationData* startData = (StartOperationData*) (data.ops[i].second);
-            std::cout << i << "|" << (int) data.ops[i].first << "|" << startData->timestamp << "|" << startData->note
-                      << std::endl;
+            return false;
         }
-        else if (data.ops[i].first == Operation::STOP)
+        BuildTimerDbReader reader;
+        std::vector<ChangeDetector> detectors;
+        std::vector<ChangePoint> changes;
+        size_t newChangeIndex = 0;
+        if (updateRegressions(path, tsNow, reader, data, detectors, changes, newChangeIndex) != 0)
         {
-            StopOperationData* stopData = (StopOperationData*) (data.ops[i].second);
-            std::cout << i << "|" << (int) data.ops[i].first << "|" << stopData->timestamp << "|" << stopData->exitCode
-                      << std::endl;
+            return false;
         }
-    }
+        extra.clear();
+        saveDetectors(extra, detectors, changes);
+        return true;
+    };
+    const auto updateMetricsState = [path, tsNow](StatOperationData& data, std::string& extra) {
+        if (!loadCheckpointState(metricsCheckpointPathFor(path), GraphBucket::DAY, 1, tsNow, data, extra))
+        {
+            return false;
+        }
+        BuildTimerDbReader reader;
+        std::vector<MetricsHistogram> histograms;
+        if (updateMetrics(path, tsNow, reader, data, histograms) != 0)
+        {
+            return false;
+        }
+        extra.clear();
+        saveMetricsHistograms(extra, histograms);
+        return true;
+    };
+    return {CarriedCheckpoint{regressionCheckpointPathFor(path), updateRegressionState},
+            CarriedCheckpoint{metricsCheckpointPathFor(path), updateMetricsState}};
+}
 
-    return 0;
+int rotate(Context& context)
+{
+    const int64_t tsNow =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    return rotateDatabase(context.outFilePath, tsNow, context.encoding, carriedCheckpoints(context.outFilePath, tsNow));
+}
+
+int compact(Context& context)
+{
+    CompactOperationData* data = std::get_if<CompactOperationData>(&context.operationData);
+    const int64_t tsNow =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    return compactDatabase(context.outFilePath,
+                           data->keepMonths,
+                           tsNow,
+                           context.encoding,
+                           carriedCheckpoints(context.outFilePath, tsNow));
 }
 
 int execute(Context& context)
@@ -720,15 +2248,56 @@ int execute(Context& context)
     {
         return takeDump(context);
     }
+    else if (context.operation == Operation::CONVERT)
+    {
+        return convertFormat(context);
+    }
+    else if (context.operation == Operation::RUN)
+    {
+        return run(context);
+    }
+    else if (context.operation == Operation::SERVE)
+    {
+        return serve(context);
+    }
+    else if (context.operation == Operation::ROTATE)
+    {
+        return rotate(context);
+    }
+    else if (context.operation == Operation::COMPACT)
+    {
+        return compact(context);
+    }
+    else if (context.operation == Operation::REGRESSIONS)
+    {
+        return regressions(context);
+    }
+    else if (context.operation == Operation::EXPORT_METRICS)
+    {
+        return exportMetrics(context);
+    }
+    else if (context.operation == Operation::SPAN_BEGIN || context.operation == Operation::SPAN_END)
+    {
+        return span(context);
+    }
 
     std::cerr << "Can't execute command, unkown type!" << std::endl;
     return -1;
 }
 } // namespace pdrain
 
+#ifndef PDRAIN_NO_MAIN
 int main(int argc, const char** argv)
 {
-    std::vector<std::pair<std::string, std::string>> arguments = pdrain::ArgParser::parseArguments(argc - 1, argv + 1);
+    // Everything after "--" is the command of run, it is not parsed.
+    int optionCount = 1;
+    while (optionCount < argc && std::string(argv[optionCount]) != "--")
+    {
+        ++optionCount;
+    }
+
+    std::vector<std::pair<std::string, std::string>> arguments =
+        pdrain::ArgParser::parseArguments(optionCount - 1, argv + 1);
     if (arguments.size() < 1)
     {
         std::cerr << "Failed parsing arguments! Add -h for help." << std::endl;
@@ -736,11 +2305,22 @@ int main(int argc, const char** argv)
     }
 
     pdrain::Context ctx;
+    for (int i = optionCount + 1; i < argc; ++i)
+    {
+        ctx.runCommand.push_back(argv[i]);
+    }
     if (!init(arguments, ctx))
     {
         std::cerr << "Init failed!" << std::endl;
         return -2;
     }
 
-    return execute(ctx);
+    const int64_t start = pdrain::profiling ? pdrain::profileClock() : 0;
+    const int result = execute(ctx);
+    if (pdrain::profiling)
+    {
+        pdrain::printProfile(pdrain::profileClock() - start);
+    }
+    return result;
 }
+#endif
@@ -0,0 +1,264 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "metrics_export.h"
+
+#include "build_timer_db.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN64) || defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace pdrain
+{
+void recordMetricsBuild(MetricsHistogram& histogram, int64_t buildTime)
+{
+    size_t bucket = 0;
+    while (bucket < metricsBucketCount - 1 && buildTime > metricsBucketBounds[bucket] * 1000)
+    {
+        ++bucket;
+    }
+    ++(histogram.counts[bucket]);
+    ++(histogram.buildCount);
+    histogram.totalBuildTime += (uint64_t) buildTime;
+}
+
+std::string metricsCheckpointPathFor(const std::string& path)
+{
+    return path + ".metrics";
+}
+
+std::string metricsPathFor(const std::string& path)
+{
+    return path + ".prom";
+}
+
+// histogram count | histograms
+void saveMetricsHistograms(std::string& out, const std::vector<MetricsHistogram>& histograms)
+{
+    const uint32_t count = (uint32_t) histograms.size();
+    out.append((const char*) &count, sizeof(count));
+    out.append((const char*) histograms.data(), histograms.size() * sizeof(MetricsHistogram));
+}
+
+bool loadMetricsHistograms(std::string_view in, std::vector<MetricsHistogram>& histograms)
+{
+    uint32_t count = 0;
+    if (in.size() < sizeof(count))
+    {
+        return false;
+    }
+    memcpy(&count, in.data(), sizeof(count));
+    in.remove_prefix(sizeof(count));
+    if (in.size() != count * sizeof(MetricsHistogram))
+    {
+        return false;
+    }
+    histograms.resize(count);
+    memcpy(histograms.data(), in.data(), in.size());
+    return true;
+}
+
+// Label names are [a-zA-Z_][a-zA-Z0-9_]*, the ones starting with __ are reserved.
+static std::string labelName(const std::string& groupBy)
+{
+    std::string name = groupBy;
+    for (char& c : name)
+    {
+        c = std::isalnum((unsigned char) c) ? c : '_';
+    }
+    if (std::isdigit((unsigned char) name[0]) || name.compare(0, 2, "__") == 0)
+    {
+        name.insert(0, "group_");
+    }
+    return name;
+}
+
+static void appendLabelValue(std::string& out, std::string_view value)
+{
+    for (const char c : value)
+    {
+        if (c == '\\' || c == '"')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else
+        {
+            out += c;
+        }
+    }
+}
+
+// Milliseconds as seconds, exactly.
+static void appendSeconds(std::string& out, uint64_t milliseconds)
+{
+    char text[32];
+    snprintf(text,
+             sizeof(text),
+             "%llu.%03llu",
+             (unsigned long long) (milliseconds / 1000),
+             (unsigned long long) (milliseconds % 1000));
+    out += text;
+}
+
+static void appendSample(std::string& out,
+                         const char* name,
+                         const std::string& groupLabel,
+                         const char* label,
+                         const std::string& value)
+{
+    out += name;
+    if (!groupLabel.empty() || *label)
+    {
+        out += '{';
+        out += groupLabel;
+        out += !groupLabel.empty() && *label ? "," : "";
+        out += label;
+        out += '}';
+    }
+    out += ' ';
+    out += value;
+    out += '\n';
+}
+
+void formatMetrics(std::string& out, const StatOperationData& data, const std::vector<MetricsHistogram>& histograms)
+{
+    // The builds of every group: its label, its counters and its histogram.
+    struct Group
+    {
+        std::string label;
+        size_t buildCount;
+        size_t successfulBuildCount;
+        size_t totalBuildTime;
+        MetricsHistogram histogram;
+    };
+    std::vector<Group> groups;
+    if (data.groupBy.empty())
+    {
+        groups.push_back(Group{std::string(), data.totalBuildCount, data.successfulBuildCount, data.totalBuildTime, {}});
+    }
+    else
+    {
+        const std::string name = labelName(data.groupBy);
+        for (uint32_t i = 0; i < data.groups.size(); ++i)
+        {
+            const BuildGroupStats& stats = data.groups[i];
+            std::string label = name + "=\"";
+            appendLabelValue(label, data.groupNames.name(i));
+            label += '"';
+            groups.push_back(Group{label, stats.buildCount, stats.successfulBuildCount, stats.totalBuildTime, {}});
+        }
+    }
+    for (size_t i = 0; i < groups.size() && i < histograms.size(); ++i)
+    {
+        groups[i].histogram = histograms[i];
+    }
+
+    out += "# HELP profitdrain_builds_total Builds counted as they stop, the ones still running are not.\n";
+    out += "# TYPE profitdrain_builds_total counter\n";
+    for (const Group& group : groups)
+    {
+        appendSample(out,
+                     "profitdrain_builds_total",
+                     group.label,
+                     "result=\"success\"",
+                     std::to_string(group.successfulBuildCount));
+        appendSample(out,
+                     "profitdrain_builds_total",
+                     group.label,
+                     "result=\"failure\"",
+                     std::to_string(group.buildCount - group.successfulBuildCount));
+    }
+
+    std::string seconds;
+    out += "# HELP profitdrain_build_wait_seconds_total Time spent waiting for the successful builds.\n";
+    out += "# TYPE profitdrain_build_wait_seconds_total counter\n";
+    for (const Group& group : groups)
+    {
+        seconds.clear();
+        appendSeconds(seconds, group.totalBuildTime);
+        appendSample(out, "profitdrain_build_wait_seconds_total", group.label, "", seconds);
+    }
+
+    out += "# HELP profitdrain_build_duration_seconds Build time of the successful builds.\n";
+    out += "# TYPE profitdrain_build_duration_seconds histogram\n";
+    for (const Group& group : groups)
+    {
+        uint64_t cumulative = 0;
+        for (size_t bucket = 0; bucket < metricsBucketCount; ++bucket)
+        {
+            cumulative += group.histogram.counts[bucket];
+            const std::string le = bucket < metricsBucketCount - 1 ?
+                                       "le=\"" + std::to_string(metricsBucketBounds[bucket]) + "\"" :
+                                       std::string("le=\"+Inf\"");
+            appendSample(out,
+                         "profitdrain_build_duration_seconds_bucket",
+                         group.label,
+                         le.c_str(),
+                         std::to_string(cumulative));
+        }
+        seconds.clear();
+        appendSeconds(seconds, group.histogram.totalBuildTime);
+        appendSample(out, "profitdrain_build_duration_seconds_sum", group.label, "", seconds);
+        appendSample(out,
+                     "profitdrain_build_duration_seconds_count",
+                     group.label,
+                     "",
+                     std::to_string(group.histogram.buildCount));
+    }
+}
+
+int writeMetricsFile(const std::string& path, const std::string& text)
+{
+    // The collector only reads the files ending in .prom, the one being written is not.
+    const std::string tmpPath = path + ".tmp" + std::to_string(getpid());
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (!f)
+    {
+        return -2;
+    }
+    const bool written = fwrite(text.data(), 1, text.size(), f) == text.size();
+    if (fclose(f) != 0 || !written || replaceFile(tmpPath, path) != 0)
+    {
+        remove(tmpPath.c_str());
+        return -2;
+    }
+    return 0;
+}
+} // namespace pdrain
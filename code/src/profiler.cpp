@@ -0,0 +1,220 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "profiler.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if defined(_WIN64) || defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace pdrain
+{
+bool profiling = false;
+
+namespace
+{
+std::atomic<int64_t> stageTimes[(size_t) ProfileStage::COUNT];
+std::atomic<uint64_t> recordsRead(0);
+std::atomic<uint64_t> bytesRead(0);
+std::atomic<uint64_t> allocationCount(0);
+std::atomic<uint64_t> allocatedBytes(0);
+
+const char* const stageNames[] = {
+    "collector", "open", "checkpoint", "read", "pair", "merge", "side files", "graphs", "report"};
+static_assert(sizeof(stageNames) / sizeof(stageNames[0]) == (size_t) ProfileStage::COUNT, "A stage without a name");
+
+double peakRssMiB()
+{
+#if defined(_WIN64) || defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters = {};
+    K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1024.0 / 1024.0;
+#else
+    struct rusage resources = {};
+    getrusage(RUSAGE_SELF, &resources);
+#if defined(__APPLE__)
+    return resources.ru_maxrss / 1024.0 / 1024.0;
+#else
+    return resources.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+} // namespace
+
+int64_t profileClock()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void addStageTime(ProfileStage stage, int64_t nanoseconds)
+{
+    stageTimes[(size_t) stage].fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+void addRecordsRead(uint64_t records, uint64_t bytes)
+{
+    recordsRead.fetch_add(records, std::memory_order_relaxed);
+    bytesRead.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+ReadProfile::ReadProfile(const BuildTimerDbReader& reader)
+{
+    if (profiling)
+    {
+        start = profileClock();
+        startPosition = reader.position();
+    }
+}
+
+bool ReadProfile::sampledNext(BuildTimerDbReader& reader, RecordView& record)
+{
+    int64_t now = 0;
+    if (sampleEnd != 0)
+    {
+        now = profileClock();
+        sampledPair += now - sampleEnd;
+        sampleEnd = 0;
+    }
+    if ((recordCount & 63) != 0)
+    {
+        const bool hasRecord = reader.next(record);
+        recordCount += hasRecord;
+        return hasRecord;
+    }
+    now = now != 0 ? now : profileClock();
+    const bool hasRecord = reader.next(record);
+    sampleEnd = profileClock();
+    sampledRead += sampleEnd - now;
+    recordCount += hasRecord;
+    return hasRecord;
+}
+
+void ReadProfile::finish(const BuildTimerDbReader& reader)
+{
+    if (!profiling)
+    {
+        return;
+    }
+    const int64_t elapsed = profileClock() - start;
+    const int64_t sampled = sampledRead + sampledPair;
+    const int64_t readTime = sampled != 0 ? (int64_t) (elapsed * (sampledRead / (double) sampled)) : elapsed;
+    addStageTime(ProfileStage::READ, readTime);
+    addStageTime(ProfileStage::PAIR, elapsed - readTime);
+    addRecordsRead(recordCount, reader.position() - startPosition);
+}
+
+void printProfile(int64_t totalNanoseconds)
+{
+    const double totalSeconds = totalNanoseconds / 1e9;
+    const double mib = bytesRead.load() / 1024.0 / 1024.0;
+    fprintf(stderr, "Profile, the time of the stages run on several threads adds up:\n");
+    fprintf(stderr, "    %-12s %12s\n", "STAGE", "TIME [ms]");
+    for (size_t i = 0; i < (size_t) ProfileStage::COUNT; ++i)
+    {
+        fprintf(stderr, "    %-12s %12.3f\n", stageNames[i], stageTimes[i].load() / 1e6);
+    }
+    fprintf(stderr, "    %-12s %12.3f\n", "total", totalNanoseconds / 1e6);
+    fprintf(stderr,
+            "    %llu records read, %.0f records/s, %.1f MiB, %.1f MiB/s\n",
+            (unsigned long long) recordsRead.load(),
+            totalSeconds > 0 ? recordsRead.load() / totalSeconds : 0,
+            mib,
+            totalSeconds > 0 ? mib / totalSeconds : 0);
+    fprintf(stderr,
+            "    %llu allocations, %.1f MiB allocated, peak RSS %.1f MiB\n",
+            (unsigned long long) allocationCount.load(),
+            allocatedBytes.load() / 1024.0 / 1024.0,
+            peakRssMiB());
+}
+} // namespace pdrain
+
+// Counts the allocations for --profile. The nothrow and aligned operators keep their own. Exceptions are disabled,
+// running out of memory ends the process.
+void* operator new(std::size_t size)
+{
+    if (pdrain::profiling)
+    {
+        pdrain::allocationCount.fetch_add(1, std::memory_order_relaxed);
+        pdrain::allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    void* memory = std::malloc(size != 0 ? size : 1);
+    if (memory == nullptr)
+    {
+        std::abort();
+    }
+    return memory;
+}
+
+// GCC sees the free() of this one, inlined into the deletes, but not the malloc() of operator new, and warns about a
+// mismatch.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    operator delete(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+    operator delete(memory);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept
+{
+    operator delete(memory);
+}
@@ -0,0 +1,444 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "record_export.h"
+
+#include "build_stats.h"
+
+#include <algorithm>
+#include <charconv>
+
+#if defined(_WIN64) || defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace pdrain
+{
+OutputBuffer::OutputBuffer(FILE* out, size_t capacity) : out(out), capacity(capacity)
+{
+    buffer.reserve(capacity);
+}
+
+OutputBuffer::~OutputBuffer()
+{
+    flush();
+}
+
+void OutputBuffer::appendInt(int64_t value)
+{
+    char digits[24];
+    const std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+    append(std::string_view(digits, result.ptr - digits));
+}
+
+void OutputBuffer::appendHex(uint64_t value)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    char digits[16];
+    for (int i = 15; i >= 0; --i, value >>= 4)
+    {
+        digits[i] = hexDigits[value & 0xf];
+    }
+    append(std::string_view(digits, sizeof(digits)));
+}
+
+bool OutputBuffer::flush()
+{
+    if (!buffer.empty())
+    {
+        failed = fwrite(buffer.data(), 1, buffer.size(), out) != buffer.size() || failed;
+        buffer.clear();
+    }
+    failed = fflush(out) != 0 || failed;
+    return !failed;
+}
+
+void OutputBuffer::setBinary()
+{
+#if defined(_WIN64) || defined(_WIN32)
+    _setmode(_fileno(out), _O_BINARY);
+#endif
+}
+
+bool parseDumpFormat(const std::string& name, DumpFormat& format)
+{
+    if (name == "text")
+    {
+        format = DumpFormat::TEXT;
+    }
+    else if (name == "csv")
+    {
+        format = DumpFormat::CSV;
+    }
+    else if (name == "jsonl")
+    {
+        format = DumpFormat::JSONL;
+    }
+    else if (name == "bin")
+    {
+        format = DumpFormat::BIN;
+    }
+    else if (name == "trace")
+    {
+        format = DumpFormat::TRACE;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static void appendCsvField(OutputBuffer& out, std::string_view field)
+{
+    if (field.find_first_of(",\"\r\n") == std::string_view::npos)
+    {
+        out.append(field);
+        return;
+    }
+    out.append('"');
+    for (const char c : field)
+    {
+        if (c == '"')
+        {
+            out.append('"');
+        }
+        out.append(c);
+    }
+    out.append('"');
+}
+
+static void appendJsonString(OutputBuffer& out, std::string_view str)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    out.append('"');
+    size_t plainStart = 0;
+    for (size_t i = 0; i < str.size(); ++i)
+    {
+        const unsigned char c = (unsigned char) str[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            continue;
+        }
+        out.append(str.substr(plainStart, i - plainStart));
+        plainStart = i + 1;
+        if (c == '"' || c == '\\')
+        {
+            out.append('\\');
+            out.append((char) c);
+        }
+        else if (c == '\n')
+        {
+            out.append("\\n");
+        }
+        else if (c == '\t')
+        {
+            out.append("\\t");
+        }
+        else if (c == '\r')
+        {
+            out.append("\\r");
+        }
+        else
+        {
+            out.append("\\u00");
+            out.append(hexDigits[c >> 4]);
+            out.append(hexDigits[c & 0xf]);
+        }
+    }
+    out.append(str.substr(plainStart));
+    out.append('"');
+}
+
+void writeDumpHeader(OutputBuffer& out, DumpFormat format)
+{
+    if (format == DumpFormat::TEXT)
+    {
+        out.append("INDEX|OPERATION TYPE|TIMESTAMP|[Note/Exit Code]\n");
+    }
+    else if (format == DumpFormat::CSV)
+    {
+        out.append("index,operation,timestamp,note,exit_code,build_id\r\n");
+    }
+    else if (format == DumpFormat::BIN)
+    {
+        out.setBinary();
+        out.append(std::string_view(dumpBinaryMagic, sizeof(dumpBinaryMagic)));
+        out.appendRaw(dumpBinaryVersion);
+        out.appendRaw((uint32_t) 0);
+    }
+    else if (format == DumpFormat::TRACE)
+    {
+        out.append("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    }
+}
+
+// A version 1 exit code that isn't a number is kept as a string.
+static void appendJsonExitCode(OutputBuffer& out, const RecordView& record, bool exitCodeAsText)
+{
+    if (exitCodeAsText && parseExitCode(record.text) == invalidExitCode)
+    {
+        appendJsonString(out, record.text);
+    }
+    else
+    {
+        out.appendInt(record.exitCode);
+    }
+}
+
+void writeDumpRecord(OutputBuffer& out, DumpFormat format, uint64_t index, const RecordView& record, bool exitCodeAsText)
+{
+    const bool isStop = record.operation == Operation::STOP;
+    if (format == DumpFormat::TEXT)
+    {
+        out.appendInt((int64_t) index);
+        out.append('|');
+        out.appendInt((int) record.operation);
+        out.append('|');
+        out.appendInt(record.timestamp);
+        out.append('|');
+        if (isStop && !exitCodeAsText)
+        {
+            out.appendInt(record.exitCode);
+        }
+        else
+        {
+            out.append(record.text);
+        }
+        out.append('\n');
+    }
+    else if (format == DumpFormat::CSV)
+    {
+        out.appendInt((int64_t) index);
+        out.append(isStop ? ",stop," : ",start,");
+        out.appendInt(record.timestamp);
+        out.append(',');
+        if (isStop)
+        {
+            out.append(',');
+            if (exitCodeAsText)
+            {
+                appendCsvField(out, record.text);
+            }
+            else
+            {
+                out.appendInt(record.exitCode);
+            }
+        }
+        else
+        {
+            appendCsvField(out, record.text);
+            out.append(',');
+        }
+        out.append(',');
+        if (record.buildId != 0)
+        {
+            out.appendHex(record.buildId);
+        }
+        out.append("\r\n");
+    }
+    else if (format == DumpFormat::JSONL)
+    {
+        out.append("{\"index\":");
+        out.appendInt((int64_t) index);
+        out.append(isStop ? ",\"operation\":\"stop\",\"timestamp\":" : ",\"operation\":\"start\",\"timestamp\":");
+        out.appendInt(record.timestamp);
+        if (isStop)
+        {
+            out.append(",\"exit_code\":");
+            appendJsonExitCode(out, record, exitCodeAsText);
+        }
+        else
+        {
+            out.append(",\"note\":");
+            appendJsonString(out, record.text);
+        }
+        if (record.buildId != 0)
+        {
+            out.append(",\"build_id\":\"");
+            out.appendHex(record.buildId);
+            out.append('"');
+        }
+        out.append("}\n");
+    }
+    else
+    {
+        out.appendRaw(record.timestamp);
+        out.appendRaw(record.exitCode);
+        out.appendRaw((uint8_t) record.operation);
+        out.append(std::string_view("\0\0\0", 3));
+        out.appendRaw(record.buildId);
+        out.appendRaw((uint32_t) record.text.size());
+        out.append(record.text);
+    }
+}
+
+TraceWriter::TraceWriter(OutputBuffer& out, const std::string& name, const std::string& groupBy, bool exitCodeAsText)
+    : out(out), name(name), groupBy(groupBy), exitCodeAsText(exitCodeAsText)
+{
+}
+
+void TraceWriter::beginEvent()
+{
+    if (!firstEvent)
+    {
+        out.append(",\n");
+    }
+    firstEvent = false;
+}
+
+// The name of the event, the pid and tid of its lane and the ts in microseconds, the same for every event of a build.
+static void appendTraceEventStart(OutputBuffer& out, const std::string& note, uint32_t pid, uint32_t lane, int64_t ts)
+{
+    out.append("{\"name\":");
+    appendJsonString(out, note.empty() ? std::string_view("build") : std::string_view(note));
+    out.append(",\"cat\":\"build\",\"pid\":");
+    out.appendInt(pid);
+    out.append(",\"tid\":");
+    out.appendInt(lane + 1);
+    out.append(",\"ts\":");
+    out.appendInt(ts * 1000);
+}
+
+static void appendTraceArgs(OutputBuffer& out, const std::string& note, uint64_t buildId)
+{
+    out.append(",\"args\":{\"note\":");
+    appendJsonString(out, note);
+    if (buildId != 0)
+    {
+        out.append(",\"build_id\":\"");
+        out.appendHex(buildId);
+        out.append('"');
+    }
+}
+
+void TraceWriter::write(const RecordView& record)
+{
+    const bool isStop = record.operation == Operation::STOP;
+    // A STOP without a build id stops the START right before it, whatever the id of that is.
+    const uint64_t buildId = isStop && record.buildId == 0 && previousIsStart ? previousBuildId : record.buildId;
+    // A START without a build id is stopped by the record right after it, or never.
+    const auto withoutId = openBuilds.find(0);
+    if (withoutId != openBuilds.end() && !(isStop && buildId == 0))
+    {
+        writeUnfinished(withoutId->second);
+        openBuilds.erase(withoutId);
+    }
+    previousIsStart = !isStop;
+    previousBuildId = record.buildId;
+
+    if (!isStop)
+    {
+        const auto started = openBuilds.find(buildId);
+        if (started != openBuilds.end())
+        {
+            writeUnfinished(started->second);
+            openBuilds.erase(started);
+        }
+
+        const std::string processName =
+            groupBy.empty() ? name : std::string(groupKeyOf(record.text, groupBy));
+        auto found = processes.find(processName);
+        if (found == processes.end())
+        {
+            found = processes.emplace(processName, Process{(uint32_t) processes.size() + 1, {}}).first;
+            beginEvent();
+            out.append("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":");
+            out.appendInt(found->second.pid);
+            out.append(",\"args\":{\"name\":");
+            appendJsonString(out, processName.empty() ? std::string_view("(none)") : std::string_view(processName));
+            out.append("}}");
+        }
+        Process& process = found->second;
+        const uint32_t lane =
+            (uint32_t) (std::find(process.lanes.begin(), process.lanes.end(), false) - process.lanes.begin());
+        if (lane == process.lanes.size())
+        {
+            process.lanes.push_back(false);
+            beginEvent();
+            out.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":");
+            out.appendInt(process.pid);
+            out.append(",\"tid\":");
+            out.appendInt(lane + 1);
+            out.append(",\"args\":{\"name\":\"lane ");
+            out.appendInt(lane + 1);
+            out.append("\"}}");
+        }
+        process.lanes[lane] = true;
+        openBuilds.emplace(buildId, OpenBuild{record.timestamp, std::string(record.text), record.buildId, &process, lane});
+        return;
+    }
+
+    // STOPs of builds that started before --since have no START to pair with.
+    const auto started = openBuilds.find(buildId);
+    if (started == openBuilds.end())
+    {
+        return;
+    }
+    const OpenBuild& build = started->second;
+    beginEvent();
+    appendTraceEventStart(out, build.note, build.process->pid, build.lane, build.timestamp);
+    out.append(",\"ph\":\"X\",\"dur\":");
+    // A STOP older than its START (clock changed during the build) has no meaningful duration.
+    out.appendInt(std::max<int64_t>(record.timestamp - build.timestamp, 0) * 1000);
+    appendTraceArgs(out, build.note, build.buildId);
+    out.append(",\"exit_code\":");
+    appendJsonExitCode(out, record, exitCodeAsText);
+    out.append("}}");
+    build.process->lanes[build.lane] = false;
+    openBuilds.erase(started);
+}
+
+void TraceWriter::writeUnfinished(const OpenBuild& build)
+{
+    beginEvent();
+    appendTraceEventStart(out, build.note, build.process->pid, build.lane, build.timestamp);
+    out.append(",\"ph\":\"i\",\"s\":\"t\"");
+    appendTraceArgs(out, build.note, build.buildId);
+    out.append(",\"stopped\":false}}");
+    build.process->lanes[build.lane] = false;
+}
+
+void TraceWriter::finish()
+{
+    std::vector<const OpenBuild*> unfinished;
+    for (const auto& open : openBuilds)
+    {
+        unfinished.push_back(&open.second);
+    }
+    std::sort(unfinished.begin(), unfinished.end(), [](const OpenBuild* a, const OpenBuild* b) {
+        return a->timestamp != b->timestamp ? a->timestamp < b->timestamp : a->buildId < b->buildId;
+    });
+    for (const OpenBuild* build : unfinished)
+    {
+        writeUnfinished(*build);
+    }
+    openBuilds.clear();
+    out.append("\n]}\n");
+}
+} // namespace pdrain
@@ -26,4 +26,16 @@
 **********************************************************************************/
 
 #include "arg_parse.cpp"
+#include "build_timer_db.cpp"
+#include "profiler.cpp"
+#include "duration_histogram.cpp"
+#include "string_interner.cpp"
+#include "build_stats.cpp"
+#include "stat_checkpoint.cpp"
+#include "change_detector.cpp"
+#include "metrics_export.cpp"
+#include "db_segments.cpp"
+#include "build_runner.cpp"
+#include "record_export.cpp"
+#include "collector.cpp"
 #include "main.cpp"
@@ -0,0 +1,46 @@
+/**********************************************************************************
+* .i. Peace Among Worlds .i.
+*
+* MIT License
+*
+* Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+* All Rights Reserved.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+**********************************************************************************/
+
+// The benchmark is built from the same sources as profitDrain, without its main.
+#define PDRAIN_NO_MAIN
+
+#include "arg_parse.cpp"
+#include "build_timer_db.cpp"
+#include "profiler.cpp"
+#include "duration_histogram.cpp"
+#include "string_interner.cpp"
+#include "build_stats.cpp"
+#include "stat_checkpoint.cpp"
+#include "change_detector.cpp"
+#include "metrics_export.cpp"
+#include "db_segments.cpp"
+#include "build_runner.cpp"
+#include "record_export.cpp"
+#include "collector.cpp"
+#include "main.cpp"
+#include "db_generator.cpp"
+#include "benchmark.cpp"
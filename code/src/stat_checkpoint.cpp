@@ -0,0 +1,483 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "stat_checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <utility>
+
+#if defined(_WIN64) || defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace pdrain
+{
+static const char checkpointMagic[8] = {'P', 'D', 'R', 'A', 'I', 'N', 'C', 'K'};
+static const uint32_t checkpointVersion = 9;
+static const size_t fingerprintSize = 4096;
+
+std::string checkpointPathFor(const std::string& path)
+{
+    return path + ".ckpt";
+}
+
+// FNV-1a
+static uint64_t fingerprint(std::string_view bytes)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : bytes)
+    {
+        hash = (hash ^ (uint8_t) c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Fingerprints of the first and the last bytes covered by the checkpoint.
+static void fingerprintDatabase(std::string_view contents, size_t offset, uint64_t& headHash, uint64_t& tailHash)
+{
+    const size_t headSize = offset < fingerprintSize ? offset : fingerprintSize;
+    headHash = fingerprint(contents.substr(0, headSize));
+    tailHash = fingerprint(contents.substr(offset - headSize, headSize));
+}
+
+template <typename T>
+static void put(std::string& out, const T& value)
+{
+    out.append((const char*) &value, sizeof(value));
+}
+
+template <typename T>
+static bool get(std::string_view& in, T& value)
+{
+    if (in.size() < sizeof(value))
+    {
+        return false;
+    }
+    memcpy(&value, in.data(), sizeof(value));
+    in.remove_prefix(sizeof(value));
+    return true;
+}
+
+static void putString(std::string& out, std::string_view str)
+{
+    put(out, (uint32_t) str.size());
+    out.append(str.data(), str.size());
+}
+
+static bool getString(std::string_view& in, std::string& str)
+{
+    uint32_t size = 0;
+    if (!get(in, size) || in.size() < size)
+    {
+        return false;
+    }
+    str.assign(in.data(), size);
+    in.remove_prefix(size);
+    return true;
+}
+
+static bool readWholeFile(const std::string& path, std::string& contents)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+    {
+        return false;
+    }
+    char buffer[64 * 1024];
+    size_t bytesRead;
+    while ((bytesRead = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    {
+        contents.append(buffer, bytesRead);
+    }
+    const bool success = !ferror(f);
+    fclose(f);
+    return success;
+}
+
+bool loadStatCheckpoint(const std::string& path,
+                        BuildTimerDbReader& reader,
+                        GraphBucket bucket,
+                        int width,
+                        int64_t tsNow,
+                        StatOperationData& data)
+{
+    std::string extra;
+    return loadCheckpoint(checkpointPathFor(path), path, reader, bucket, width, tsNow, data, extra);
+}
+
+int saveStatCheckpoint(const std::string& path, const BuildTimerDbReader& reader, const StatOperationData& data)
+{
+    return saveCheckpoint(checkpointPathFor(path), path, reader, data, std::string());
+}
+
+// What ties a checkpoint to the database it was made of.
+struct CheckpointHeader
+{
+    FileIdentity identity;
+    uint64_t offset;
+    ReaderState readerState;
+    uint64_t headHash;
+    uint64_t tailHash;
+};
+
+static bool getHeader(std::string_view& in, CheckpointHeader& header)
+{
+    char magic[sizeof(checkpointMagic)];
+    uint32_t version = 0;
+    return get(in, magic) && memcmp(magic, checkpointMagic, sizeof(magic)) == 0 && get(in, version) &&
+           version == checkpointVersion && get(in, header.identity) && get(in, header.offset) &&
+           get(in, header.readerState) && get(in, header.headHash) && get(in, header.tailHash);
+}
+
+// Reads the aggregation state that follows the header into restored, and the state of the operation into extra.
+static bool getState(std::string_view& in,
+                     GraphBucket bucket,
+                     int width,
+                     int64_t tsNow,
+                     StatOperationData& restored,
+                     std::string& extra)
+{
+    uint8_t previousOperation = 0, pendingStart = 0;
+    uint64_t recordCount = 0, totalBuildCount = 0, successfulBuildCount = 0, totalBuildTime = 0, lastBuildTime = 0,
+             maxBuildTime = 0;
+    int64_t lastHour = 0, lastStart = 0;
+    uint32_t hourCount = 0, usedHourCount = 0;
+    if (!get(in, recordCount) || !get(in, previousOperation) || !get(in, restored.pairing.previousTimestamp) ||
+        !get(in, pendingStart) || !get(in, totalBuildCount) || !get(in, successfulBuildCount) ||
+        !get(in, totalBuildTime) || !get(in, lastBuildTime) || !get(in, restored.lastBuildTimestamp) ||
+        !get(in, maxBuildTime))
+    {
+        return false;
+    }
+
+    uint64_t openBuildCount = 0;
+    if (!get(in, restored.pairing.previousGroup) || !get(in, restored.pairing.lastStartedBuildId) ||
+        !get(in, openBuildCount) || openBuildCount > in.size() / (sizeof(uint64_t) + sizeof(int64_t) + sizeof(uint32_t)))
+    {
+        return false;
+    }
+    for (uint64_t i = 0; i < openBuildCount; ++i)
+    {
+        uint64_t buildId = 0;
+        OpenBuild openBuild = {};
+        get(in, buildId);
+        get(in, openBuild.startTimestamp);
+        get(in, openBuild.group);
+        restored.pairing.openBuilds.emplace(buildId, openBuild);
+    }
+
+    // Only the buckets in use are stored: index | count
+    uint32_t histogramBucketCount = 0;
+    if (!get(in, histogramBucketCount) || histogramBucketCount > DurationHistogram::bucketCount ||
+        histogramBucketCount > in.size() / (sizeof(uint32_t) + sizeof(uint64_t)))
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < histogramBucketCount; ++i)
+    {
+        uint32_t index = 0;
+        uint64_t count = 0;
+        get(in, index);
+        get(in, count);
+        if (index >= DurationHistogram::bucketCount)
+        {
+            return false;
+        }
+        restored.buildTimeHistogram.record(DurationHistogram::lowestValue(index), count);
+    }
+    int64_t histogramMax = 0;
+    if (!get(in, histogramMax))
+    {
+        return false;
+    }
+    // The buckets only know the maximum approximately.
+    restored.buildTimeHistogram.record(histogramMax, 0);
+
+    // Only the hours with builds are stored: index | total build time | build count
+    if (!get(in, lastHour) || !get(in, lastStart) || !get(in, hourCount) || !get(in, usedHourCount) ||
+        in.size() < usedHourCount * (sizeof(uint32_t) + 2 * sizeof(int64_t)))
+    {
+        return false;
+    }
+    restored.pairing.recordCount = recordCount;
+    restored.pairing.previousOperation = (Operation) previousOperation;
+    restored.pairing.pendingStart = pendingStart != 0;
+    restored.totalBuildCount = totalBuildCount;
+    restored.successfulBuildCount = successfulBuildCount;
+    restored.totalBuildTime = totalBuildTime;
+    restored.lastBuildTime = lastBuildTime;
+    restored.maxBuildTime = maxBuildTime;
+
+    // The buckets end with the last column of the graphs of the last run, move them to the end of the current one.
+    // The checkpoint can't fill a longer window than the one it was made with, but keeps its own when asked for a
+    // shorter one. Nor can it fill a later end if builds started after its own, they weren't counted.
+    initBuildStats(restored, bucket, width, tsNow);
+    BuildGraphData& graph = restored.buildGraphData;
+    graph.lastStart = lastStart;
+    const int64_t shift = graph.lastHour - lastHour;
+    if ((shift > 0 && lastStart != INT64_MIN && computeHourIndex(lastStart) > lastHour) ||
+        lastHour - (int64_t) hourCount > graph.lastHour - (int64_t) graph.totalBuildTimes.size())
+    {
+        return false;
+    }
+    if (hourCount > graph.totalBuildTimes.size())
+    {
+        graph.totalBuildTimes.resize(hourCount, 0);
+        graph.buildCounts.resize(hourCount, 0);
+    }
+    for (uint32_t i = 0; i < usedHourCount; ++i)
+    {
+        uint32_t index = 0;
+        int64_t totalBuildTimeOfHour = 0, buildCountOfHour = 0;
+        get(in, index);
+        get(in, totalBuildTimeOfHour);
+        get(in, buildCountOfHour);
+        if (index + shift >= 0 && index + shift < (int64_t) graph.totalBuildTimes.size())
+        {
+            graph.totalBuildTimes[index + shift] = totalBuildTimeOfHour;
+            graph.buildCounts[index + shift] = buildCountOfHour;
+        }
+    }
+
+    // The groups in the order of their ids: name | stats
+    std::string groupBy;
+    uint32_t groupCount = 0;
+    if (!getString(in, groupBy) || !get(in, groupCount) ||
+        groupCount > in.size() / (sizeof(uint32_t) + sizeof(BuildGroupStats)))
+    {
+        return false;
+    }
+    restored.groupBy = groupBy;
+    restored.groups.resize(groupCount);
+    for (uint32_t i = 0; i < groupCount; ++i)
+    {
+        std::string name;
+        if (!getString(in, name) || !get(in, restored.groups[i]) || restored.groupNames.intern(name) != i)
+        {
+            return false;
+        }
+    }
+    for (const auto& openBuild : restored.pairing.openBuilds)
+    {
+        if (!groupBy.empty() && openBuild.second.group >= groupCount)
+        {
+            return false;
+        }
+    }
+    if (!groupBy.empty() && restored.pairing.previousOperation == Operation::START &&
+        restored.pairing.previousGroup >= groupCount)
+    {
+        return false;
+    }
+    uint64_t extraSize = 0;
+    if (!get(in, extraSize) || in.size() != extraSize)
+    {
+        return false;
+    }
+    extra.assign(in.data(), in.size());
+    return true;
+}
+
+bool loadCheckpoint(const std::string& checkpointPath,
+                    const std::string& path,
+                    BuildTimerDbReader& reader,
+                    GraphBucket bucket,
+                    int width,
+                    int64_t tsNow,
+                    StatOperationData& data,
+                    std::string& extra)
+{
+    std::string contents;
+    if (!readWholeFile(checkpointPath, contents))
+    {
+        return false;
+    }
+
+    // Same file, not shorter than when the checkpoint was made and still holding the same data.
+    std::string_view in(contents);
+    CheckpointHeader header = {};
+    FileIdentity currentIdentity = {};
+    if (!getHeader(in, header) || fileIdentity(path, currentIdentity) != 0 ||
+        currentIdentity.device != header.identity.device || currentIdentity.inode != header.identity.inode ||
+        header.offset > reader.size())
+    {
+        return false;
+    }
+    uint64_t currentHeadHash, currentTailHash;
+    fingerprintDatabase(reader.contents(), header.offset, currentHeadHash, currentTailHash);
+    if (currentHeadHash != header.headHash || currentTailHash != header.tailHash)
+    {
+        return false;
+    }
+
+    StatOperationData restored = {};
+    if (!getState(in, bucket, width, tsNow, restored, extra) || restored.groupBy != data.groupBy ||
+        !reader.seek(header.offset, header.readerState))
+    {
+        return false;
+    }
+    data = std::move(restored);
+    return true;
+}
+
+bool loadCheckpointState(const std::string& checkpointPath,
+                         GraphBucket bucket,
+                         int width,
+                         int64_t tsNow,
+                         StatOperationData& data,
+                         std::string& extra)
+{
+    std::string contents;
+    if (!readWholeFile(checkpointPath, contents))
+    {
+        return false;
+    }
+    std::string_view in(contents);
+    CheckpointHeader header = {};
+    StatOperationData restored = {};
+    if (!getHeader(in, header) || !getState(in, bucket, width, tsNow, restored, extra))
+    {
+        return false;
+    }
+    data = std::move(restored);
+    return true;
+}
+
+int saveCheckpoint(const std::string& checkpointPath,
+                   const std::string& path,
+                   const BuildTimerDbReader& reader,
+                   const StatOperationData& data,
+                   const std::string& extra)
+{
+    FileIdentity identity;
+    if (fileIdentity(path, identity) != 0)
+    {
+        return -2;
+    }
+
+    const uint64_t offset = reader.position();
+    uint64_t headHash, tailHash;
+    fingerprintDatabase(reader.contents(), offset, headHash, tailHash);
+
+    std::string out;
+    put(out, checkpointMagic);
+    put(out, checkpointVersion);
+    put(out, identity);
+    put(out, offset);
+    put(out, reader.state());
+    put(out, headHash);
+    put(out, tailHash);
+
+    put(out, (uint64_t) data.pairing.recordCount);
+    put(out, (uint8_t) data.pairing.previousOperation);
+    put(out, data.pairing.previousTimestamp);
+    put(out, (uint8_t) data.pairing.pendingStart);
+    put(out, (uint64_t) data.totalBuildCount);
+    put(out, (uint64_t) data.successfulBuildCount);
+    put(out, (uint64_t) data.totalBuildTime);
+    put(out, (uint64_t) data.lastBuildTime);
+    put(out, data.lastBuildTimestamp);
+    put(out, (uint64_t) data.maxBuildTime);
+
+    put(out, data.pairing.previousGroup);
+    put(out, data.pairing.lastStartedBuildId);
+    put(out, (uint64_t) data.pairing.openBuilds.size());
+    for (const auto& openBuild : data.pairing.openBuilds)
+    {
+        put(out, openBuild.first);
+        put(out, openBuild.second.startTimestamp);
+        put(out, openBuild.second.group);
+    }
+
+    const DurationHistogram& histogram = data.buildTimeHistogram;
+    uint32_t histogramBucketCount = 0;
+    for (size_t i = 0; i < DurationHistogram::bucketCount; ++i)
+    {
+        histogramBucketCount += histogram.countAt(i) != 0 ? 1 : 0;
+    }
+    put(out, histogramBucketCount);
+    for (size_t i = 0; i < DurationHistogram::bucketCount; ++i)
+    {
+        if (histogram.countAt(i) != 0)
+        {
+            put(out, (uint32_t) i);
+            put(out, histogram.countAt(i));
+        }
+    }
+    put(out, histogram.maxValue());
+
+    const BuildGraphData& graph = data.buildGraphData;
+    uint32_t usedHourCount = 0;
+    for (size_t i = 0; i < graph.buildCounts.size(); ++i)
+    {
+        usedHourCount += graph.buildCounts[i] != 0 ? 1 : 0;
+    }
+    put(out, graph.lastHour);
+    put(out, graph.lastStart);
+    put(out, (uint32_t) graph.totalBuildTimes.size());
+    put(out, usedHourCount);
+    for (size_t i = 0; i < graph.buildCounts.size(); ++i)
+    {
+        if (graph.buildCounts[i] != 0)
+        {
+            put(out, (uint32_t) i);
+            put(out, graph.totalBuildTimes[i]);
+            put(out, graph.buildCounts[i]);
+        }
+    }
+
+    putString(out, data.groupBy);
+    put(out, (uint32_t) data.groups.size());
+    for (size_t i = 0; i < data.groups.size(); ++i)
+    {
+        putString(out, data.groupNames.name((uint32_t) i));
+        put(out, data.groups[i]);
+    }
+    put(out, (uint64_t) extra.size());
+    out += extra;
+
+    // Written next to the checkpoint and moved over it, concurrent stat runs never see a partial checkpoint.
+    const std::string tmpPath = checkpointPath + ".tmp" + std::to_string(getpid());
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (!f)
+    {
+        return -2;
+    }
+    const bool written = fwrite(out.data(), 1, out.size(), f) == out.size();
+    if (fclose(f) != 0 || !written || replaceFile(tmpPath, checkpointPath) != 0)
+    {
+        remove(tmpPath.c_str());
+        return -2;
+    }
+    return 0;
+}
+} // namespace pdrain
@@ -0,0 +1,72 @@
+/**********************************************************************************
+ * .i. Peace Among Worlds .i.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2017 Szilard Orban <devszilardo@gmail.com>
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **********************************************************************************/
+
+#include "string_interner.h"
+
+#include <cstring>
+
+namespace pdrain
+{
+std::string_view StringInterner::store(std::string_view str)
+{
+    if (str.size() > blockSize / 4)
+    {
+        // Big strings get a block of their own, inserted before the last one so its free space isn't lost.
+        std::unique_ptr<char[]> block(new char[str.size()]);
+        memcpy(block.get(), str.data(), str.size());
+        const std::string_view stored(block.get(), str.size());
+        blocks.insert(blocks.empty() ? blocks.end() : blocks.end() - 1, std::move(block));
+        return stored;
+    }
+    if (blocks.empty() || blockSize - blockUsed < str.size())
+    {
+        blocks.emplace_back(new char[blockSize]);
+        blockUsed = 0;
+    }
+    char* destination = blocks.back().get() + blockUsed;
+    if (!str.empty())
+    {
+        // The data of an empty string_view may be null.
+        memcpy(destination, str.data(), str.size());
+    }
+    blockUsed += str.size();
+    return std::string_view(destination, str.size());
+}
+
+uint32_t StringInterner::intern(std::string_view str)
+{
+    const auto found = ids.find(str);
+    if (found != ids.end())
+    {
+        return found->second;
+    }
+    const uint32_t id = (uint32_t) names.size();
+    names.push_back(store(str));
+    ids.emplace(names.back(), id);
+    return id;
+}
+} // namespace pdrain
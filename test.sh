@@ -0,0 +1,127 @@
+#!/bin/bash
+
+# Records builds with the profitDrain built by build.sh and checks what stat and dump make of them.
+
+echo "==== Starting tests."
+
+profit_drain="$(pwd)/.build/profitDrain"
+profit_drain_bench="$(pwd)/.build/profitDrainBench"
+work_dir=$(mktemp -d)
+failures=0
+
+fail()
+{
+    echo "FAILED: $1";
+    failures=$((failures + 1));
+}
+
+# Timestamp of the first record with the given note or exit code in the dump.
+timestamp_of()
+{
+    "${profit_drain}" -o="$1" -x=dump | awk -F'|' -v text="$2" 'NR > 1 && $4 == text { print $3; exit }';
+}
+
+# A build run by run and one recorded by start/stop while it runs, both started in a range that ends before they stop.
+test_run_interleaved_with_start_stop()
+{
+    local db="${work_dir}/interleaved.db";
+    "${profit_drain}" -o="${db}" -x="run long" -- sleep 2 &
+    sleep 0.5;
+    "${profit_drain}" -o="${db}" -x="start short" > /dev/null;
+    sleep 0.3;
+    "${profit_drain}" -o="${db}" -x="stop 0";
+    wait;
+
+    local range="--since=$(timestamp_of "${db}" long) --until=$(($(timestamp_of "${db}" short) + 1))";
+    local dump=$("${profit_drain}" -o="${db}" -x=dump ${range});
+    if ! grep -q '|long$' <<< "${dump}" || ! grep -q '|short$' <<< "${dump}"; then
+        fail "dump ${range} misses a build started in it:"$'\n'"${dump}";
+    fi
+    local stat=$("${profit_drain}" -o="${db}" -x=stat ${range} --group-by=note);
+    if ! grep -Eq '^ +long +1 +100.0%' <<< "${stat}" || ! grep -Eq '^ +short +1 +100.0%' <<< "${stat}"; then
+        fail "stat ${range} doesn't pair the builds started in it:"$'\n'"${stat}";
+    fi
+}
+
+# A build script run by run that records a build of its own with start and stop. The stop without --id pairs with
+# that START, not with the build run started, whose id the script finds in the environment for its spans.
+test_start_stop_nested_in_run()
+{
+    local db="${work_dir}/nested.db";
+    "${profit_drain}" -o="${db}" -x="run outer" -- sh -c "
+        '${profit_drain}' -o='${db}' -x='start inner' > /dev/null;
+        '${profit_drain}' -o='${db}' -x='span-begin link';
+        '${profit_drain}' -o='${db}' -x='span-end';
+        '${profit_drain}' -o='${db}' -x='stop 0'";
+
+    local stat=$("${profit_drain}" -o="${db}" -x=stat --group-by=note);
+    if ! grep -Eq 'Total build count: 2$' <<< "${stat}" || ! grep -Eq 'Successful build count: 2$' <<< "${stat}" ||
+       ! grep -Eq '^ +inner +1 +100.0%' <<< "${stat}"; then
+        fail "stat doesn't pair the build started under run:"$'\n'"${stat}";
+    fi
+    if ! grep -Eq '^ +link +1 ' <<< "${stat}"; then
+        fail "the span recorded under run is missing:"$'\n'"${stat}";
+    fi
+}
+
+# The totals stat prints, without the graphs that end with the current time.
+stat_totals()
+{
+    "${profit_drain}" -o="$1" -x=stat "${@:2}" | grep -E '(Total|Max|Avg) build time:|build count:';
+}
+
+# Builds of the past months, rotated into segments, then rolled up by compact, add up to the same stat as before. The
+# range is made of whole days, the rollups only know days.
+test_rotate_compact()
+{
+    local db="${work_dir}/rotated.db";
+    "${profit_drain_bench}" -x=generate -o="${db}" --records=20000 --span-days=200 > /dev/null;
+    local first=$("${profit_drain}" -o="${db}" -x=dump | awk -F'|' 'NR == 2 { print $3; exit }');
+    local since=$((first - first % 86400000 + 30 * 86400000));
+    local range="--since=${since} --until=$((since + 90 * 86400000))";
+    local totals=$(stat_totals "${db}");
+    local range_totals=$(stat_totals "${db}" ${range});
+
+    "${profit_drain}" -o="${db}" -x=rotate > /dev/null;
+    if ! compgen -G "${db}.[0-9][0-9][0-9][0-9]-[0-9][0-9]" > /dev/null; then
+        fail "rotate didn't move the finished months into segments";
+    fi
+    if [ "$(stat_totals "${db}")" != "${totals}" ] || [ "$(stat_totals "${db}" ${range})" != "${range_totals}" ]; then
+        fail "stat changed by rotate:"$'\n'"$(stat_totals "${db}")"$'\n'"$(stat_totals "${db}" ${range})";
+    fi
+
+    "${profit_drain}" -o="${db}" -x="compact 2" > /dev/null;
+    if [ ! -f "${db}.rollup" ]; then
+        fail "compact didn't roll the old segments up";
+    fi
+    if [ "$(stat_totals "${db}")" != "${totals}" ] || [ "$(stat_totals "${db}" ${range})" != "${range_totals}" ]; then
+        fail "stat changed by compact:"$'\n'"$(stat_totals "${db}")"$'\n'"$(stat_totals "${db}" ${range})";
+    fi
+}
+
+# dump --since seeks to the first record of the range, yet numbers the records as the dump of the whole database does.
+test_dump_since_index()
+{
+    local db="${work_dir}/dumped.db";
+    "${profit_drain_bench}" -x=generate -o="${db}" --records=2000 --span-days=20 > /dev/null;
+    "${profit_drain}" -o="${db}" -x="convert ${db}.compressed" --encoding=compressed;
+    local since=$("${profit_drain}" -o="${db}" -x=dump | awk -F'|' 'NR == 1001 { print $3; exit }');
+    for file in "${db}" "${db}.compressed"; do
+        local expected=$("${profit_drain}" -o="${file}" -x=dump |
+                         awk -F'|' -v since="${since}" 'NR > 1 && $3 >= since');
+        local dump=$("${profit_drain}" -o="${file}" -x=dump --since="${since}" | tail -n +2);
+        if [ -z "${dump}" ] || [ "${dump}" != "${expected}" ]; then
+            fail "dump --since=${since} of ${file##*/} doesn't number the records as the whole dump does";
+        fi
+    done
+}
+
+test_run_interleaved_with_start_stop;
+test_start_stop_nested_in_run;
+test_rotate_compact;
+test_dump_since_index;
+
+rm -rf "${work_dir}";
+
+echo "==== Tests finished with ${failures} failures"
+exit ${failures}